@@ -0,0 +1,70 @@
+#!/bin/bash
+
+# Copyright 2015 Google Inc. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Time each benchmark with one or more jsonnet binaries, e.g. to compare builds:
+#
+#     ./run_benchmarks.sh ../jsonnet /tmp/jsonnet-nan-boxing
+#
+# Each benchmark is run RUNS times per binary and the best wall-clock time is reported.
+#
+# As well as the bench.*.jsonnet files, a large program is generated (about 1M AST nodes, mostly
+# in one local with LARGE_BINDS bindings) to time parsing and static analysis.
+
+RUNS=${RUNS:-5}
+LARGE_BINDS=${LARGE_BINDS:-20000}
+
+if [ $# -eq 0 ] ; then
+    set -- ../jsonnet
+fi
+
+cd "$(dirname "$0")"
+
+LARGE=$(mktemp --suffix=.large.jsonnet)
+trap 'rm -f "$LARGE"' EXIT
+awk -v n=$LARGE_BINDS 'BEGIN {
+    print "local v0 = { a: 0, b: [], f(x): x },"
+    for (i = 1; i <= n; i++) {
+        p = int(i / 2)
+        printf "      v%d = { a: v%d.a + 1, b: [v%d.a, %d, \"s%d\"], ", i, p, p, i, i
+        printf "f(x): if x > %d then v%d.f(x - 1) else x * 2, ", i, p
+        printf "local l = self.a, c: { d: l, e: [y + %d for y in [1, 2, 3]] } }%s\n", i, (i == n ? ";" : ",")
+    }
+    printf "[v%d.a, v%d.f(3), v%d.c.e]\n", n, n, n
+}' > "$LARGE"
+
+printf "%-24s" "benchmark"
+for BIN in "$@" ; do
+    printf " %20s" "$(basename "$BIN")"
+done
+echo
+
+for BENCH in bench.*.jsonnet "$LARGE" ; do
+    printf "%-24s" "$(basename "$BENCH" | sed 's/^tmp\.[^.]*\.//')"
+    for BIN in "$@" ; do
+        BEST=""
+        for ((i = 0 ; i < RUNS ; i++)) ; do
+            START=$(date +%s%N)
+            "$BIN" "$BENCH" > /dev/null || exit 1
+            END=$(date +%s%N)
+            T=$(( (END - START) / 1000000 ))
+            if [ -z "$BEST" ] || [ $T -lt $BEST ] ; then
+                BEST=$T
+            fi
+        done
+        printf " %18dms" "$BEST"
+    done
+    echo
+done
@@ -14,6 +14,8 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+#include <cerrno>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <cassert>
@@ -23,104 +25,19 @@ limitations under the License.
 #include <iostream>
 #include <map>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 extern "C" {
     #include "core/libjsonnet.h"
 }
 
-struct ImportCallbackContext {
-    JsonnetVm *vm;
-    std::vector<std::string> *jpaths;
-};
-
-enum ImportStatus {
-    IMPORT_STATUS_OK,
-    IMPORT_STATUS_FILE_NOT_FOUND,
-    IMPORT_STATUS_IO_ERROR
-};
-
-static enum ImportStatus try_path(const std::string &dir, const std::string &rel,
-                                  std::string &content, std::string &found_here,
-                                  std::string &err_msg)
-{
-    std::string abs_path;
-    if (rel.length() == 0) {
-        err_msg = "The empty string is not a valid filename";
-        return IMPORT_STATUS_IO_ERROR;
-    }
-    // It is possible that rel is actually absolute.
-    if (rel[0] == '/') {
-        abs_path = rel;
-    } else {
-        abs_path = dir + rel;
-    }
-
-    if (abs_path[abs_path.length() - 1] == '/') {
-        err_msg = "Attempted to import a directory";
-        return IMPORT_STATUS_IO_ERROR;
-    }
-
-    std::ifstream f;
-    f.open(abs_path.c_str());
-    if (!f.good()) return IMPORT_STATUS_FILE_NOT_FOUND;
-    try {
-        content.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
-    } catch (const std::ios_base::failure &io_err) {
-        err_msg = io_err.what();
-        return IMPORT_STATUS_IO_ERROR;
-    }
-    if (!f.good()) {
-        err_msg = strerror(errno);
-        return IMPORT_STATUS_IO_ERROR;
-    }
-
-    found_here = abs_path;
-
-    return IMPORT_STATUS_OK;
-}
-
-static char *from_string(JsonnetVm* vm, const std::string &v)
-{
-    char *r = jsonnet_realloc(vm, nullptr, v.length() + 1);
-    std::strcpy(r, v.c_str());
-    return r;
-}
-
-static char *import_callback(void *ctx_, const char *dir, const char *file,
-                             char **found_here_cptr, int *success)
-{
-    const auto &ctx = *static_cast<ImportCallbackContext*>(ctx_);
-
-    std::string input, found_here, err_msg;
-
-    ImportStatus status = try_path(dir, file, input, found_here, err_msg);
-
-    std::vector<std::string> jpaths(*ctx.jpaths);
-
-    // If not found, try library search path.
-    while (status == IMPORT_STATUS_FILE_NOT_FOUND) {
-        if (jpaths.size() == 0) {
-            *success = 0;
-            const char *err = "No match locally or in the Jsonnet library path.";
-            char *r = jsonnet_realloc(ctx.vm, nullptr, std::strlen(err) + 1);
-            std::strcpy(r, err);
-            return r;
-        }
-        status = try_path(jpaths.back(), file, input, found_here, err_msg);
-        jpaths.pop_back();
-    }
-
-    if (status == IMPORT_STATUS_IO_ERROR) {
-        *success = 0;
-        return from_string(ctx.vm, err_msg);
-    } else {
-        assert(status == IMPORT_STATUS_OK);
-        *success = 1;
-        *found_here_cptr = from_string(ctx.vm, found_here);
-        return from_string(ctx.vm, input);
-    }
-}
+#include "core/hash.h"
+#include "core/parse_cache.h"
 
 std::string next_arg(unsigned &i, const std::vector<std::string> &args)
 {
@@ -179,11 +96,15 @@ void usage(std::ostream &o)
     o << "  -o / --output-file <file> Write to the output file rather than stdout\n";
     o << "  -m / --multi <dir>      Write multiple files to the directory, list files on stdout\n";
     o << "  -S / --string           Expect a string, manifest as plain text\n";
+    o << "  --compat-numbers        Output numbers with all 17 digits, as earlier versions did\n";
     o << "  -s / --max-stack <n>    Number of allowed stack frames\n";
     o << "  -t / --max-trace <n>    Max length of stack trace before cropping\n";
+    o << "  --import-threads <n>    Threads for loading imports ahead of time, 0 for none\n";
+    o << "  --cache-dir <dir>       Keep parsed files and outputs here to reuse in later runs\n";
     o << "  --gc-min-objects <n>    Do not run garbage collector until this many\n";
     o << "  --gc-growth-trigger <n> Run garbage collector after this amount of object growth\n";
-    o << "  --debug-ast             Unparse the parsed AST without executing it\n\n";
+    o << "  --debug-ast             Unparse the parsed AST without executing it\n";
+    o << "  --debug-folded-ast      As --debug-ast but after constant folding\n\n";
     o << "  --version               Print version\n";
     o << "Multichar options are expanded e.g. -abc becomes -a -b -c.\n";
     o << "The -- option suppresses option processing for subsequent arguments.\n";
@@ -269,6 +190,26 @@ class JsonnetConfig {
         return &jpaths_;
     }
 
+    const std::string& cache_dir() const {
+        return cache_dir_;
+    }
+
+    void set_cache_dir(const std::string& cache_dir) {
+        cache_dir_ = cache_dir;
+    }
+
+    /** Everything on the command line that could change the output, with
+     * each string followed by a \0.
+     */
+    const std::string& settings() const {
+        return settings_;
+    }
+
+    void AddSetting(const std::string& setting) {
+        settings_ += setting;
+        settings_ += '\0';
+    }
+
   private:
     bool filename_is_code_;
     bool multi_;
@@ -276,6 +217,8 @@ class JsonnetConfig {
     std::string output_file_;
     std::string output_dir_;
     std::vector<std::string> jpaths_;
+    std::string cache_dir_;
+    std::string settings_;
 };
 
 /** Parse the command line arguments, configuring the Jsonnet VM context and
@@ -287,6 +230,8 @@ static bool process_args(int argc,
                          JsonnetVm *vm) {
     auto args = simplify_args(argc, argv);
     std::vector<std::string> remaining_args;
+    for (const auto &arg : args)
+        config->AddSetting(arg);
 
     for (unsigned i=0 ; i<args.size() ; ++i) {
         const std::string &arg = args[i];
@@ -323,6 +268,7 @@ static bool process_args(int argc,
                           << " was undefined." << std::endl;
                 return false;
             }
+            config->AddSetting(val);
             jsonnet_ext_var(vm, var.c_str(), val);
         } else if (arg == "-V" || arg == "--var") {
             const std::string var_val = next_arg(i, args);
@@ -344,6 +290,7 @@ static bool process_args(int argc,
                           << " was undefined." << std::endl;
                 return EXIT_FAILURE;
             }
+            config->AddSetting(val);
             jsonnet_ext_code(vm, var.c_str(), val);
         } else if (arg == "--code-var") {
             const std::string var_val = next_arg(i, args);
@@ -375,6 +322,23 @@ static bool process_args(int argc,
                 return EXIT_FAILURE;
             }
             jsonnet_max_trace(vm, l);
+        } else if (arg == "--import-threads") {
+            long l = strtol_check(next_arg(i, args));
+            if (l < 0) {
+                std::cerr << "ERROR: Invalid --import-threads value: " << l
+                          << std::endl;
+                usage(std::cerr);
+                return false;
+            }
+            jsonnet_import_threads(vm, l);
+        } else if (arg == "--cache-dir") {
+            const std::string dir = next_arg(i, args);
+            if (dir.length() == 0) {
+                std::cerr << "ERROR: --cache-dir argument was empty string" << std::endl;
+                return false;
+            }
+            config->set_cache_dir(dir);
+            jsonnet_cache_dir(vm, dir.c_str());
         } else if (arg == "--gc-growth-trigger") {
             const char *arg = next_arg(i,args).c_str();
             char *ep;
@@ -414,8 +378,12 @@ static bool process_args(int argc,
             config->set_output_file(output_file);
         } else if (arg == "-S" || arg == "--string") {
             jsonnet_string_output(vm, 1);
+        } else if (arg == "--compat-numbers") {
+            jsonnet_compat_numbers(vm, 1);
         } else if (arg == "--debug-ast") {
-            jsonnet_debug_ast(vm, true);
+            jsonnet_debug_ast(vm, 1);
+        } else if (arg == "--debug-folded-ast") {
+            jsonnet_debug_ast(vm, 2);
         } else if (arg == "--") {
             // All subsequent args are not options.
             while ((++i) < args.size())
@@ -475,6 +443,140 @@ static bool read_input(JsonnetConfig* config, std::string* input) {
     return true;
 }
 
+/** The path of the output cache entry for this input and command line.
+ *
+ * The command line does not say where imports were found, so the entry lists
+ * them separately, see read_cached_output.  Relative paths depend on the
+ * working directory, so that is part of the key.  So is the build of Jsonnet,
+ * as for parsed files.  Returns "" if there is no key.
+ */
+static std::string output_cache_path(const JsonnetConfig &config,
+                                     const std::string &input) {
+    char cwd[4096];
+    if (::getcwd(cwd, sizeof cwd) == nullptr
+        || jsonnet_cache_fingerprint().length() == 0)
+        return "";
+    std::string key = jsonnet_cache_fingerprint();
+    key += cwd;
+    key += '\0';
+    key += config.settings();
+    key += config.input_file();
+    key += '\0';
+    key += jsonnet_hash(input);
+    std::string path = config.cache_dir();
+    if (path[path.length() - 1] != '/')
+        path += '/';
+    return path + jsonnet_hash(key) + ".out";
+}
+
+/** The length of an output buffer, including the final \0. */
+static size_t output_length(const char *output, bool multi) {
+    if (!multi)
+        return std::strlen(output) + 1;
+    // Pairs of strings, then an empty string.
+    const char *c = output;
+    while (*c != '\0') {
+        c += std::strlen(c) + 1;
+        c += std::strlen(c) + 1;
+    }
+    return c - output + 1;
+}
+
+/** Whether a file has the given jsonnet_hash, "" meaning the file should not
+ * exist.
+ */
+static bool dependency_unchanged(const std::string &path,
+                                 const std::string &hash) {
+    if (hash.length() == 0) {
+        // As in the default import callback, which tries to open it.
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return true;
+        ::close(fd);
+        return false;
+    }
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+        return false;
+    std::ifstream f(path.c_str(), std::ios::binary);
+    std::string content;
+    content.assign(std::istreambuf_iterator<char>(f),
+                   std::istreambuf_iterator<char>());
+    return f.good() || f.eof() ? jsonnet_hash(content) == hash : false;
+}
+
+/** Return the output recorded in the output cache entry, or nullptr if there
+ * is none, or the files it depended on have changed.
+ *
+ * An entry is the jsonnet_hash of the rest, the output of
+ * jsonnet_dependencies, and then the output of the evaluation.
+ */
+static char *read_cached_output(JsonnetVm *vm, const std::string &path) {
+    std::ifstream f(path.c_str(), std::ios::binary);
+    if (!f.good())
+        return nullptr;
+    std::string entry;
+    entry.assign(std::istreambuf_iterator<char>(f),
+                 std::istreambuf_iterator<char>());
+    if (entry.length() < 33 || entry.back() != '\0'
+        || jsonnet_hash(entry.data() + 32, entry.length() - 32)
+           != entry.substr(0, 32))
+        return nullptr;
+    const char *c = entry.c_str() + 32;
+    const char *end = entry.c_str() + entry.length();
+    while (*c != '\0') {
+        std::string dependency = c;
+        c += dependency.length() + 1;
+        if (c == end)
+            return nullptr;
+        std::string hash = c;
+        c += hash.length() + 1;
+        if (c == end || !dependency_unchanged(dependency, hash))
+            return nullptr;
+    }
+    ++c;
+    if (c == end)
+        return nullptr;
+    size_t length = end - c;
+    char *output = jsonnet_realloc(vm, nullptr, length);
+    std::memcpy(output, c, length);
+    return output;
+}
+
+/** Record the output and what it depended on in the output cache, unless
+ * something goes wrong.  The entry is renamed into place once it is
+ * written, so that other processes never see part of one.
+ */
+static void write_cached_output(JsonnetVm *vm, const JsonnetConfig &config,
+                                const std::string &path, const char *output) {
+    char *dependencies = jsonnet_dependencies(vm);
+    std::string rest(dependencies, output_length(dependencies, true));
+    jsonnet_realloc(vm, dependencies, 0);
+    rest.append(output, output_length(output, config.multi()));
+    std::string entry = jsonnet_hash(rest) + rest;
+
+    if (::mkdir(config.cache_dir().c_str(), 0777) != 0 && errno != EEXIST)
+        return;
+    std::string tmp = path + ".XXXXXX";
+    int fd = ::mkstemp(&tmp[0]);
+    if (fd < 0)
+        return;
+    ::fchmod(fd, 0644);
+    size_t written = 0;
+    while (written < entry.length()) {
+        ssize_t n = ::write(fd, entry.data() + written,
+                            entry.length() - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        written += n;
+    }
+    bool ok = ::close(fd) == 0 && written == entry.length();
+    if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0)
+        ::unlink(tmp.c_str());
+}
+
 /** Writes output files for multiple file output */
 static bool write_multi_output_files(JsonnetVm* vm, char* output,
                                      const std::string& output_dir) {
@@ -564,6 +666,9 @@ int main(int argc, const char **argv)
 {
     try {
         JsonnetVm *vm = jsonnet_make();
+        // Load imports in the background, on as many threads as there are cores, up to 8.
+        unsigned cores = std::thread::hardware_concurrency();
+        jsonnet_import_threads(vm, cores == 0 ? 1 : cores > 8 ? 8 : cores);
         JsonnetConfig config;
         if (!process_args(argc, argv, &config, vm)) {
             return EXIT_FAILURE;
@@ -575,19 +680,31 @@ int main(int argc, const char **argv)
             return EXIT_FAILURE;
         }
 
-        // Set import callbacks for jpaths.
-        ImportCallbackContext import_callback_ctx{vm, config.mutable_jpaths()};
-        jsonnet_import_callback(vm, import_callback, &import_callback_ctx);
+        for (const auto &jpath : config.jpaths())
+            jsonnet_jpath_add(vm, jpath.c_str());
+
+        // With a cache, the output of an earlier run can be used as long as
+        // none of the files it imported have changed.
+        std::string cache_path;
+        char *output = nullptr;
+        int error = 0;
+        if (config.cache_dir().length() > 0) {
+            cache_path = output_cache_path(config, input);
+            if (cache_path.length() > 0)
+                output = read_cached_output(vm, cache_path);
+        }
 
         // Evaluate input Jsonnet and handle any errors from Jsonnet VM.
-        int error;
-        char *output;
-        if (config.multi()) {
-            output = jsonnet_evaluate_snippet_multi(
-                vm, config.input_file().c_str(), input.c_str(), &error);
-        } else {
-            output = jsonnet_evaluate_snippet(
-                vm, config.input_file().c_str(), input.c_str(), &error);
+        if (output == nullptr) {
+            if (config.multi()) {
+                output = jsonnet_evaluate_snippet_multi(
+                    vm, config.input_file().c_str(), input.c_str(), &error);
+            } else {
+                output = jsonnet_evaluate_snippet(
+                    vm, config.input_file().c_str(), input.c_str(), &error);
+            }
+            if (!error && cache_path.length() > 0)
+                write_cached_output(vm, config, cache_path, output);
         }
 
         if (error) {
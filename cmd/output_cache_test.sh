@@ -0,0 +1,69 @@
+#!/bin/bash
+
+# Copyright 2015 Google Inc. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Checks that outputs from --cache-dir are only reused while the imported files, ext vars and
+# flags are all unchanged.  Usage: output_cache_test.sh <path to jsonnet>
+
+JSONNET="$(cd "$(dirname "$1")" && pwd)/$(basename "$1")"
+DIR="$(mktemp -d)"
+trap 'rm -rf "$DIR"' EXIT
+cd "$DIR"
+FAILED=0
+
+mkdir lib out
+echo '{ x: 1 }' > lib/l.libsonnet
+echo 'hello' > data.txt
+cat > main.jsonnet <<'JSONNET'
+local l = import "l.libsonnet";
+{ "a.json": l { s: importstr "data.txt", e: std.extVar("e") }, "b.json": [] }
+JSONNET
+
+# Runs jsonnet with the cache, and checks the content of out/a.json.
+function check {
+    EXPECTED="$1"
+    shift
+    "$JSONNET" --cache-dir cache -J lib -m out/ "$@" main.jsonnet > /dev/null
+    GOT="$(tr -d ' \n' < out/a.json)"
+    if [ "$GOT" != "$EXPECTED" ] ; then
+        echo "Expected $EXPECTED but got $GOT after: $STEP"
+        FAILED=1
+    fi
+}
+
+STEP="first run" check '{"e":"1","s":"hello\n","x":1}' -V e=1
+STEP="same again" check '{"e":"1","s":"hello\n","x":1}' -V e=1
+STEP="ext var" check '{"e":"2","s":"hello\n","x":1}' -V e=2
+echo '{ x: 2 }' > lib/l.libsonnet
+STEP="import changed" check '{"e":"2","s":"hello\n","x":2}' -V e=2
+echo '{ x: 3 }' > l.libsonnet
+STEP="import shadowed" check '{"e":"2","s":"hello\n","x":3}' -V e=2
+rm l.libsonnet
+STEP="shadow removed" check '{"e":"2","s":"hello\n","x":2}' -V e=2
+echo 'bye' > data.txt
+STEP="importstr changed" check '{"e":"2","s":"bye\n","x":2}' -V e=2
+STEP="flag" check '{"e":"2","s":"bye\n","x":2}' -V e=2 --max-stack 100
+
+# Errors are never cached.
+"$JSONNET" --cache-dir cache -e 'error "x"' > /dev/null 2>&1
+if "$JSONNET" --cache-dir cache -e 'error "x"' > /dev/null 2>&1 ; then
+    echo "An error was cached"
+    FAILED=1
+fi
+
+if [ $FAILED -eq 0 ] ; then
+    echo "The output cache works."
+fi
+exit $FAILED
@@ -17,11 +17,17 @@ limitations under the License.
 #ifndef JSONNET_AST_H
 #define JSONNET_AST_H
 
+#include <cstdint>
 #include <cstdlib>
 
 #include <iostream>
+#include <list>
 #include <string>
 #include <map>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "core/lexer.h"
@@ -118,7 +124,7 @@ struct Array : public AST {
     { }
 };
 
-/** Represents array constructors [1, 2, 3]. */
+/** Represents array comprehensions [e for x in a if c ...], evaluated directly by the VM. */
 struct ArrayComprehension : public AST {
     AST* body;
     std::vector<ComprehensionSpec> specs;
@@ -233,6 +239,8 @@ struct Error : public AST {
 struct Function : public AST {
     std::vector<const Identifier*> parameters;
     AST *body;
+    /** Whether each parameter is always forced by the body.  \see jsonnet_strictness_analysis */
+    std::vector<bool> strictParams;
     Function(const LocationRange &lr, const std::vector<const Identifier*> &parameters, AST *body)
       : AST(lr, AST_FUNCTION), parameters(parameters), body(body)
     { }
@@ -299,8 +307,12 @@ struct LiteralNumber : public AST {
 /** Represents JSON strings. */
 struct LiteralString : public AST {
     String value;
+    /** The interpreter's immortal string for the value, once it has evaluated the literal.
+     * Cleared again when the interpreter is destroyed.
+     */
+    mutable void *heapString;
     LiteralString(const LocationRange &lr, const String &value)
-      : AST(lr, AST_LITERAL_STRING), value(value)
+      : AST(lr, AST_LITERAL_STRING), value(value), heapString(nullptr)
     { }
 };
 
@@ -409,15 +421,55 @@ struct Var : public AST {
 };
 
 
-/** Allocates ASTs on demand, frees them in its destructor.
+/** Allocates AST nodes and interns identifiers.
+ *
+ * The nodes and identifiers are placed one after another in large chunks of memory, which are
+ * all released when the Allocator is destroyed.  The destructors are still run, to free the
+ * vectors, maps and strings that the nodes own.
  */
 class Allocator {
-    std::map<String, const Identifier*> internedIdentifiers;
+    /** The size of the chunks.  Anything bigger gets a chunk of its own. */
+    static const std::size_t CHUNK_SIZE = 64 * 1024;
+
+    /** Imports can be parsed on other threads while the interpreter runs, see
+     * jsonnet_import_threads, so everything below is guarded by this.
+     */
+    std::mutex mutex;
+
+    std::unordered_map<String, const Identifier*> internedIdentifiers;
+    std::unordered_set<std::string> internedFiles;
     std::vector<AST*> allocated;
+    std::vector<char*> chunks;
+
+    /** The unused part of the last chunk. */
+    char *next;
+    std::size_t remaining;
+
+    void *allocate(std::size_t size, std::size_t align)
+    {
+        std::size_t pad = (align - std::uintptr_t(next) % align) % align;
+        if (pad + size > remaining) {
+            std::size_t chunk_size = size > CHUNK_SIZE ? size : CHUNK_SIZE;
+            chunks.push_back(static_cast<char*>(::operator new(chunk_size)));
+            next = chunks.back();
+            remaining = chunk_size;
+            pad = 0;
+        }
+        void *r = next + pad;
+        next += pad + size;
+        remaining -= pad + size;
+        return r;
+    }
+
     public:
+    Allocator(void)
+      : next(nullptr), remaining(0)
+    { }
+    Allocator(const Allocator &) = delete;
     template <class T, class... Args> T* make(Args&&... args)
     {
-        auto r = new T(std::forward<Args>(args)...);
+        std::lock_guard<std::mutex> lock(mutex);
+        auto r = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
         allocated.push_back(r);
         return r;
     }
@@ -427,24 +479,39 @@ class Allocator {
      */
     const Identifier *makeIdentifier(const String &name)
     {
+        std::lock_guard<std::mutex> lock(mutex);
         auto it = internedIdentifiers.find(name);
         if (it != internedIdentifiers.end()) {
             return it->second;
         }
-        auto r = new Identifier(name);
+        auto r = new (allocate(sizeof(Identifier), alignof(Identifier))) Identifier(name);
         internedIdentifiers[name] = r;
         return r;
     }
+    /** Returns the single copy of the given file name, which lives as long as the allocator.
+     *
+     * Every location in a file refers to this copy, which keeps locations small and cheap to copy.
+     */
+    const std::string *internFile(const std::string &file)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        // Elements of an unordered_set do not move when it grows.
+        return &*internedFiles.insert(file).first;
+    }
     ~Allocator()
     {
         for (auto x : allocated) {
-            delete x;
+            x->~AST();
         }
         allocated.clear();
         for (auto x : internedIdentifiers) {
-            delete x.second;
+            x.second->~Identifier();
         }
         internedIdentifiers.clear();
+        for (auto chunk : chunks) {
+            ::operator delete(chunk);
+        }
+        chunks.clear();
     }
 };
 
@@ -0,0 +1,460 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <cmath>
+#include <map>
+
+#include "core/constant_folding.h"
+#include "core/ast.h"
+
+namespace {
+
+/** Whether the AST is a literal whose evaluation cannot fail. */
+bool is_constant(const AST *ast)
+{
+    switch (ast->type) {
+        case AST_LITERAL_BOOLEAN:
+        case AST_LITERAL_NULL:
+        case AST_LITERAL_STRING:
+        return true;
+
+        case AST_LITERAL_NUMBER: {
+            // Out of range literals raise an error when evaluated.
+            double v = static_cast<const LiteralNumber*>(ast)->value;
+            return !std::isnan(v) && !std::isinf(v);
+        }
+
+        default:
+        return false;
+    }
+}
+
+class ConstantFolder {
+
+    Allocator *alloc;
+
+    /** The std identifier. */
+    const Identifier *stdId;
+
+    /** The fields of the standard library object, as bound by the local that jsonnet_parse wraps
+     * around every file, or empty if the AST was not produced that way. */
+    std::map<String, AST *> stdFields;
+
+    /** The standard library object. */
+    const Object *stdObject;
+
+    /** How many bindings of std are in scope, other than the standard library object. */
+    unsigned stdShadowed;
+
+    template <class T, class... Args> T* make(Args&&... args)
+    {
+        return alloc->make<T>(std::forward<Args>(args)...);
+    }
+
+    /** If ast_ is std.f for some field f of the standard library, return the name f, otherwise
+     * nullptr. */
+    const String *stdFieldName(const AST *ast_)
+    {
+        if (stdShadowed > 0 || stdFields.empty()) return nullptr;
+        auto *ast = dynamic_cast<const Index*>(ast_);
+        if (ast == nullptr) return nullptr;
+        auto *target = dynamic_cast<const Var*>(ast->target);
+        auto *index = dynamic_cast<const LiteralString*>(ast->index);
+        if (target == nullptr || target->id != stdId || index == nullptr) return nullptr;
+        if (stdFields.find(index->value) == stdFields.end()) return nullptr;
+        return &index->value;
+    }
+
+    /** The value of std.type(ast), if it can be known without evaluating anything that could
+     * fail, otherwise nullptr. */
+    static const char32_t *constantType(const AST *ast)
+    {
+        switch (ast->type) {
+            case AST_ARRAY: return U"array";
+            case AST_FUNCTION: return U"function";
+            case AST_LITERAL_BOOLEAN: return U"boolean";
+            case AST_LITERAL_NULL: return U"null";
+            case AST_LITERAL_NUMBER: return is_constant(ast) ? U"number" : nullptr;
+            case AST_LITERAL_STRING: return U"string";
+            default: return nullptr;
+        }
+    }
+
+    /** Fold a unary operator whose operand has already been folded.
+     *
+     * \returns The folded AST, or nullptr if it could not be folded.
+     */
+    AST *foldUnary(Unary *ast)
+    {
+        if (auto *b = dynamic_cast<LiteralBoolean*>(ast->expr)) {
+            if (ast->op == UOP_NOT)
+                return make<LiteralBoolean>(ast->location, !b->value);
+        } else if (is_constant(ast->expr)) {
+            auto *n = dynamic_cast<LiteralNumber*>(ast->expr);
+            if (n == nullptr) return nullptr;
+            switch (ast->op) {
+                case UOP_PLUS: return n;
+                case UOP_MINUS: return make<LiteralNumber>(ast->location, -n->value);
+                case UOP_BITWISE_NOT:
+                return make<LiteralNumber>(ast->location, double(~(long)n->value));
+                default: return nullptr;
+            }
+        }
+        return nullptr;
+    }
+
+    /** Fold a binary operator whose operands have already been folded.
+     *
+     * \returns The folded AST, or nullptr if it could not be folded.
+     */
+    AST *foldBinary(Binary *ast)
+    {
+        const LocationRange &loc = ast->location;
+
+        // Short-cut semantics only need the left hand side.
+        if (auto *l = dynamic_cast<LiteralBoolean*>(ast->left)) {
+            if (ast->op == BOP_AND && !l->value) return make<LiteralBoolean>(loc, false);
+            if (ast->op == BOP_OR && l->value) return make<LiteralBoolean>(loc, true);
+        }
+
+        if (!is_constant(ast->left) || !is_constant(ast->right)) return nullptr;
+        if (ast->left->type != ast->right->type) return nullptr;
+
+        switch (ast->left->type) {
+            case AST_LITERAL_BOOLEAN: {
+                bool l = static_cast<LiteralBoolean*>(ast->left)->value;
+                bool r = static_cast<LiteralBoolean*>(ast->right)->value;
+                switch (ast->op) {
+                    case BOP_AND: return make<LiteralBoolean>(loc, l && r);
+                    case BOP_OR: return make<LiteralBoolean>(loc, l || r);
+                    default: return nullptr;
+                }
+            }
+
+            case AST_LITERAL_NUMBER: {
+                double l = static_cast<LiteralNumber*>(ast->left)->value;
+                double r = static_cast<LiteralNumber*>(ast->right)->value;
+                double v;
+                switch (ast->op) {
+                    case BOP_PLUS: v = l + r; break;
+                    case BOP_MINUS: v = l - r; break;
+                    case BOP_MULT: v = l * r; break;
+                    case BOP_DIV:
+                    if (r == 0) return nullptr;
+                    v = l / r;
+                    break;
+                    case BOP_SHIFT_L: v = (long)l << (long)r; break;
+                    case BOP_SHIFT_R: v = (long)l >> (long)r; break;
+                    case BOP_BITWISE_AND: v = (long)l & (long)r; break;
+                    case BOP_BITWISE_XOR: v = (long)l ^ (long)r; break;
+                    case BOP_BITWISE_OR: v = (long)l | (long)r; break;
+                    case BOP_LESS_EQ: return make<LiteralBoolean>(loc, l <= r);
+                    case BOP_GREATER_EQ: return make<LiteralBoolean>(loc, l >= r);
+                    case BOP_LESS: return make<LiteralBoolean>(loc, l < r);
+                    case BOP_GREATER: return make<LiteralBoolean>(loc, l > r);
+                    default: return nullptr;
+                }
+                if (std::isnan(v) || std::isinf(v)) return nullptr;
+                return make<LiteralNumber>(loc, v);
+            }
+
+            case AST_LITERAL_STRING: {
+                const String &l = static_cast<LiteralString*>(ast->left)->value;
+                const String &r = static_cast<LiteralString*>(ast->right)->value;
+                switch (ast->op) {
+                    case BOP_PLUS: return make<LiteralString>(loc, l + r);
+                    case BOP_LESS_EQ: return make<LiteralBoolean>(loc, l <= r);
+                    case BOP_GREATER_EQ: return make<LiteralBoolean>(loc, l >= r);
+                    case BOP_LESS: return make<LiteralBoolean>(loc, l < r);
+                    case BOP_GREATER: return make<LiteralBoolean>(loc, l > r);
+                    default: return nullptr;
+                }
+            }
+
+            default:
+            return nullptr;
+        }
+    }
+
+    /** Fold a call to the standard library whose arguments have already been folded.
+     *
+     * \returns The folded AST, or nullptr if it could not be folded.
+     */
+    AST *foldStdCall(Apply *ast, const String &name)
+    {
+        const LocationRange &loc = ast->location;
+        const auto &args = ast->arguments;
+
+        if (name == U"type" && args.size() == 1) {
+            const char32_t *type = constantType(args[0]);
+            if (type != nullptr) return make<LiteralString>(loc, type);
+
+        } else if (name == U"length" && args.size() == 1) {
+            if (auto *str = dynamic_cast<LiteralString*>(args[0]))
+                return make<LiteralNumber>(loc, double(str->value.length()));
+            if (auto *arr = dynamic_cast<Array*>(args[0]))
+                return make<LiteralNumber>(loc, double(arr->elements.size()));
+
+        } else if (name == U"equals" && args.size() == 2) {
+            // This is what == desugars to.
+            if (!is_constant(args[0]) || !is_constant(args[1])) return nullptr;
+            if (args[0]->type != args[1]->type) return make<LiteralBoolean>(loc, false);
+            bool v;
+            switch (args[0]->type) {
+                case AST_LITERAL_BOOLEAN:
+                v = static_cast<LiteralBoolean*>(args[0])->value
+                    == static_cast<LiteralBoolean*>(args[1])->value;
+                break;
+
+                case AST_LITERAL_NUMBER:
+                v = static_cast<LiteralNumber*>(args[0])->value
+                    == static_cast<LiteralNumber*>(args[1])->value;
+                break;
+
+                case AST_LITERAL_STRING:
+                v = static_cast<LiteralString*>(args[0])->value
+                    == static_cast<LiteralString*>(args[1])->value;
+                break;
+
+                default:  // null
+                v = true;
+            }
+            return make<LiteralBoolean>(loc, v);
+
+        } else if (name == U"mod" && args.size() == 2) {
+            // This is what % desugars to.  Only fold numbers, formatting is left to runtime.
+            auto *a = dynamic_cast<LiteralNumber*>(args[0]);
+            auto *b = dynamic_cast<LiteralNumber*>(args[1]);
+            if (a == nullptr || b == nullptr || !is_constant(a) || !is_constant(b)) return nullptr;
+            if (b->value == 0) return nullptr;
+            double v = std::fmod(a->value, b->value);
+            if (std::isnan(v) || std::isinf(v)) return nullptr;
+            return make<LiteralNumber>(loc, v);
+
+        } else {
+            inlineStdCall(ast, name);
+        }
+        return nullptr;
+    }
+
+    /** If the named standard library function just forwards its parameters to a builtin, e.g.
+     * objectHas(o, f):: std.objectHasEx(o, f, false), then call the builtin directly.
+     *
+     * Each parameter must be passed at most once, and all other arguments must be literals, so
+     * the arguments are evaluated exactly as before.
+     */
+    void inlineStdCall(Apply *ast, const String &name)
+    {
+        // Skip the object locals around the field body.  The standard library binds
+        // local std = self, which is still the standard library object here.
+        AST *field = stdFields[name];
+        while (auto *local = dynamic_cast<Local*>(field)) {
+            auto it = local->binds.find(stdId);
+            if (it != local->binds.end() && dynamic_cast<Self*>(it->second) == nullptr) return;
+            field = local->body;
+        }
+        auto *func = dynamic_cast<Function*>(field);
+        if (func == nullptr || func->parameters.size() != ast->arguments.size()) return;
+        auto *body = dynamic_cast<Apply*>(func->body);
+        if (body == nullptr || body->tailstrict) return;
+        const String *builtin_name = stdFieldName(body->target);
+        if (builtin_name == nullptr) return;
+        if (dynamic_cast<BuiltinFunction*>(stdFields[*builtin_name]) == nullptr) return;
+
+        std::map<const Identifier *, AST *> params;
+        for (unsigned i=0 ; i<func->parameters.size() ; ++i)
+            params[func->parameters[i]] = ast->arguments[i];
+        std::vector<AST*> args;
+        for (AST *arg : body->arguments) {
+            if (auto *var = dynamic_cast<Var*>(arg)) {
+                auto it = params.find(var->id);
+                if (it == params.end() || it->second == nullptr) return;
+                args.push_back(it->second);
+                it->second = nullptr;
+            } else if (is_constant(arg)) {
+                args.push_back(arg);
+            } else {
+                return;
+            }
+        }
+
+        auto *std_var = make<Var>(ast->target->location, stdId);
+        std_var->freeVariables.push_back(stdId);
+        auto *target = make<Index>(ast->target->location, std_var,
+                                   make<LiteralString>(ast->target->location, *builtin_name));
+        target->freeVariables.push_back(stdId);
+        ast->target = target;
+        ast->arguments = args;
+    }
+
+    public:
+    ConstantFolder(Allocator *alloc)
+      : alloc(alloc), stdId(alloc->makeIdentifier(U"std")), stdObject(nullptr), stdShadowed(0)
+    { }
+
+    /** Find the standard library object bound by the local at the root of the AST. */
+    void findStd(AST *ast_)
+    {
+        auto *ast = dynamic_cast<Local*>(ast_);
+        if (ast == nullptr) return;
+        auto it = ast->binds.find(stdId);
+        if (it == ast->binds.end()) return;
+        stdObject = dynamic_cast<Object*>(it->second);
+        if (stdObject == nullptr) return;
+        for (const auto &field : stdObject->fields) {
+            auto *name = dynamic_cast<LiteralString*>(field.name);
+            if (name == nullptr) {
+                stdFields.clear();
+                return;
+            }
+            stdFields[name->value] = field.body;
+        }
+    }
+
+    void fold(AST *&ast_)
+    {
+        switch (ast_->type) {
+            case AST_APPLY: {
+                auto *ast = static_cast<Apply*>(ast_);
+                fold(ast->target);
+                for (AST *&arg : ast->arguments)
+                    fold(arg);
+                const String *name = stdFieldName(ast->target);
+                if (name != nullptr) {
+                    AST *folded = foldStdCall(ast, *name);
+                    if (folded != nullptr) ast_ = folded;
+                }
+            } break;
+
+            case AST_ARRAY: {
+                for (AST *&el : static_cast<Array*>(ast_)->elements)
+                    fold(el);
+            } break;
+
+            case AST_BINARY: {
+                auto *ast = static_cast<Binary*>(ast_);
+                fold(ast->left);
+                fold(ast->right);
+                AST *folded = foldBinary(ast);
+                if (folded != nullptr) ast_ = folded;
+            } break;
+
+            case AST_CONDITIONAL: {
+                auto *ast = static_cast<Conditional*>(ast_);
+                fold(ast->cond);
+                fold(ast->branchTrue);
+                fold(ast->branchFalse);
+                if (auto *cond = dynamic_cast<LiteralBoolean*>(ast->cond))
+                    ast_ = cond->value ? ast->branchTrue : ast->branchFalse;
+            } break;
+
+            case AST_ERROR: {
+                fold(static_cast<Error*>(ast_)->expr);
+            } break;
+
+            case AST_FUNCTION: {
+                auto *ast = static_cast<Function*>(ast_);
+                unsigned shadowed = stdShadowed;
+                for (auto *p : ast->parameters) {
+                    if (p == stdId) stdShadowed++;
+                }
+                fold(ast->body);
+                stdShadowed = shadowed;
+            } break;
+
+            case AST_INDEX: {
+                auto *ast = static_cast<Index*>(ast_);
+                fold(ast->target);
+                fold(ast->index);
+            } break;
+
+            case AST_LOCAL: {
+                auto *ast = static_cast<Local*>(ast_);
+                unsigned shadowed = stdShadowed;
+                auto it = ast->binds.find(stdId);
+                if (it != ast->binds.end() && it->second != stdObject) stdShadowed++;
+                for (auto &bind : ast->binds)
+                    fold(bind.second);
+                fold(ast->body);
+                stdShadowed = shadowed;
+            } break;
+
+            case AST_OBJECT: {
+                auto *ast = static_cast<Object*>(ast_);
+                for (AST *&assert : ast->asserts)
+                    fold(assert);
+                for (auto &field : ast->fields) {
+                    fold(field.name);
+                    fold(field.body);
+                }
+            } break;
+
+            case AST_ARRAY_COMPREHENSION: {
+                auto *ast = static_cast<ArrayComprehension*>(ast_);
+                unsigned shadowed = stdShadowed;
+                for (auto &spec : ast->specs) {
+                    fold(spec.expr);
+                    if (spec.kind == ComprehensionSpec::FOR && spec.var == stdId) stdShadowed++;
+                }
+                fold(ast->body);
+                stdShadowed = shadowed;
+            } break;
+
+            case AST_OBJECT_COMPREHENSION_SIMPLE: {
+                auto *ast = static_cast<ObjectComprehensionSimple*>(ast_);
+                fold(ast->array);
+                unsigned shadowed = stdShadowed;
+                if (ast->id == stdId) stdShadowed++;
+                fold(ast->field);
+                fold(ast->value);
+                stdShadowed = shadowed;
+            } break;
+
+            case AST_UNARY: {
+                auto *ast = static_cast<Unary*>(ast_);
+                fold(ast->expr);
+                AST *folded = foldUnary(ast);
+                if (folded != nullptr) ast_ = folded;
+            } break;
+
+            case AST_BUILTIN_FUNCTION:
+            case AST_IMPORT:
+            case AST_IMPORTSTR:
+            case AST_LITERAL_BOOLEAN:
+            case AST_LITERAL_NULL:
+            case AST_LITERAL_NUMBER:
+            case AST_LITERAL_STRING:
+            case AST_SELF:
+            case AST_SUPER:
+            case AST_VAR:
+            // Nothing to do.
+            break;
+
+            default:
+            std::cerr << "INTERNAL ERROR: Unknown AST: " << ast_ << std::endl;
+            std::abort();
+        }
+    }
+};
+
+}  // namespace
+
+void jsonnet_constant_folding(Allocator *alloc, AST *&ast)
+{
+    ConstantFolder folder(alloc);
+    folder.findStd(ast);
+    folder.fold(ast);
+}
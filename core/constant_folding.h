@@ -0,0 +1,36 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef JSONNET_CONSTANT_FOLDING_H
+#define JSONNET_CONSTANT_FOLDING_H
+
+#include "core/ast.h"
+
+/** Replace constant subexpressions with their values.
+ *
+ * This folds unary and binary operators on literals, conditionals with literal conditions, and
+ * calls to std.type, std.length, std.equals and std.mod that have literal arguments.  Calls to
+ * standard library functions that only forward their parameters to a builtin, such as
+ * std.objectHas, are replaced with a direct call to the builtin.  Nothing that could raise an
+ * error is folded, so errors are still raised at runtime.
+ *
+ * This must happen after static analysis (so that static errors are still reported for code that
+ * is folded away) and before execution.  The freeVariables of enclosing ASTs are not updated, but
+ * remain a superset of the variables that are actually needed.
+ */
+void jsonnet_constant_folding(Allocator *alloc, AST *&ast);
+
+#endif
@@ -0,0 +1,110 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <cstdint>
+
+#include <string>
+
+#include "core/hash.h"
+
+/* MurmurHash3 by Austin Appleby, which he placed in the public domain.  This is the x64 variant
+ * with 128 bits of output.  The input is read in little endian order whatever the machine, so
+ * that every build names cache entries the same way.
+ */
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+/** Read 8 bytes as a little endian number. */
+static inline uint64_t load64(const unsigned char *p)
+{
+    uint64_t r = 0;
+    for (int i = 7 ; i >= 0 ; --i) r = (r << 8) | p[i];
+    return r;
+}
+
+std::string jsonnet_hash(const char *data, std::size_t length)
+{
+    static const uint64_t c1 = 0x87c37b91114253d5ULL;
+    static const uint64_t c2 = 0x4cf5ad432745937fULL;
+    const unsigned char *p = reinterpret_cast<const unsigned char*>(data);
+    const std::size_t nblocks = length / 16;
+    uint64_t h1 = 0;
+    uint64_t h2 = 0;
+
+    for (std::size_t i = 0 ; i < nblocks ; ++i) {
+        uint64_t k1 = load64(p + i * 16);
+        uint64_t k2 = load64(p + i * 16 + 8);
+
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    // The last 0 to 15 bytes.
+    const unsigned char *tail = p + nblocks * 16;
+    std::size_t rest = length & 15;
+    uint64_t k1 = 0;
+    uint64_t k2 = 0;
+    for (std::size_t i = rest ; i > 8 ; --i) k2 = (k2 << 8) | tail[i - 1];
+    for (std::size_t i = rest < 8 ? rest : 8 ; i > 0 ; --i) k1 = (k1 << 8) | tail[i - 1];
+    if (rest > 8) {
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    }
+    if (rest > 0) {
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= length;
+    h2 ^= length;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+
+    static const char digits[] = "0123456789abcdef";
+    std::string r(32, '0');
+    for (int i = 0 ; i < 8 ; ++i) {
+        unsigned b1 = (h1 >> (8 * i)) & 0xff;
+        unsigned b2 = (h2 >> (8 * i)) & 0xff;
+        r[2 * i] = digits[b1 >> 4];
+        r[2 * i + 1] = digits[b1 & 15];
+        r[16 + 2 * i] = digits[b2 >> 4];
+        r[16 + 2 * i + 1] = digits[b2 & 15];
+    }
+    return r;
+}
+
+std::string jsonnet_hash(const std::string &data)
+{
+    return jsonnet_hash(data.c_str(), data.length());
+}
@@ -0,0 +1,35 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef JSONNET_HASH_H
+#define JSONNET_HASH_H
+
+#include <cstddef>
+
+#include <string>
+
+/** A 128 bit hash of some bytes, written as 32 lower case hex digits.
+ *
+ * This is MurmurHash3 (x64, 128 bit, seed 0), whose digits are the bytes of its output in order.
+ * It is fast and spreads its input well, which is what naming cache entries after their content
+ * needs, but it is not a cryptographic hash: do not trust a cache that others can write to.
+ */
+std::string jsonnet_hash(const char *data, std::size_t length);
+
+/** As jsonnet_hash, of the bytes of a string. */
+std::string jsonnet_hash(const std::string &data);
+
+#endif  // JSONNET_HASH_H
@@ -0,0 +1,523 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <cstdlib>
+#include <cstring>
+
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define JSONNET_JSON_SSE2
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define JSONNET_JSON_AVX2
+#endif
+
+#include "core/json.h"
+#include "core/string.h"
+
+/* The document is processed in blocks of 64 bytes.  A scanner classifies the bytes of a block,
+ * giving one bit per byte in each of these masks.  Everything after that is done with the masks,
+ * so is the same whichever scanner is used.
+ */
+struct JsonMasks {
+    uint64_t quote;
+    uint64_t backslash;
+    /** { } [ ] : , */
+    uint64_t structural;
+    /** Space, tab, \n, \r */
+    uint64_t space;
+    /** Bytes below 0x20, which cannot appear in strings. */
+    uint64_t control;
+};
+
+struct ScalarJsonScanner {
+    static void masks(const char *block, JsonMasks &m)
+    {
+        m = JsonMasks{0, 0, 0, 0, 0};
+        for (unsigned i = 0 ; i < 64 ; ++i) {
+            uint64_t bit = uint64_t(1) << i;
+            unsigned char c = block[i];
+            switch (c) {
+                case '"': m.quote |= bit; break;
+                case '\\': m.backslash |= bit; break;
+                case '{': case '}': case '[': case ']': case ':': case ',':
+                m.structural |= bit;
+                break;
+                case ' ': case '\t': case '\n': case '\r': m.space |= bit; break;
+            }
+            if (c < 0x20) m.control |= bit;
+        }
+    }
+
+    static unsigned plain(const char32_t *str, char *bytes)
+    {
+        for (unsigned i = 0 ; i < 16 ; ++i) {
+            char32_t c = str[i];
+            if (c < 0x20 || c == '"' || c == '\\' || c > 0x7e) return i;
+            bytes[i] = char(c);
+        }
+        return 16;
+    }
+};
+
+#ifdef JSONNET_JSON_SSE2
+struct Sse2JsonScanner {
+    static void masks(const char *block, JsonMasks &m)
+    {
+        m = JsonMasks{0, 0, 0, 0, 0};
+        for (unsigned i = 0 ; i < 4 ; ++i) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + 16 * i));
+            // Setting bit 5 maps [ to { and ] to }, and nothing else to either of them.
+            __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+            __m128i structural = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(lower, _mm_set1_epi8('{')),
+                             _mm_cmpeq_epi8(lower, _mm_set1_epi8('}'))),
+                _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')),
+                             _mm_cmpeq_epi8(v, _mm_set1_epi8(','))));
+            __m128i space = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                             _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+                _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                             _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+            __m128i control = _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1f)), v);
+            unsigned shift = 16 * i;
+            m.quote |=
+                uint64_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')))) << shift;
+            m.backslash |=
+                uint64_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\\')))) << shift;
+            m.structural |= uint64_t(_mm_movemask_epi8(structural)) << shift;
+            m.space |= uint64_t(_mm_movemask_epi8(space)) << shift;
+            m.control |= uint64_t(_mm_movemask_epi8(control)) << shift;
+        }
+    }
+
+    static unsigned plain(const char32_t *str, char *bytes)
+    {
+        __m128i v[4];
+        // 4 bits for each character.
+        uint64_t special = 0;
+        for (unsigned i = 0 ; i < 4 ; ++i) {
+            // Code points are below 2^31, so the signed comparisons work.
+            v[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(str + 4 * i));
+            __m128i m = _mm_or_si128(
+                _mm_or_si128(_mm_cmplt_epi32(v[i], _mm_set1_epi32(0x20)),
+                             _mm_cmpgt_epi32(v[i], _mm_set1_epi32(0x7e))),
+                _mm_or_si128(_mm_cmpeq_epi32(v[i], _mm_set1_epi32('"')),
+                             _mm_cmpeq_epi32(v[i], _mm_set1_epi32('\\'))));
+            special |= uint64_t(_mm_movemask_epi8(m)) << (16 * i);
+        }
+        // Only the bytes before the first special character are used, and they are ASCII.
+        __m128i bytes16 = _mm_packus_epi16(_mm_packs_epi32(v[0], v[1]),
+                                           _mm_packs_epi32(v[2], v[3]));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(bytes), bytes16);
+        return special == 0 ? 16 : __builtin_ctzll(special) / 4;
+    }
+};
+#endif
+
+#ifdef JSONNET_JSON_AVX2
+struct Avx2JsonScanner {
+    __attribute__((target("avx2")))
+    static void masks(const char *block, JsonMasks &m)
+    {
+        m = JsonMasks{0, 0, 0, 0, 0};
+        for (unsigned i = 0 ; i < 2 ; ++i) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + 32 * i));
+            __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+            __m256i structural = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(lower, _mm256_set1_epi8('{')),
+                                _mm256_cmpeq_epi8(lower, _mm256_set1_epi8('}'))),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(':')),
+                                _mm256_cmpeq_epi8(v, _mm256_set1_epi8(','))));
+            __m256i space = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+            __m256i control = _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(0x1f)), v);
+            unsigned shift = 32 * i;
+            m.quote |= uint64_t(uint32_t(
+                _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'))))) << shift;
+            m.backslash |= uint64_t(uint32_t(
+                _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))))) << shift;
+            m.structural |= uint64_t(uint32_t(_mm256_movemask_epi8(structural))) << shift;
+            m.space |= uint64_t(uint32_t(_mm256_movemask_epi8(space))) << shift;
+            m.control |= uint64_t(uint32_t(_mm256_movemask_epi8(control))) << shift;
+        }
+    }
+
+    __attribute__((target("avx2")))
+    static unsigned plain(const char32_t *str, char *bytes)
+    {
+        __m256i v[2];
+        uint64_t special = 0;
+        for (unsigned i = 0 ; i < 2 ; ++i) {
+            v[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(str + 8 * i));
+            __m256i m = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpgt_epi32(_mm256_set1_epi32(0x20), v[i]),
+                                _mm256_cmpgt_epi32(v[i], _mm256_set1_epi32(0x7e))),
+                _mm256_or_si256(_mm256_cmpeq_epi32(v[i], _mm256_set1_epi32('"')),
+                                _mm256_cmpeq_epi32(v[i], _mm256_set1_epi32('\\'))));
+            special |= uint64_t(uint32_t(_mm256_movemask_epi8(m))) << (32 * i);
+        }
+        // The packs work within 128 bit lanes, so the middle 64 bit quarters need swapping.
+        __m256i words = _mm256_permute4x64_epi64(_mm256_packs_epi32(v[0], v[1]), 0xd8);
+        __m128i bytes16 = _mm_packus_epi16(_mm256_castsi256_si128(words),
+                                           _mm256_extracti128_si256(words, 1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(bytes), bytes16);
+        return special == 0 ? 16 : __builtin_ctzll(special) / 4;
+    }
+};
+#endif
+
+bool jsonnet_json_scanner_supported(JsonScanner scanner)
+{
+    switch (scanner) {
+        case JSON_SCANNER_SCALAR:
+        case JSON_SCANNER_BEST:
+        return true;
+
+        case JSON_SCANNER_SSE2:
+        #ifdef JSONNET_JSON_SSE2
+        return true;
+        #else
+        return false;
+        #endif
+
+        case JSON_SCANNER_AVX2:
+        #ifdef JSONNET_JSON_AVX2
+        return __builtin_cpu_supports("avx2");
+        #else
+        return false;
+        #endif
+    }
+    return false;
+}
+
+/** Bit i of the result is the xor of bits 0 to i of x. */
+static inline uint64_t prefix_xor(uint64_t x)
+{
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+template <class Scanner>
+static bool json_index(const char *text, unsigned long length, std::vector<uint32_t> &offsets,
+                       JsonError &err)
+{
+    offsets.clear();
+    if (length >= UINT32_MAX) {
+        err = JsonError{0, "document is too large"};
+        return false;
+    }
+    // Most documents have a structural character every few bytes.
+    offsets.reserve(length / 4 + 2);
+
+    // Whether the first character of the next block is escaped by a backslash.
+    bool escape_carry = false;
+    // All ones if the next block starts inside a string.
+    uint64_t string_carry = 0;
+    // 1 if the previous block ended in the middle of a number, true, false or null.
+    uint64_t scalar_carry = 0;
+
+    char tail[64];
+    for (unsigned long base = 0 ; base < length ; base += 64) {
+        const char *block = text + base;
+        if (length - base < 64) {
+            // Pad the last block with whitespace, which does not change anything.
+            std::memset(tail, ' ', sizeof tail);
+            std::memcpy(tail, block, length - base);
+            block = tail;
+        }
+        JsonMasks m;
+        Scanner::masks(block, m);
+
+        // Backslashes are rare, so they are dealt with one at a time.  A backslash escapes the
+        // next character, which can then not escape anything itself.
+        uint64_t escaped = escape_carry ? 1 : 0;
+        uint64_t backslash = m.backslash & ~escaped;
+        escape_carry = false;
+        while (backslash != 0) {
+            unsigned i = __builtin_ctzll(backslash);
+            if (i == 63) {
+                escape_carry = true;
+                break;
+            }
+            escaped |= uint64_t(2) << i;
+            backslash &= ~(uint64_t(3) << i);
+        }
+
+        // The bits from each opening quote up to (but not including) its closing quote.
+        uint64_t quote = m.quote & ~escaped;
+        uint64_t in_string = prefix_xor(quote) ^ string_carry;
+        string_carry = uint64_t(int64_t(in_string) >> 63);
+
+        uint64_t bad = m.control & in_string;
+        if (bad != 0) {
+            err = JsonError{base + __builtin_ctzll(bad), "control character in string"};
+            return false;
+        }
+
+        uint64_t outside = ~(in_string | quote);
+        uint64_t scalar = outside & ~(m.structural | m.space);
+        uint64_t scalar_start = scalar & ~((scalar << 1) | scalar_carry);
+        scalar_carry = scalar >> 63;
+
+        uint64_t found = (m.structural & outside) | quote | scalar_start;
+        while (found != 0) {
+            offsets.push_back(uint32_t(base + __builtin_ctzll(found)));
+            found &= found - 1;
+        }
+    }
+    if (string_carry != 0) {
+        // Nothing after the opening quote was found.
+        err = JsonError{offsets.back(), "unterminated string"};
+        return false;
+    }
+    offsets.push_back(uint32_t(length));
+    return true;
+}
+
+bool jsonnet_json_index(const char *text, unsigned long length, std::vector<uint32_t> &offsets,
+                        JsonError &err, JsonScanner scanner)
+{
+    switch (scanner) {
+        case JSON_SCANNER_SCALAR:
+        return json_index<ScalarJsonScanner>(text, length, offsets, err);
+
+        #ifdef JSONNET_JSON_SSE2
+        case JSON_SCANNER_SSE2:
+        return json_index<Sse2JsonScanner>(text, length, offsets, err);
+        #endif
+
+        #ifdef JSONNET_JSON_AVX2
+        case JSON_SCANNER_AVX2:
+        return json_index<Avx2JsonScanner>(text, length, offsets, err);
+        #endif
+
+        case JSON_SCANNER_BEST: {
+            static const JsonScanner best =
+                jsonnet_json_scanner_supported(JSON_SCANNER_AVX2) ? JSON_SCANNER_AVX2
+                : jsonnet_json_scanner_supported(JSON_SCANNER_SSE2) ? JSON_SCANNER_SSE2
+                : JSON_SCANNER_SCALAR;
+            return jsonnet_json_index(text, length, offsets, err, best);
+        }
+
+        default:
+        std::cerr << "INTERNAL ERROR: Unsupported JSON scanner: " << scanner << std::endl;
+        std::abort();
+    }
+}
+
+/** Write one character of a JSON string, escaped if need be, returning the number of bytes. */
+static unsigned escape_char(char32_t c, bool ascii, char *out)
+{
+    switch (c) {
+        case '"': std::memcpy(out, "\\\"", 2); return 2;
+        case '\\': std::memcpy(out, "\\\\", 2); return 2;
+        case '\b': std::memcpy(out, "\\b", 2); return 2;
+        case '\f': std::memcpy(out, "\\f", 2); return 2;
+        case '\n': std::memcpy(out, "\\n", 2); return 2;
+        case '\r': std::memcpy(out, "\\r", 2); return 2;
+        case '\t': std::memcpy(out, "\\t", 2); return 2;
+    }
+    if (c < 0x20 || (c >= 0x7f && (ascii || c <= 0x9f))) {
+        // Unprintable, use \u with at least 4 hex digits.
+        static const char hex[] = "0123456789abcdef";
+        unsigned digits = 4;
+        while (digits < 8 && (c >> (4 * digits)) != 0)
+            digits++;
+        out[0] = '\\';
+        out[1] = 'u';
+        for (unsigned i = 0 ; i < digits ; ++i)
+            out[1 + digits - i] = hex[(c >> (4 * i)) & 0xf];
+        return 2 + digits;
+    }
+    if (c < 0x80) {
+        out[0] = char(c);
+        return 1;
+    }
+    std::string utf8;
+    unsigned len = encode_utf8(c, utf8);
+    std::memcpy(out, utf8.data(), len);
+    return len;
+}
+
+template <class Scanner>
+__attribute__((always_inline))
+static inline void json_escape(const String &str, bool ascii, std::string &out)
+{
+    // The output is collected in a buffer, which is flushed when it might not have room for
+    // another 16 characters of up to 10 bytes each.  The scanners find the run of characters that
+    // need no escaping, and copy it 16 at a time.
+    char buf[1024];
+    unsigned len = 0;
+    buf[len++] = '"';
+    const char32_t *c = str.data();
+    const char32_t *end = c + str.length();
+    while (c < end) {
+        if (len > sizeof buf - 16 * 10) {
+            out.append(buf, len);
+            len = 0;
+        }
+        if (end - c >= 16) {
+            // Copy the plain characters, and then escape the one after them, if any.
+            unsigned n = Scanner::plain(c, buf + len);
+            len += n;
+            c += n;
+            if (n < 16)
+                len += escape_char(*(c++), ascii, buf + len);
+        } else {
+            len += escape_char(*(c++), ascii, buf + len);
+        }
+    }
+    buf[len++] = '"';
+    out.append(buf, len);
+}
+
+#ifdef JSONNET_JSON_AVX2
+/** The scanner is called for every few characters, so the whole loop is compiled for AVX2 to let
+ * it be inlined.
+ */
+__attribute__((target("avx2")))
+static void json_escape_avx2(const String &str, bool ascii, std::string &out)
+{
+    json_escape<Avx2JsonScanner>(str, ascii, out);
+}
+#endif
+
+void jsonnet_json_escape(const String &str, bool ascii, std::string &out, JsonScanner scanner)
+{
+    switch (scanner) {
+        case JSON_SCANNER_SCALAR:
+        json_escape<ScalarJsonScanner>(str, ascii, out);
+        return;
+
+        #ifdef JSONNET_JSON_SSE2
+        case JSON_SCANNER_SSE2:
+        json_escape<Sse2JsonScanner>(str, ascii, out);
+        return;
+        #endif
+
+        #ifdef JSONNET_JSON_AVX2
+        case JSON_SCANNER_AVX2:
+        json_escape_avx2(str, ascii, out);
+        return;
+        #endif
+
+        case JSON_SCANNER_BEST: {
+            static const JsonScanner best =
+                jsonnet_json_scanner_supported(JSON_SCANNER_AVX2) ? JSON_SCANNER_AVX2
+                : jsonnet_json_scanner_supported(JSON_SCANNER_SSE2) ? JSON_SCANNER_SSE2
+                : JSON_SCANNER_SCALAR;
+            jsonnet_json_escape(str, ascii, out, best);
+            return;
+        }
+
+        default:
+        std::cerr << "INTERNAL ERROR: Unsupported JSON scanner: " << scanner << std::endl;
+        std::abort();
+    }
+}
+
+bool jsonnet_json_string(const char *begin, const char *end, std::string &utf8, JsonError &err)
+{
+    utf8.clear();
+    const char *c = begin;
+    while (true) {
+        // Copy the run up to the next escape.
+        const char *backslash =
+            static_cast<const char*>(std::memchr(c, '\\', end - c));
+        if (backslash == nullptr) {
+            utf8.append(c, end - c);
+            return true;
+        }
+        utf8.append(c, backslash - c);
+        c = backslash + 1;
+        switch (*c) {
+            case '"': case '\\': case '/': utf8 += *c; break;
+            case 'b': utf8 += '\b'; break;
+            case 'f': utf8 += '\f'; break;
+            case 'n': utf8 += '\n'; break;
+            case 'r': utf8 += '\r'; break;
+            case 't': utf8 += '\t'; break;
+            case 'u': {
+                unsigned long codepoint = 0;
+                for (unsigned i = 1 ; i <= 4 ; ++i) {
+                    unsigned char x = c + i < end ? c[i] : '\0';
+                    unsigned digit;
+                    if (x >= '0' && x <= '9') {
+                        digit = x - '0';
+                    } else if (x >= 'a' && x <= 'f') {
+                        digit = x - 'a' + 10;
+                    } else if (x >= 'A' && x <= 'F') {
+                        digit = x - 'A' + 10;
+                    } else {
+                        err = JsonError{(unsigned long)(c - begin), "malformed unicode escape"};
+                        return false;
+                    }
+                    codepoint = codepoint * 16 + digit;
+                }
+                encode_utf8(codepoint, utf8);
+                c += 4;
+            } break;
+
+            default:
+            err = JsonError{(unsigned long)(c - begin), "unknown escape sequence in string"};
+            return false;
+        }
+        c++;
+    }
+}
+
+const char *jsonnet_json_number(const char *c, double &d)
+{
+    const char *begin = c;
+    if (*c == '-') c++;
+    if (*c == '0') {
+        c++;
+    } else if (*c >= '1' && *c <= '9') {
+        while (*c >= '0' && *c <= '9') c++;
+    } else {
+        return nullptr;
+    }
+    if (*c == '.') {
+        c++;
+        if (!(*c >= '0' && *c <= '9')) return nullptr;
+        while (*c >= '0' && *c <= '9') c++;
+    }
+    if (*c == 'e' || *c == 'E') {
+        c++;
+        if (*c == '+' || *c == '-') c++;
+        if (!(*c >= '0' && *c <= '9')) return nullptr;
+        while (*c >= '0' && *c <= '9') c++;
+    }
+    char *end;
+    d = std::strtod(begin, &end);
+    if (end != c) return nullptr;
+    return c;
+}
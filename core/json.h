@@ -0,0 +1,109 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef JSONNET_JSON_H
+#define JSONNET_JSON_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "core/string.h"
+
+/** Where and why some text could not be parsed as JSON. */
+struct JsonError {
+    /** Byte offset into the text. */
+    unsigned long offset;
+    std::string msg;
+};
+
+/** The implementations of jsonnet_json_index and jsonnet_json_escape.  They all give the same
+ * result, this is only useful for testing and benchmarking.
+ */
+enum JsonScanner {
+    JSON_SCANNER_SCALAR,
+    JSON_SCANNER_SSE2,
+    JSON_SCANNER_AVX2,
+    /** The fastest one that this machine supports. */
+    JSON_SCANNER_BEST
+};
+
+/** Whether this build and machine can use the given scanner. */
+bool jsonnet_json_scanner_supported(JsonScanner scanner);
+
+/** Find the structure of a JSON document, the first of the two stages of parsing it.
+ *
+ * The offsets are those of the characters { } [ ] : , that are not in strings, the opening and
+ * closing quotes of every string, and the first character of every number, true, false and null.
+ * Nothing in between needs looking at to parse the document: a string is between two consecutive
+ * offsets, and other values end at the first whitespace or structural character.  The offsets
+ * are followed by the length of the text, which makes the walk over them simpler.
+ *
+ * \param text The document, which must be followed by a \0 (not included in the length).
+ * \param length The length of the document in bytes.
+ * \param offsets Set to the offsets.
+ * \param err Set if an error is found.  Only errors inside strings are found at this stage, the
+ * rest are found by walking the offsets.
+ * \returns Whether there was no error.
+ */
+bool jsonnet_json_index(const char *text, unsigned long length, std::vector<uint32_t> &offsets,
+                        JsonError &err, JsonScanner scanner=JSON_SCANNER_BEST);
+
+/** Decode the body of a JSON string, handling escapes the same way as the Jsonnet lexer.
+ *
+ * \param begin The first character after the opening quote.
+ * \param end The closing quote.
+ * \param utf8 Set to the decoded string.
+ * \param err Set if there is a bad escape, with the offset from begin.
+ * \returns Whether there was no error.
+ */
+bool jsonnet_json_string(const char *begin, const char *end, std::string &utf8, JsonError &err);
+
+/** Append a string to out as a JSON string literal in UTF-8, in quotes and with escapes.
+ *
+ * The characters that need escaping (or UTF-8 encoding) are found a vector at a time, so the runs of
+ * plain ASCII between them are copied in bulk.
+ *
+ * \param str The string.
+ * \param ascii Whether to escape all characters outside printable ASCII, as std.escapeStringJson
+ * does.  Otherwise, only control characters are escaped, as in manifested JSON.
+ * \param out The JSON is appended to this.
+ */
+void jsonnet_json_escape(const String &str, bool ascii, std::string &out,
+                         JsonScanner scanner=JSON_SCANNER_BEST);
+
+/** Whether a number, true, false or null ending at c is properly terminated. */
+static inline bool jsonnet_json_delimiter(char c)
+{
+    switch (c) {
+        case ' ': case '\t': case '\n': case '\r':
+        case '{': case '}': case '[': case ']': case ':': case ',': case '"':
+        return true;
+
+        default:
+        return false;
+    }
+}
+
+/** Parse a JSON number, converting it the same way as the Jsonnet parser.
+ *
+ * \param c The first character of the number.
+ * \param d Set to the number.
+ * \returns The character after the number, or nullptr if there is not a number at c.
+ */
+const char *jsonnet_json_number(const char *c, double &d);
+
+#endif  // JSONNET_JSON_H
@@ -0,0 +1,263 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <cstdlib>
+#include <cstring>
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "core/json.h"
+
+extern "C" {
+    #include "core/libjsonnet.h"
+}
+
+// Checks that the vectorized JSON scanners agree with the scalar one on random inputs, both for
+// indexing documents and for escaping strings.  With --benchmark, reports the throughput of each
+// scanner, and compares std.parseJson with passing the same document as external code.
+
+static const JsonScanner SCANNERS[] = {
+    JSON_SCANNER_SCALAR, JSON_SCANNER_SSE2, JSON_SCANNER_AVX2
+};
+
+static const char *scanner_name(JsonScanner scanner)
+{
+    switch (scanner) {
+        case JSON_SCANNER_SCALAR: return "scalar";
+        case JSON_SCANNER_SSE2: return "sse2";
+        case JSON_SCANNER_AVX2: return "avx2";
+        default: return "best";
+    }
+}
+
+// Pieces that random inputs are made of, chosen to exercise strings, escapes, and block carries.
+static const char *FRAGMENTS[] = {
+    " ", "    ", "\t", "\r", "\n", "{", "}", "[", "]", ":", ",",
+    "\"", "\\", "\\\"", "\\\\", "\\n", "\\u00e9", "\x01", "\xc3\xa9",
+    "0", "-1.5e3", "true", "false", "null", "x",
+    "\"a string that is longer than one vector of input\"",
+    "                                                                ",
+};
+
+/** Index the input and describe the offsets or the error in a way that can be compared. */
+static std::string describe(const std::string &input, JsonScanner scanner)
+{
+    std::stringstream ss;
+    std::vector<uint32_t> offsets;
+    JsonError err;
+    if (jsonnet_json_index(input.c_str(), input.length(), offsets, err, scanner)) {
+        for (auto offset : offsets)
+            ss << offset << " ";
+    } else {
+        ss << "error at " << err.offset << ": " << err.msg;
+    }
+    return ss.str();
+}
+
+// Pieces of strings to escape, chosen to put characters that need escaping anywhere in a vector.
+static const String STRING_FRAGMENTS[] = {
+    U"a", U"plain ascii text", U"0123456789abcdef", U"\"", U"\\", U"\n", U"\t", U"\b", U"\f",
+    U"\r", String(1, U'\0'), U"\x01", U"\x1f", U" ", U"~", U"\x7f", U"\x80", U"\x9f", U"\xa0",
+    U"\u00e9", U"\u2028", U"\U0001f600",
+};
+
+static int differential_test_escape(std::mt19937 &rng)
+{
+    const unsigned num_fragments = sizeof(STRING_FRAGMENTS) / sizeof(*STRING_FRAGMENTS);
+    for (unsigned i = 0 ; i < 20000 ; ++i) {
+        String str;
+        unsigned length = rng() % 40;
+        for (unsigned j = 0 ; j < length ; ++j)
+            str += STRING_FRAGMENTS[rng() % num_fragments];
+
+        for (bool ascii : {false, true}) {
+            std::string expected;
+            jsonnet_json_escape(str, ascii, expected, JSON_SCANNER_SCALAR);
+            for (JsonScanner scanner : SCANNERS) {
+                if (!jsonnet_json_scanner_supported(scanner)) continue;
+                std::string got;
+                jsonnet_json_escape(str, ascii, got, scanner);
+                if (got != expected) {
+                    std::cerr << "Scanner " << scanner_name(scanner) << " escapes "
+                              << encode_utf8(str) << " differently:\n--- scalar:\n" << expected
+                              << "\n--- " << scanner_name(scanner) << ":\n" << got << std::endl;
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+static int differential_test(void)
+{
+    std::mt19937 rng(42);
+    const unsigned num_fragments = sizeof(FRAGMENTS) / sizeof(*FRAGMENTS);
+    for (unsigned i = 0 ; i < 20000 ; ++i) {
+        std::string input;
+        unsigned length = rng() % 80;
+        for (unsigned j = 0 ; j < length ; ++j)
+            input += FRAGMENTS[rng() % num_fragments];
+
+        std::string expected = describe(input, JSON_SCANNER_SCALAR);
+        for (JsonScanner scanner : SCANNERS) {
+            if (!jsonnet_json_scanner_supported(scanner)) continue;
+            std::string got = describe(input, scanner);
+            if (got != expected) {
+                std::cerr << "Scanner " << scanner_name(scanner) << " disagrees on input:\n"
+                          << input << "\n--- scalar:\n" << expected << "\n--- "
+                          << scanner_name(scanner) << ":\n" << got << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    return differential_test_escape(rng);
+}
+
+/** Something like an inventory file: an array of records with strings, numbers, and lists. */
+static std::string generate_benchmark_input(void)
+{
+    std::stringstream ss;
+    ss << "[\n";
+    for (unsigned i = 0 ; i < 50000 ; ++i) {
+        ss << (i == 0 ? "" : ",\n")
+           << "  {\"host\": \"host-" << i << ".example.com\", \"id\": " << i
+           << ", \"load\": " << i * 0.25 << ", \"up\": " << (i % 3 ? "true" : "false")
+           << ", \"tags\": [\"rack-" << i % 40 << "\", \"zone \\\"" << i % 7 << "\\\"\"]"
+           << ", \"owner\": null}";
+    }
+    ss << "\n]\n";
+    return ss.str();
+}
+
+/** The best of 5 runs of f, in seconds. */
+template <class F> static double best_time(F f)
+{
+    double best = 0;
+    for (unsigned i = 0 ; i < 5 ; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+        if (best == 0 || secs.count() < best) best = secs.count();
+    }
+    return best;
+}
+
+/** Evaluate a snippet in a fresh VM with one external variable, and check it worked. */
+static void evaluate(const char *snippet, const std::string &input, bool code)
+{
+    JsonnetVm *vm = jsonnet_make();
+    if (code) {
+        jsonnet_ext_code(vm, "input", input.c_str());
+    } else {
+        jsonnet_ext_var(vm, "input", input.c_str());
+    }
+    int error;
+    char *output = jsonnet_evaluate_snippet(vm, "benchmark", snippet, &error);
+    if (error) {
+        std::cerr << output << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    jsonnet_realloc(vm, output, 0);
+    jsonnet_destroy(vm);
+}
+
+static int benchmark(const std::string &input)
+{
+    double mb = input.length() / 1e6;
+    std::cout << "Indexing " << mb << " MB" << std::endl;
+    for (JsonScanner scanner : SCANNERS) {
+        if (!jsonnet_json_scanner_supported(scanner)) continue;
+        std::vector<uint32_t> offsets;
+        JsonError err;
+        double secs = best_time([&] {
+            jsonnet_json_index(input.c_str(), input.length(), offsets, err, scanner);
+        });
+        std::cout << scanner_name(scanner) << ": " << mb / secs << " MB/s" << std::endl;
+    }
+
+    // Escaping every string in the document again, as manifesting it would.
+    std::vector<String> strs;
+    std::vector<uint32_t> offsets;
+    JsonError err;
+    if (!jsonnet_json_index(input.c_str(), input.length(), offsets, err)) {
+        std::cerr << "Invalid JSON at byte " << err.offset << ": " << err.msg << std::endl;
+        return EXIT_FAILURE;
+    }
+    double escape_mb = 0;
+    for (unsigned i = 0 ; i + 1 < offsets.size() ; ++i) {
+        const char *begin = input.c_str() + offsets[i];
+        if (*begin != '"') continue;
+        std::string utf8;
+        if (!jsonnet_json_string(begin + 1, input.c_str() + offsets[i + 1], utf8, err)) {
+            std::cerr << "Invalid JSON string at byte " << offsets[i] << std::endl;
+            return EXIT_FAILURE;
+        }
+        strs.push_back(decode_utf8(utf8));
+        escape_mb += utf8.length() / 1e6;
+        i++;
+    }
+    std::cout << "Escaping " << strs.size() << " strings, " << escape_mb << " MB" << std::endl;
+    for (JsonScanner scanner : SCANNERS) {
+        if (!jsonnet_json_scanner_supported(scanner)) continue;
+        std::string json;
+        double secs = best_time([&] {
+            json.clear();
+            for (const auto &str : strs)
+                jsonnet_json_escape(str, false, json, scanner);
+        });
+        std::cout << scanner_name(scanner) << ": " << escape_mb / secs << " MB/s" << std::endl;
+    }
+
+    // Both include manifesting the whole value.
+    double parse_json = best_time([&] {
+        evaluate("std.parseJson(std.extVar(\"input\"))", input, false);
+    });
+    std::cout << "std.parseJson: " << parse_json << " s" << std::endl;
+    double ext_code = best_time([&] {
+        evaluate("std.extVar(\"input\")", input, true);
+    });
+    std::cout << "external code: " << ext_code << " s" << std::endl;
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, const char **argv)
+{
+    if (argc >= 2 && std::string(argv[1]) == "--benchmark") {
+        if (argc == 3) {
+            std::ifstream f(argv[2]);
+            if (!f.good()) {
+                std::cerr << "Could not open " << argv[2] << std::endl;
+                return EXIT_FAILURE;
+            }
+            std::string input((std::istreambuf_iterator<char>(f)),
+                              std::istreambuf_iterator<char>());
+            return benchmark(input);
+        }
+        return benchmark(generate_benchmark_input());
+    }
+    if (argc != 1) {
+        std::cerr << "json_test [--benchmark [<file>]]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    return differential_test();
+}
@@ -15,10 +15,21 @@ limitations under the License.
 */
 
 #include <cassert>
+#include <cstdint>
 
 #include <string>
 #include <sstream>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define JSONNET_LEX_SSE2
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define JSONNET_LEX_AVX2
+#endif
+
 #include "core/lexer.h"
 #include "core/static_error.h"
 #include "core/string.h"
@@ -60,7 +71,7 @@ static bool is_symbol(char c)
     return false;
 }
 
-std::string lex_number(const char *&c, const std::string &filename, const Location &begin)
+TokenText lex_number(const char *&c, const std::string &filename, const Location &begin)
 {
     // This function should be understood with reference to the linked image:
     // http://www.json.org/number.gif
@@ -81,7 +92,7 @@ std::string lex_number(const char *&c, const std::string &filename, const Locati
         AFTER_EXP_DIGIT
     } state;
 
-    std::string r;
+    const char *start = c;
 
     state = BEGIN;
     while (true) {
@@ -214,12 +225,11 @@ std::string lex_number(const char *&c, const std::string &filename, const Locati
             }
             break;
         }
-        r += *c;
         c++;
     }
     end:
     c--;
-    return r;
+    return TokenText(start, c - start + 1);
 }
 
 // Check that b has at least the same whitespace prefix as a and returns the amount of this whitespace,
@@ -234,19 +244,176 @@ static int whitespace_check(const char *a, const char *b)
     return i;
 }
 
-std::list<Token> jsonnet_lex(const std::string &filename, const char *input)
+/* The scanners skip over the parts of the input that do not need looking at one character at a
+ * time: indentation, comments, and the bodies of string literals.  Each provides:
+ *
+ * find(c, x, y): The first character at or after c that is \0, \n, x or y.  Pass \0 for x or y
+ * if only fewer characters are needed.
+ *
+ * blanks(c): The first character at or after c that is not a space, tab or \r.
+ *
+ * The vectorized scanners read whole aligned blocks.  An aligned block never crosses a page
+ * boundary, so reading past the terminating \0 is safe.  The bytes before c in the first block
+ * are masked out.
+ *
+ * Those reads are still outside the input as far as AddressSanitizer knows, so it is not allowed
+ * to check the vectorized scanners.  Everything else in the lexer is checked as usual.
+ */
+
+#if defined(__GNUC__)
+#define JSONNET_LEX_NO_SANITIZE __attribute__((no_sanitize_address))
+#else
+#define JSONNET_LEX_NO_SANITIZE
+#endif
+
+struct ScalarScanner {
+    static const char *find(const char *c, char x, char y)
+    {
+        while (*c != '\0' && *c != '\n' && *c != x && *c != y) ++c;
+        return c;
+    }
+
+    static const char *blanks(const char *c)
+    {
+        while (*c == ' ' || *c == '\t' || *c == '\r') ++c;
+        return c;
+    }
+};
+
+#ifdef JSONNET_LEX_SSE2
+struct Sse2Scanner {
+    JSONNET_LEX_NO_SANITIZE
+    static const char *find(const char *c, char x, char y)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i nl = _mm_set1_epi8('\n');
+        const __m128i vx = _mm_set1_epi8(x);
+        const __m128i vy = _mm_set1_epi8(y);
+        unsigned misalign = uintptr_t(c) & 15;
+        const __m128i *p = reinterpret_cast<const __m128i*>(c - misalign);
+        unsigned mask = ~0u << misalign;
+        while (true) {
+            __m128i v = _mm_load_si128(p);
+            __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, zero), _mm_cmpeq_epi8(v, nl)),
+                                     _mm_or_si128(_mm_cmpeq_epi8(v, vx), _mm_cmpeq_epi8(v, vy)));
+            mask &= unsigned(_mm_movemask_epi8(m));
+            if (mask != 0)
+                return reinterpret_cast<const char*>(p) + __builtin_ctz(mask);
+            mask = ~0u;
+            p++;
+        }
+    }
+
+    JSONNET_LEX_NO_SANITIZE
+    static const char *blanks(const char *c)
+    {
+        const __m128i space = _mm_set1_epi8(' ');
+        const __m128i tab = _mm_set1_epi8('\t');
+        const __m128i cr = _mm_set1_epi8('\r');
+        unsigned misalign = uintptr_t(c) & 15;
+        const __m128i *p = reinterpret_cast<const __m128i*>(c - misalign);
+        unsigned mask = ~0u << misalign;
+        while (true) {
+            __m128i v = _mm_load_si128(p);
+            __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, space),
+                                     _mm_or_si128(_mm_cmpeq_epi8(v, tab), _mm_cmpeq_epi8(v, cr)));
+            mask &= ~unsigned(_mm_movemask_epi8(m)) & 0xffff;
+            if (mask != 0)
+                return reinterpret_cast<const char*>(p) + __builtin_ctz(mask);
+            mask = ~0u;
+            p++;
+        }
+    }
+};
+#endif
+
+#ifdef JSONNET_LEX_AVX2
+struct Avx2Scanner {
+    __attribute__((target("avx2"))) JSONNET_LEX_NO_SANITIZE
+    static const char *find(const char *c, char x, char y)
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i nl = _mm256_set1_epi8('\n');
+        const __m256i vx = _mm256_set1_epi8(x);
+        const __m256i vy = _mm256_set1_epi8(y);
+        unsigned misalign = uintptr_t(c) & 31;
+        const __m256i *p = reinterpret_cast<const __m256i*>(c - misalign);
+        unsigned mask = ~0u << misalign;
+        while (true) {
+            __m256i v = _mm256_load_si256(p);
+            __m256i m = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, zero), _mm256_cmpeq_epi8(v, nl)),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, vx), _mm256_cmpeq_epi8(v, vy)));
+            mask &= unsigned(_mm256_movemask_epi8(m));
+            if (mask != 0)
+                return reinterpret_cast<const char*>(p) + __builtin_ctz(mask);
+            mask = ~0u;
+            p++;
+        }
+    }
+
+    __attribute__((target("avx2"))) JSONNET_LEX_NO_SANITIZE
+    static const char *blanks(const char *c)
+    {
+        const __m256i space = _mm256_set1_epi8(' ');
+        const __m256i tab = _mm256_set1_epi8('\t');
+        const __m256i cr = _mm256_set1_epi8('\r');
+        unsigned misalign = uintptr_t(c) & 31;
+        const __m256i *p = reinterpret_cast<const __m256i*>(c - misalign);
+        unsigned mask = ~0u << misalign;
+        while (true) {
+            __m256i v = _mm256_load_si256(p);
+            __m256i m = _mm256_or_si256(
+                _mm256_cmpeq_epi8(v, space),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, tab), _mm256_cmpeq_epi8(v, cr)));
+            mask &= ~unsigned(_mm256_movemask_epi8(m));
+            if (mask != 0)
+                return reinterpret_cast<const char*>(p) + __builtin_ctz(mask);
+            mask = ~0u;
+            p++;
+        }
+    }
+};
+#endif
+
+bool jsonnet_lex_scanner_supported(LexScanner scanner)
+{
+    switch (scanner) {
+        case LEX_SCANNER_SCALAR:
+        case LEX_SCANNER_BEST:
+        return true;
+
+        case LEX_SCANNER_SSE2:
+        #ifdef JSONNET_LEX_SSE2
+        return true;
+        #else
+        return false;
+        #endif
+
+        case LEX_SCANNER_AVX2:
+        #ifdef JSONNET_LEX_AVX2
+        return __builtin_cpu_supports("avx2");
+        #else
+        return false;
+        #endif
+    }
+    return false;
+}
+
+template <class Scanner>
+static Tokens lex(const std::string &filename, const char *input)
 {
     unsigned long line_number = 1;
     const char *line_start = input;
 
-    std::list<Token> r;
+    Tokens r(filename);
 
     const char *c = input;
 
     for ( ; *c!='\0' ; ++c) {
         Location begin(line_number, c - line_start + 1);
         Token::Kind kind;
-        std::string data;
+        TokenText data;
 
         switch (*c) {
 
@@ -254,10 +421,11 @@ std::list<Token> jsonnet_lex(const std::string &filename, const char *input)
             case ' ': case '\t': case '\r':
             continue;
 
-            // Skip \n and maintain line numbers
+            // Skip \n and maintain line numbers, then skip the next line's indentation.
             case '\n':
             line_number++;
             line_start = c+1;
+            c = Scanner::blanks(c + 1) - 1;
             continue;
 
             case '{':
@@ -308,26 +476,26 @@ std::list<Token> jsonnet_lex(const std::string &filename, const char *input)
             case '!':
             kind = Token::OPERATOR;
             if (*(c+1) == '=') {
+                data = TokenText(c, 2);
                 c++;
-                data = "!=";
             } else {
-                data = "!";
+                data = TokenText(c, 1);
             }
             break;
 
             case '~':
             kind = Token::OPERATOR;
-            data = "~";
+            data = TokenText(c, 1);
             break;
 
             case '+':
             kind = Token::OPERATOR;
-            data = "+";
+            data = TokenText(c, 1);
 
             break;
             case '-':
             kind = Token::OPERATOR;
-            data = "-";
+            data = TokenText(c, 1);
             break;
 
             // Numeric literals.
@@ -340,110 +508,118 @@ std::list<Token> jsonnet_lex(const std::string &filename, const char *input)
             // String literals.
             case '"': {
                 c++;
+                // Unless there are escapes, the value is just the characters between the quotes.
+                // Otherwise, runs of plain characters are copied from body to decoded.
+                const char *body = c;
+                bool escaped = false;
+                std::string decoded;
                 for (; ; ++c) {
+                    c = Scanner::find(c, '"', '\\');
                     if (*c == '\0') {
                         throw StaticError(filename, begin, "Unterminated string");
                     }
                     if (*c == '"') {
                         break;
                     }
-                    switch (*c) {
-                        case '\\':
-                        switch (*(++c)) {
-                            case '"':
-                            data += *c;
-                            break;
+                    if (*c == '\n') {
+                        // Treat as a regular letter, but maintain line/column counters.
+                        line_number++;
+                        line_start = c+1;
+                        continue;
+                    }
+                    // Must be a backslash.
+                    decoded.append(body, c - body);
+                    escaped = true;
+                    switch (*(++c)) {
+                        case '"':
+                        decoded += *c;
+                        break;
 
-                            case '\\':
-                            data += *c;
-                            break;
+                        case '\\':
+                        decoded += *c;
+                        break;
 
-                            case '/':
-                            data += *c;
-                            break;
+                        case '/':
+                        decoded += *c;
+                        break;
 
-                            case 'b':
-                            data += '\b';
-                            break;
+                        case 'b':
+                        decoded += '\b';
+                        break;
 
-                            case 'f':
-                            data += '\f';
-                            break;
+                        case 'f':
+                        decoded += '\f';
+                        break;
 
-                            case 'n':
-                            data += '\n';
-                            break;
+                        case 'n':
+                        decoded += '\n';
+                        break;
 
-                            case 'r':
-                            data += '\r';
-                            break;
+                        case 'r':
+                        decoded += '\r';
+                        break;
 
-                            case 't':
-                            data += '\t';
-                            break;
+                        case 't':
+                        decoded += '\t';
+                        break;
 
-                            case 'u': {
-                                ++c;  // Consume the 'u'.
-                                unsigned long codepoint = 0;
-                                // Expect 4 hex digits.
-                                for (unsigned i=0 ; i<4 ; ++i) {
-                                    auto x = (unsigned char)(c[i]);
-                                    unsigned digit;
-                                    if (x == '\0') {
-                                        auto msg = "Unterminated string";
-                                        throw StaticError(filename, begin, msg);
-                                    } else if (x == '"') {
-                                        auto msg = "Truncated unicode escape sequence in "
-                                                   "string literal.";
-                                        throw StaticError(filename, begin, msg);
-                                    } else if (x >= '0' && x <= '9') {
-                                        digit = x - '0';
-                                    } else if (x >= 'a' && x <= 'f') {
-                                        digit = x - 'a' + 10;
-                                    } else if (x >= 'A' && x <= 'F') {
-                                        digit = x - 'A' + 10;
-                                    } else {
-                                        std::stringstream ss;
-                                        ss << "Malformed unicode escape character, "
-                                           << "should be hex: '" << x << "'";
-                                        throw StaticError(filename, begin, ss.str());
-                                    }
-                                    codepoint *= 16;
-                                    codepoint += digit;
+                        case 'u': {
+                            ++c;  // Consume the 'u'.
+                            unsigned long codepoint = 0;
+                            // Expect 4 hex digits.
+                            for (unsigned i=0 ; i<4 ; ++i) {
+                                auto x = (unsigned char)(c[i]);
+                                unsigned digit;
+                                if (x == '\0') {
+                                    auto msg = "Unterminated string";
+                                    throw StaticError(filename, begin, msg);
+                                } else if (x == '"') {
+                                    auto msg = "Truncated unicode escape sequence in "
+                                               "string literal.";
+                                    throw StaticError(filename, begin, msg);
+                                } else if (x >= '0' && x <= '9') {
+                                    digit = x - '0';
+                                } else if (x >= 'a' && x <= 'f') {
+                                    digit = x - 'a' + 10;
+                                } else if (x >= 'A' && x <= 'F') {
+                                    digit = x - 'A' + 10;
+                                } else {
+                                    std::stringstream ss;
+                                    ss << "Malformed unicode escape character, "
+                                       << "should be hex: '" << x << "'";
+                                    throw StaticError(filename, begin, ss.str());
                                 }
-
-                                encode_utf8(codepoint, data);
-
-                                // Leave us on the last char, ready for the ++c at
-                                // the outer for loop.
-                                c += 3;
+                                codepoint *= 16;
+                                codepoint += digit;
                             }
-                            break;
 
-                            case '\0': {
-                                auto msg = "Truncated escape sequence in string literal.";
-                                throw StaticError(filename, begin, msg);
-                            }
+                            encode_utf8(codepoint, decoded);
 
-                            default: {
-                                std::stringstream ss;
-                                ss << "Unknown escape sequence in string literal: '" << *c << "'";
-                                throw StaticError(filename, begin, ss.str());
-                            }
+                            // Leave us on the last char, ready for the ++c at
+                            // the outer for loop.
+                            c += 3;
                         }
                         break;
 
-                        // Treat as a regular letter, but maintain line/column counters.
-                        case '\n':
-                        line_number++;
-                        line_start = c+1;
-                        data += *c;
-                        break;
+                        case '\0': {
+                            auto msg = "Truncated escape sequence in string literal.";
+                            throw StaticError(filename, begin, msg);
+                        }
 
-                        default:
-                        // Just a regular letter.
-                        data += *c;
+                        default: {
+                            std::stringstream ss;
+                            ss << "Unknown escape sequence in string literal: '" << *c << "'";
+                            throw StaticError(filename, begin, ss.str());
+                        }
                     }
+                    body = c + 1;
+                }
+                if (escaped) {
+                    decoded.append(body, c - body);
+                    r.strings.push_back(std::move(decoded));
+                    data = TokenText(r.strings.back().data(), r.strings.back().length());
+                } else {
+                    data = TokenText(body, c - body);
                 }
                 kind = Token::STRING;
             }
@@ -452,13 +628,13 @@ std::list<Token> jsonnet_lex(const std::string &filename, const char *input)
             // Keywords
             default:
             if (is_identifier_first(*c)) {
-                std::string id;
+                const char *start = c;
                 for (; *c != '\0' ; ++c) {
                     if (!is_identifier(*c)) {
                         break;
                     }
-                    id += *c;
                 }
+                TokenText id(start, c - start);
                 --c;
                 if (id == "assert") {
                     kind = Token::ASSERT;
@@ -503,9 +679,7 @@ std::list<Token> jsonnet_lex(const std::string &filename, const char *input)
 
                 // Single line C++ style comment
                 if (*c == '/' && *(c+1) == '/') {
-                    while (*c != '\0' && *c != '\n') {
-                        ++c;
-                    }
+                    c = Scanner::find(c, '\0', '\0');
                     // Leaving it on the \n allows processing of \n on next iteration,
                     // i.e. managing of the line & column counter.
                     c--;
@@ -514,9 +688,7 @@ std::list<Token> jsonnet_lex(const std::string &filename, const char *input)
 
                 // Single line # comment
                 if (*c == '#') {
-                    while (*c != '\0' && *c != '\n') {
-                        ++c;
-                    }
+                    c = Scanner::find(c, '\0', '\0');
                     // Leaving it on the \n allows processing of \n on next iteration,
                     // i.e. managing of the line & column counter.
                     c--;
@@ -526,7 +698,9 @@ std::list<Token> jsonnet_lex(const std::string &filename, const char *input)
                 // Multi-line comment.
                 if (*c == '/' && *(c+1) == '*') {
                     c += 2;  // Avoid matching /*/: skip the /* before starting the search for */.
-                    while (*c != '\0' && !(*c == '*' && *(c+1) == '/')) {
+                    while (true) {
+                        c = Scanner::find(c, '*', '\0');
+                        if (*c == '\0' || (*c == '*' && *(c+1) == '/')) break;
                         if (*c == '\n') {
                             // Just keep track of the line / column counters.
                             line_number++;
@@ -544,7 +718,7 @@ std::list<Token> jsonnet_lex(const std::string &filename, const char *input)
                 }
                 // Text block
                 if (*c == '|' && *(c+1) == '|' && *(c+2) == '|' && *(c+3) == '\n') {
-                    std::stringstream block;
+                    std::string block;
                     c += 4; // Skip the "|||\n"
                     line_number++;
                     line_start = c;
@@ -557,13 +731,13 @@ std::list<Token> jsonnet_lex(const std::string &filename, const char *input)
                     while (true) {
                         assert(ws_chars > 0);
                         // Read up to the \n
-                        for (c = &c[ws_chars]; *c != '\n' ; ++c) {
-                            if (*c == '\0')
-                                throw StaticError(filename, begin, "Unexpected EOF");
-                            block << *c;
-                        }
+                        const char *line = &c[ws_chars];
+                        c = Scanner::find(line, '\0', '\0');
+                        if (*c == '\0')
+                            throw StaticError(filename, begin, "Unexpected EOF");
+                        block.append(line, c - line);
                         // Add the \n
-                        block << '\n';
+                        block += '\n';
                         ++c;
                         line_number++;
                         line_start = c;
@@ -579,7 +753,8 @@ std::list<Token> jsonnet_lex(const std::string &filename, const char *input)
                                 throw StaticError(filename, begin, msg);
                             }
                             c += 2;  // Leave on the last |
-                            data = block.str();
+                            r.strings.push_back(std::move(block));
+                            data = TokenText(r.strings.back().data(), r.strings.back().length());
                             kind = Token::STRING;
                             break;
                         }
@@ -588,12 +763,13 @@ std::list<Token> jsonnet_lex(const std::string &filename, const char *input)
                     break;  // Out of the switch.
                 }
 
+                const char *start = c;
                 for (; *c != '\0' ; ++c) {
                     if (!is_symbol(*c)) {
                         break;
                     }
-                    data += *c;
                 }
+                data = TokenText(start, c - start);
                 --c;
                 kind = Token::OPERATOR;
             } else {
@@ -610,11 +786,40 @@ std::list<Token> jsonnet_lex(const std::string &filename, const char *input)
         }
 
         Location end(line_number, c - line_start + 1);
-        r.push_back(Token(kind, data, LocationRange(filename, begin, end)));
+        r.tokens.emplace_back(kind, data, begin, end);
     }
 
     Location end(line_number, c - line_start + 1);
-    r.push_back(Token(Token::END_OF_FILE, "", LocationRange(filename, end, end)));
+    r.tokens.emplace_back(Token::END_OF_FILE, TokenText(), end, end);
     return r;
 }
 
+Tokens jsonnet_lex(const std::string &filename, const char *input, LexScanner scanner)
+{
+    switch (scanner) {
+        case LEX_SCANNER_SCALAR:
+        return lex<ScalarScanner>(filename, input);
+
+        #ifdef JSONNET_LEX_SSE2
+        case LEX_SCANNER_SSE2:
+        return lex<Sse2Scanner>(filename, input);
+        #endif
+
+        #ifdef JSONNET_LEX_AVX2
+        case LEX_SCANNER_AVX2:
+        return lex<Avx2Scanner>(filename, input);
+        #endif
+
+        case LEX_SCANNER_BEST: {
+            static const LexScanner best =
+                jsonnet_lex_scanner_supported(LEX_SCANNER_AVX2) ? LEX_SCANNER_AVX2
+                : jsonnet_lex_scanner_supported(LEX_SCANNER_SSE2) ? LEX_SCANNER_SSE2
+                : LEX_SCANNER_SCALAR;
+            return jsonnet_lex(filename, input, best);
+        }
+
+        default:
+        std::cerr << "INTERNAL ERROR: Unsupported lexer scanner: " << scanner << std::endl;
+        std::abort();
+    }
+}
@@ -18,14 +18,49 @@ limitations under the License.
 #define JSONNET_LEXER_H
 
 #include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <iostream>
 #include <string>
-#include <list>
 #include <sstream>
+#include <vector>
 
 #include "core/string.h"
 #include "core/static_error.h"
 
+/** Some characters from the lexer input, or decoded from it.  Not terminated by \0. */
+struct TokenText {
+    const char *ptr;
+    unsigned long length;
+
+    TokenText(void) : ptr(""), length(0) { }
+
+    TokenText(const char *ptr, unsigned long length) : ptr(ptr), length(length) { }
+
+    std::string str(void) const { return std::string(ptr, length); }
+};
+
+static inline bool operator==(const TokenText &a, const TokenText &b)
+{
+    return a.length == b.length && std::memcmp(a.ptr, b.ptr, a.length) == 0;
+}
+
+static inline bool operator==(const TokenText &a, const char *b)
+{
+    return std::strlen(b) == a.length && std::memcmp(a.ptr, b, a.length) == 0;
+}
+
+static inline bool operator!=(const TokenText &a, const char *b)
+{
+    return !(a == b);
+}
+
+static inline std::ostream &operator<<(std::ostream &o, const TokenText &v)
+{
+    o.write(v.ptr, v.length);
+    return o;
+}
+
 struct Token {
     enum Kind {
         // Symbols
@@ -70,18 +105,22 @@ struct Token {
         END_OF_FILE
     } kind;
 
-    std::string data;
+    /** The text of identifiers, numbers and operators, and the value of string literals.
+     *
+     * This points into the lexer input, except for string literals that had to be decoded
+     * (because of escapes or being a text block), which are held by the Tokens.
+     */
+    TokenText data;
 
-    String data32(void) { return decode_utf8(data); }
+    String data32(void) const { return decode_utf8(data.ptr, data.length); }
 
-    LocationRange location;
+    /** Where the token is in the file.  The file name is held by the Tokens. */
+    Location begin, end;
 
-    Token(Kind kind, const std::string &data, const LocationRange &location)
-      : kind(kind), data(data), location(location)
+    Token(Kind kind, const TokenText &data, const Location &begin, const Location &end)
+      : kind(kind), data(data), begin(begin), end(end)
     { }
 
-    Token(Kind kind, const std::string &data="") : kind(kind), data(data) { }
-
     static const char *toString(Kind v)
     {
         switch (v) {
@@ -132,7 +171,7 @@ struct Token {
 static inline bool operator==(const Token &a, const Token &b)
 {
     if (a.kind != b.kind) return false;
-    if (a.data != b.data) return false;
+    if (!(a.data == b.data)) return false;
     return true;
 }
 
@@ -144,7 +183,7 @@ static inline std::ostream &operator<<(std::ostream &o, Token::Kind v)
 
 static inline std::ostream &operator<<(std::ostream &o, const Token &v)
 {
-    if (v.data == "") {
+    if (v.data.length == 0) {
         o << Token::toString(v.kind);
     } else if (v.kind == Token::OPERATOR) {
             o << "\"" << v.data << "\"";
@@ -154,6 +193,41 @@ static inline std::ostream &operator<<(std::ostream &o, const Token &v)
     return o;
 }
 
-std::list<Token> jsonnet_lex(const std::string &filename, const char *input);
+/** The tokens of a file.
+ *
+ * The tokens refer to the input that was lexed, so it must outlive them.
+ */
+struct Tokens {
+    std::string file;
+
+    /** The tokens, ending with END_OF_FILE. */
+    std::vector<Token> tokens;
+
+    /** The decoded string literals.  A deque does not move its elements as it grows, and neither
+     * does moving the deque, so tokens can refer to them.
+     */
+    std::deque<std::string> strings;
+
+    Tokens(const std::string &file) : file(file) { }
+    Tokens(Tokens &&) = default;
+    Tokens(const Tokens &) = delete;
+};
+
+/** The implementations of the loops that skip over whitespace, comments, and the bodies of string
+ * literals.  They all give the same result, this is only useful for testing and benchmarking.
+ */
+enum LexScanner {
+    LEX_SCANNER_SCALAR,
+    LEX_SCANNER_SSE2,
+    LEX_SCANNER_AVX2,
+    /** The fastest one that this machine supports. */
+    LEX_SCANNER_BEST
+};
+
+/** Whether this build and machine can use the given scanner. */
+bool jsonnet_lex_scanner_supported(LexScanner scanner);
+
+Tokens jsonnet_lex(const std::string &filename, const char *input,
+                   LexScanner scanner=LEX_SCANNER_BEST);
 
 #endif  // JSONNET_LEXER_H
@@ -0,0 +1,160 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <cstdlib>
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "core/lexer.h"
+
+// Checks that the vectorized lexer scanners agree with the scalar one on random inputs.  With
+// --benchmark, reports the throughput of each scanner instead.
+
+static const LexScanner SCANNERS[] = {
+    LEX_SCANNER_SCALAR, LEX_SCANNER_SSE2, LEX_SCANNER_AVX2
+};
+
+static const char *scanner_name(LexScanner scanner)
+{
+    switch (scanner) {
+        case LEX_SCANNER_SCALAR: return "scalar";
+        case LEX_SCANNER_SSE2: return "sse2";
+        case LEX_SCANNER_AVX2: return "avx2";
+        default: return "best";
+    }
+}
+
+// Pieces that random inputs are made of, chosen to exercise the scanners' stopping characters.
+static const char *FRAGMENTS[] = {
+    " ", "    ", "\t", "\r", "\n", "\n        ", "\n\t\t",
+    "\"", "\\", "\\\"", "\\\\", "\\n", "\\t", "\\u00e9", "\\u12", "\\q",
+    "//", "#", "/*", "*/", "*", "/", "|||\n", "|||",
+    "x", "local", "abc_123", "0", "1.5e3", "+", "==", "!=", "{", "}", "[", "]", ",", ":",
+    "\xc3\xa9", "\x01",
+    "some text that is longer than one vector of input",
+    "                                                ",
+};
+
+/** Lex the input and describe the tokens or the error in a way that can be compared. */
+static std::string describe(const char *input, LexScanner scanner)
+{
+    std::stringstream ss;
+    try {
+        Tokens tokens = jsonnet_lex("test", input, scanner);
+        for (const auto &token : tokens.tokens) {
+            ss << token << " " << token.begin << "-" << token.end << "\n";
+        }
+    } catch (const StaticError &err) {
+        ss << err << "\n";
+    }
+    return ss.str();
+}
+
+static int differential_test(void)
+{
+    std::mt19937 rng(42);
+    const unsigned num_fragments = sizeof(FRAGMENTS) / sizeof(*FRAGMENTS);
+    std::vector<char> buf;
+    for (unsigned i = 0 ; i < 20000 ; ++i) {
+        std::string input;
+        unsigned length = rng() % 40;
+        for (unsigned j = 0 ; j < length ; ++j)
+            input += FRAGMENTS[rng() % num_fragments];
+
+        // Vary where the input starts relative to the vector alignment.
+        unsigned offset = rng() % 64;
+        buf.assign(offset, 'x');
+        buf.insert(buf.end(), input.begin(), input.end());
+        buf.push_back('\0');
+        const char *start = &buf[offset];
+
+        std::string expected = describe(start, LEX_SCANNER_SCALAR);
+        for (LexScanner scanner : SCANNERS) {
+            if (!jsonnet_lex_scanner_supported(scanner)) continue;
+            std::string got = describe(start, scanner);
+            if (got != expected) {
+                std::cerr << "Scanner " << scanner_name(scanner) << " disagrees on input:\n"
+                          << input << "\n--- scalar:\n" << expected << "--- "
+                          << scanner_name(scanner) << ":\n" << got;
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/** Something like a large generated library: mostly indentation, strings and comments. */
+static std::string generate_benchmark_input(void)
+{
+    std::stringstream ss;
+    ss << "{\n";
+    for (unsigned i = 0 ; i < 200000 ; ++i) {
+        ss << "    // Entry number " << i << ", generated.\n"
+           << "    field" << i << ": {\n"
+           << "        description: \"A fairly long description of entry " << i
+           << " that goes on for a while\",\n"
+           << "        path: \"/some/path/to/the/resource/number/" << i << "\",\n"
+           << "    },\n";
+    }
+    ss << "}\n";
+    return ss.str();
+}
+
+static int benchmark(const std::string &input)
+{
+    double mb = input.length() / 1e6;
+    std::cout << "Lexing " << mb << " MB" << std::endl;
+    for (LexScanner scanner : SCANNERS) {
+        if (!jsonnet_lex_scanner_supported(scanner)) continue;
+        double best = 0;
+        for (unsigned i = 0 ; i < 5 ; ++i) {
+            auto start = std::chrono::steady_clock::now();
+            Tokens tokens = jsonnet_lex("benchmark", input.c_str(), scanner);
+            std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+            if (best == 0 || secs.count() < best) best = secs.count();
+        }
+        std::cout << scanner_name(scanner) << ": " << mb / best << " MB/s" << std::endl;
+    }
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, const char **argv)
+{
+    if (argc >= 2 && std::string(argv[1]) == "--benchmark") {
+        if (argc == 3) {
+            std::ifstream f(argv[2]);
+            if (!f.good()) {
+                std::cerr << "Could not open " << argv[2] << std::endl;
+                return EXIT_FAILURE;
+            }
+            std::string input((std::istreambuf_iterator<char>(f)),
+                              std::istreambuf_iterator<char>());
+            return benchmark(input);
+        }
+        return benchmark(generate_benchmark_input());
+    }
+    if (argc != 1) {
+        std::cerr << "lexer_test [--benchmark [<file>]]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    return differential_test();
+}
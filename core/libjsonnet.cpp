@@ -18,18 +18,27 @@ limitations under the License.
 #include <cstring>
 
 #include <exception>
-#include <fstream>
 #include <iostream>
+#include <map>
 #include <sstream>
 #include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 extern "C" {
 #include "core/libjsonnet.h"
 }
 
+#include "core/constant_folding.h"
 #include "core/desugaring.h"
+#include "core/hash.h"
+#include "core/parse_cache.h"
 #include "core/parser.h"
 #include "core/static_analysis.h"
+#include "core/strictness_analysis.h"
 #include "core/vm.h"
 
 static void memory_panic(void)
@@ -45,7 +54,107 @@ static char *from_string(JsonnetVm* vm, const std::string &v)
     return r;
 }
 
-/** Resolve the absolute path and use C++ file io to load the file.
+static char *default_import_callback(void *ctx, const char *base, const char *file,
+                                     char **found_here_cptr, int *success);
+
+struct JsonnetVm {
+    double gcGrowthTrigger;
+    unsigned maxStack;
+    unsigned gcMinObjects;
+    int debugAst;
+    unsigned maxTrace;
+    std::map<std::string, VmExt> ext;
+    JsonnetImportCallback *importCallback;
+    void *importCallbackContext;
+    JsonnetImportBatchCallback *importBatchCallback;
+    void *importBatchCallbackContext;
+    bool stringOutput;
+    bool compatNumbers;
+    unsigned importThreads;
+    std::string cacheDir;
+    /** Library search paths for the default import callback, tried last to first. */
+    std::vector<std::string> jpaths;
+    /** For each (directory, imported path) that the default import callback has tried, 0 if the
+     * file was there, otherwise the errno from opening it.  This way each library path is only
+     * searched once for each file.
+     */
+    std::map<std::pair<std::string, std::string>, int> importPaths;
+    /** For each path the default import callback has tried, the jsonnet_hash of what it read, ""
+     * if there was no such file, or "!" if it could not be read.  See jsonnet_dependencies.
+     */
+    std::map<std::string, std::string> dependencies;
+    JsonnetVm(void)
+      : gcGrowthTrigger(2.0), maxStack(500), gcMinObjects(1000), debugAst(0), maxTrace(20),
+        importCallback(default_import_callback), importCallbackContext(this),
+        importBatchCallback(nullptr), importBatchCallbackContext(nullptr),
+        stringOutput(false), compatNumbers(false), importThreads(0)
+    { }
+};
+
+enum ImportStatus {
+    IMPORT_STATUS_OK,
+    IMPORT_STATUS_FILE_NOT_FOUND,
+    IMPORT_STATUS_IO_ERROR
+};
+
+/** Read a whole file into a buffer allocated with jsonnet_realloc, followed by a \0.
+ *
+ * The buffer of a regular file is sized from fstat, so it is read straight into the buffer in one
+ * go.  Anything else, like a pipe, is read in chunks into a buffer that grows.
+ *
+ * \param path The file.
+ * \param content Set to the buffer.
+ * \param length Set to the length of the file.
+ * \param err Set to the errno if the file could not be opened.
+ * \param err_msg Set to a message if the file was opened but could not be read.
+ * \returns Whether the file was read, or else whether it could not be opened or not read.
+ */
+static ImportStatus read_file(JsonnetVm *vm, const std::string &path, char *&content,
+                              size_t &length, int &err, std::string &err_msg)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        err = errno;
+        return IMPORT_STATUS_FILE_NOT_FOUND;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        err_msg = std::strerror(errno);
+        ::close(fd);
+        return IMPORT_STATUS_IO_ERROR;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        err_msg = "Attempted to import a directory";
+        ::close(fd);
+        return IMPORT_STATUS_IO_ERROR;
+    }
+
+    // Room for the \0, and for the read that finds the end of a regular file without growing.
+    size_t capacity = S_ISREG(st.st_mode) ? size_t(st.st_size) + 2 : 4096;
+    content = jsonnet_realloc(vm, nullptr, capacity);
+    length = 0;
+    while (true) {
+        if (length + 1 == capacity) {
+            capacity *= 2;
+            content = jsonnet_realloc(vm, content, capacity);
+        }
+        ssize_t n = ::read(fd, content + length, capacity - length - 1);
+        if (n == 0) break;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            err_msg = std::strerror(errno);
+            jsonnet_realloc(vm, content, 0);
+            ::close(fd);
+            return IMPORT_STATUS_IO_ERROR;
+        }
+        length += n;
+    }
+    content[length] = '\0';
+    ::close(fd);
+    return IMPORT_STATUS_OK;
+}
+
+/** Look for the file next to the importing file, and then in the library paths.
  */
 static char *default_import_callback(void *ctx, const char *base, const char *file,
                                      char **found_here_cptr, int *success)
@@ -62,47 +171,49 @@ static char *default_import_callback(void *ctx, const char *base, const char *fi
         return from_string(vm, "Attempted to import a directory");
     }
 
-    std::string abs_path;
-    // It is possible that file is an absolute path
-    if (file[0] == '/')
-        abs_path = file;
-    else
-        abs_path = std::string(base) + file;
-
-    std::ifstream f;
-    f.open(abs_path.c_str());
-    if (!f.good()) {
-        *success = 0;
-        return from_string(vm, std::strerror(errno));
-    }
-    try {
-        std::string input;
-        input.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
-        *success = 1;
-        *found_here_cptr = from_string(vm, abs_path);
-        return from_string(vm, input);
-    } catch (const std::ios_base::failure &io_err) {
-        *success = 0;
-        return from_string(vm, io_err.what());
+    // An absolute path is only tried once.
+    std::vector<std::string> dirs = {base};
+    if (file[0] != '/')
+        dirs.insert(dirs.end(), vm->jpaths.rbegin(), vm->jpaths.rend());
+
+    int local_err = 0;
+    for (const auto &dir : dirs) {
+        int &cached = vm->importPaths.emplace(std::make_pair(dir, std::string(file)), -1)
+                      .first->second;
+        if (cached <= 0) {
+            // Not tried before, or found before.
+            std::string abs_path = file[0] == '/' ? std::string(file) : dir + file;
+            char *content;
+            size_t length;
+            int err;
+            std::string err_msg;
+            switch (read_file(vm, abs_path, content, length, err, err_msg)) {
+                case IMPORT_STATUS_OK:
+                cached = 0;
+                vm->dependencies[abs_path] = jsonnet_hash(content, length);
+                *success = 1;
+                *found_here_cptr = from_string(vm, abs_path);
+                return content;
+
+                case IMPORT_STATUS_FILE_NOT_FOUND:
+                cached = err;
+                vm->dependencies[abs_path] = "";
+                break;
+
+                case IMPORT_STATUS_IO_ERROR:
+                vm->dependencies[abs_path] = "!";
+                *success = 0;
+                return from_string(vm, err_msg);
+            }
+        }
+        if (&dir == &dirs[0]) local_err = cached;
     }
-}
 
-struct JsonnetVm {
-    double gcGrowthTrigger;
-    unsigned maxStack;
-    unsigned gcMinObjects;
-    bool debugAst;
-    unsigned maxTrace;
-    std::map<std::string, VmExt> ext;
-    JsonnetImportCallback *importCallback;
-    void *importCallbackContext;
-    bool stringOutput;
-    JsonnetVm(void)
-      : gcGrowthTrigger(2.0), maxStack(500), gcMinObjects(1000), debugAst(false), maxTrace(20),
-        importCallback(default_import_callback), importCallbackContext(this),
-        stringOutput(false)
-    { }
-};
+    *success = 0;
+    if (vm->jpaths.size() == 0)
+        return from_string(vm, std::strerror(local_err));
+    return from_string(vm, "No match locally or in the Jsonnet library path.");
+}
 
 #define TRY try {
 #define CATCH(func) \
@@ -154,6 +265,51 @@ void jsonnet_string_output(struct JsonnetVm *vm, int v)
     vm->stringOutput = bool(v);
 }
 
+void jsonnet_compat_numbers(struct JsonnetVm *vm, int v)
+{
+    vm->compatNumbers = bool(v);
+}
+
+void jsonnet_import_batch_callback(struct JsonnetVm *vm, JsonnetImportBatchCallback *cb,
+                                   void *ctx)
+{
+    vm->importBatchCallback = cb;
+    vm->importBatchCallbackContext = ctx;
+}
+
+void jsonnet_import_threads(struct JsonnetVm *vm, unsigned v)
+{
+    vm->importThreads = v;
+}
+
+void jsonnet_cache_dir(struct JsonnetVm *vm, const char *v)
+{
+    vm->cacheDir = v;
+}
+
+void jsonnet_jpath_add(struct JsonnetVm *vm, const char *v)
+{
+    std::string jpath = v;
+    if (jpath.length() == 0) return;
+    if (jpath[jpath.length() - 1] != '/') jpath += '/';
+    vm->jpaths.push_back(jpath);
+}
+
+char *jsonnet_dependencies(struct JsonnetVm *vm)
+{
+    std::string r;
+    for (const auto &pair : vm->dependencies) {
+        r += pair.first;
+        r += '\0';
+        r += pair.second;
+        r += '\0';
+    }
+    r += '\0';
+    char *buf = jsonnet_realloc(vm, nullptr, r.length());
+    std::memcpy(buf, r.data(), r.length());
+    return buf;
+}
+
 void jsonnet_import_callback(struct JsonnetVm *vm, JsonnetImportCallback *cb, void *ctx)
 {
     vm->importCallback = cb;
@@ -183,26 +339,40 @@ void jsonnet_max_trace(JsonnetVm *vm, unsigned v)
 static char *jsonnet_evaluate_snippet_aux(JsonnetVm *vm, const char *filename,
                                           const char *snippet, int *error, bool multi)
 {
+    // Errors refer to the file names interned in alloc, so it has to outlive them.
+    Allocator alloc;
     try {
-        Allocator alloc;
-        AST *expr = jsonnet_parse(&alloc, filename, snippet);
         std::string json_str;
         std::map<std::string, std::string> files;
-        jsonnet_desugar(&alloc, expr);
-        if (vm->debugAst) {
+        if (vm->debugAst == 1) {
+            AST *expr = jsonnet_parse(&alloc, filename, snippet);
+            jsonnet_desugar(&alloc, expr);
             json_str = jsonnet_unparse_jsonnet(expr);
-        } else {
+        } else if (vm->debugAst == 2) {
+            AST *expr = jsonnet_parse(&alloc, filename, snippet);
+            jsonnet_desugar(&alloc, expr);
             jsonnet_static_analysis(expr);
+            jsonnet_constant_folding(&alloc, expr);
+            json_str = jsonnet_unparse_jsonnet(expr);
+        } else {
+            std::vector<const AST*> imports;
+            AST *expr = jsonnet_parse_cached(&alloc, vm->cacheDir, filename, snippet, &imports);
             if (multi) {
-                files = jsonnet_vm_execute_multi(&alloc, expr, vm->ext, vm->maxStack,
+                files = jsonnet_vm_execute_multi(&alloc, expr, imports, vm->ext, vm->maxStack,
                                                  vm->gcMinObjects, vm->gcGrowthTrigger,
                                                  vm->importCallback, vm->importCallbackContext,
-                                                 vm->stringOutput);
+                                                 vm->importBatchCallback,
+                                                 vm->importBatchCallbackContext,
+                                                 vm->importThreads, vm->cacheDir,
+                                                 vm->stringOutput, vm->compatNumbers);
             } else {
-                json_str = jsonnet_vm_execute(&alloc, expr, vm->ext, vm->maxStack,
+                json_str = jsonnet_vm_execute(&alloc, expr, imports, vm->ext, vm->maxStack,
                                               vm->gcMinObjects, vm->gcGrowthTrigger,
                                               vm->importCallback, vm->importCallbackContext,
-                                              vm->stringOutput);
+                                              vm->importBatchCallback,
+                                              vm->importBatchCallbackContext,
+                                              vm->importThreads, vm->cacheDir,
+                                              vm->stringOutput, vm->compatNumbers);
             }
         }
         if (multi) {
@@ -262,19 +432,28 @@ static char *jsonnet_evaluate_snippet_aux(JsonnetVm *vm, const char *filename,
 
 static char *jsonnet_evaluate_file_aux(JsonnetVm *vm, const char *filename, int *error, bool multi)
 {
-    std::ifstream f;
-    f.open(filename);
-    if (!f.good()) {
-        std::stringstream ss;
-        ss << "Opening input file: " << filename << ": " << strerror(errno);
-        *error = true;
-        return from_string(vm, ss.str());
-    }
-    std::string input;
-    input.assign(std::istreambuf_iterator<char>(f),
-                 std::istreambuf_iterator<char>());
+    char *input;
+    size_t length;
+    int err;
+    std::string err_msg;
+    switch (read_file(vm, filename, input, length, err, err_msg)) {
+        case IMPORT_STATUS_FILE_NOT_FOUND:
+        err_msg = std::strerror(err);
+        // Fall through.
+
+        case IMPORT_STATUS_IO_ERROR: {
+            std::stringstream ss;
+            ss << "Opening input file: " << filename << ": " << err_msg;
+            *error = true;
+            return from_string(vm, ss.str());
+        }
 
-    return jsonnet_evaluate_snippet_aux(vm, filename, input.c_str(), error, multi);
+        case IMPORT_STATUS_OK:
+        break;
+    }
+    char *r = jsonnet_evaluate_snippet_aux(vm, filename, input, error, multi);
+    jsonnet_realloc(vm, input, 0);
+    return r;
 }
 
 char *jsonnet_evaluate_file(JsonnetVm *vm, const char *filename, int *error)
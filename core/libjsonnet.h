@@ -50,6 +50,12 @@ void jsonnet_gc_growth_trigger(struct JsonnetVm *vm, double v);
 /** Expect a string as output and don't JSON encode it. */
 void jsonnet_string_output(struct JsonnetVm *vm, int v);
 
+/** If set to 1, output numbers exactly as earlier versions did: integers in full, and
+ * everything else with 17 significant digits.  Otherwise, numbers get the shortest digits that
+ * read back as the same number.
+ */
+void jsonnet_compat_numbers(struct JsonnetVm *vm, int v);
+
 /** Callback used to load imports.
  *
  * The returned char* should be allocated with jsonnet_realloc.  It will be cleaned up by
@@ -66,6 +72,32 @@ void jsonnet_string_output(struct JsonnetVm *vm, int v);
  */
 typedef char *JsonnetImportCallback(void *ctx, const char *base, const char *rel, char **found_here, int *success);
 
+/** Callback used to load many imports at once, for when each call to the import callback is
+ * expensive, e.g. a round trip to another process.
+ *
+ * Once a file has been parsed, the files it imports that are not loaded yet are passed to this in
+ * one call, whether or not evaluation will reach them.  Import paths are always literals, so
+ * every import is seen this way.  This is done for
+ * the main file before evaluation starts, and for each imported file when it is parsed, which
+ * may be on an import thread (see jsonnet_import_threads).
+ *
+ * Each element of the arrays is as for JsonnetImportCallback, and is NULL or 0 to begin with.
+ * Leave an element of contents NULL to have the import callback load that file instead, if
+ * evaluation reaches it.
+ *
+ * \param ctx User pointer, given in jsonnet_import_batch_callback.
+ * \param base The directory containing the code that did the imports.
+ * \param rels The n paths imported by the code.
+ * \param n The number of paths.
+ * \param found_here For each path, set to the path of the file.  Allocate with jsonnet_realloc.
+ * \param contents For each path, set to the content of the file, or an error message.  Allocate
+ *     with jsonnet_realloc.
+ * \param success For each path, set to 1 to indicate success and 0 for failure.
+ */
+typedef void JsonnetImportBatchCallback(void *ctx, const char *base, const char * const *rels,
+                                        size_t n, char **found_here, char **contents,
+                                        int *success);
+
 /** Allocate, resize, or free a buffer.  This will abort if the memory cannot be allocated.  It will
  * only return NULL if sz was zero.
  *
@@ -75,10 +107,54 @@ typedef char *JsonnetImportCallback(void *ctx, const char *base, const char *rel
  */
 char *jsonnet_realloc(struct JsonnetVm *vm, char *buf, size_t sz);
 
+/** Add to the library search path of the default import callback.  Imports are looked for next to
+ * the importing file first, and then in the library paths, last added first.
+ *
+ * The default import callback remembers where it found each file, and where it did not, for as
+ * long as the VM exists.  Use a new VM to see files that have been created or moved since.
+ */
+void jsonnet_jpath_add(struct JsonnetVm *vm, const char *v);
+
+/** The files the default import callback has read since the VM was made, and those it looked for
+ * and did not find, with a hash of the content of each.  If none of them have changed, the same
+ * program with the same settings gives the same result.
+ *
+ * The returned buffer should be cleaned up with jsonnet_realloc.
+ *
+ * \returns A sequence of strings separated by \0, terminated with \0\0: each path, absolute or
+ *     relative to the process's CWD, followed by the hash of its content (32 hex digits), "" if
+ *     there was no such file, or "!" if it could not be read.
+ */
+char *jsonnet_dependencies(struct JsonnetVm *vm);
+
 /** Override the callback used to locate imports.
  */
 void jsonnet_import_callback(struct JsonnetVm *vm, JsonnetImportCallback *cb, void *ctx);
 
+/** Set a callback to load the files imported by each file all at once, ahead of evaluation.  The
+ * import callback is only used for the files whose contents this leaves NULL.  There is none by
+ * default.
+ */
+void jsonnet_import_batch_callback(struct JsonnetVm *vm, JsonnetImportBatchCallback *cb,
+                                   void *ctx);
+
+/** Load and parse imports on this many threads, while the program is evaluated.  The files
+ * imported by a file are known once it is parsed, so they are queued then, and so on
+ * transitively.  Errors are only reported if evaluation reaches the import.
+ *
+ * The import callbacks are still only called by one thread at a time, but it may not be the
+ * thread that is evaluating the program.  The default, 0, loads each file when evaluation reaches
+ * it.
+ */
+void jsonnet_import_threads(struct JsonnetVm *vm, unsigned v);
+
+/** Cache the parsed and analysed form of each file in this directory, to save parsing it again
+ * in later runs.  Entries are looked up by a hash of the file's name and content, and the version
+ * of Jsonnet, so they never need to be invalidated, and any number of processes can share the
+ * directory.  Nothing is ever deleted from it.  The default, "", is not to cache.
+ */
+void jsonnet_cache_dir(struct JsonnetVm *vm, const char *v);
+
 /** Bind a Jsonnet external var to the given value.
  *
  * Argument values are copied so memory should be managed by caller.
@@ -91,7 +167,8 @@ void jsonnet_ext_var(struct JsonnetVm *vm, const char *key, const char *val);
  */
 void jsonnet_ext_code(struct JsonnetVm *vm, const char *key, const char *val);
 
-/** If set to 1, will emit the Jsonnet input after parsing / desugaring. */
+/** If set to 1, will emit the Jsonnet input after parsing / desugaring.  If set to 2, will emit
+ * it after static analysis and constant folding as well. */
 void jsonnet_debug_ast(struct JsonnetVm *vm, int v);
 
 /** Set the number of lines of stack trace to display (0 for all of them). */
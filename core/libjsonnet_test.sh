@@ -16,6 +16,7 @@ readonly TEST_SNIPPET="std.assertEqual(({ x: 1, y: self.x } { x: 2 }).y, 2)"
 readonly JSONNET="jsonnet"
 readonly LIBJSONNET_TEST_SNIPPET="libjsonnet_test_snippet"
 readonly LIBJSONNET_TEST_FILE="libjsonnet_test_file"
+readonly LIBJSONNET_TEST_IMPORT="libjsonnet_test_import"
 readonly OBJECT_JSONNET="test_suite/object.jsonnet"
 
 function test_snippet {
@@ -30,10 +31,15 @@ function test_libjsonnet_file {
   $LIBJSONNET_TEST_FILE $OBJECT_JSONNET
 }
 
+function test_libjsonnet_import {
+  $LIBJSONNET_TEST_IMPORT
+}
+
 function main {
   test_snippet
   test_libjsonnet_snippet
   test_libjsonnet_file
+  test_libjsonnet_import
 }
 
 main
@@ -0,0 +1,260 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "core/libjsonnet.h"
+
+/* Serves imports from memory, mostly through the batch import callback, and checks how often each
+ * callback is called, with and without import threads. */
+
+static const char *MAIN =
+    "local a = import \"a.libsonnet\";\n"
+    "local unused = import \"missing.libsonnet\";\n"
+    "{ a: a.x, b: (import \"b.libsonnet\").y, c: importstr \"c.txt\", d: a.d }\n";
+
+static const char *FILES[][2] = {
+    {"a.libsonnet", "{ x: (import \"b.libsonnet\").y + 1, d: import \"d.libsonnet\" }"},
+    {"b.libsonnet", "{ y: 41 }"},
+    {"c.txt", "text"},
+    {"d.libsonnet", "\"left to the import callback\""},
+};
+
+static const char *EXPECTED =
+    "{\n"
+    "   \"a\": 42,\n"
+    "   \"b\": 41,\n"
+    "   \"c\": \"text\",\n"
+    "   \"d\": \"left to the import callback\"\n"
+    "}\n";
+
+struct Counts {
+    struct JsonnetVm *vm;
+    unsigned batches;
+    unsigned batched;
+    unsigned single;
+};
+
+static char *copy(struct JsonnetVm *vm, const char *str)
+{
+    char *r = jsonnet_realloc(vm, NULL, strlen(str) + 1);
+    strcpy(r, str);
+    return r;
+}
+
+static const char *lookup(const char *rel)
+{
+    unsigned i;
+    for (i = 0 ; i < sizeof(FILES) / sizeof(*FILES) ; ++i) {
+        if (!strcmp(FILES[i][0], rel)) return FILES[i][1];
+    }
+    return NULL;
+}
+
+static void import_batch(void *ctx, const char *base, const char * const *rels, size_t n,
+                         char **found_here, char **contents, int *success)
+{
+    struct Counts *counts = ctx;
+    size_t i;
+    (void) base;
+    counts->batches++;
+    for (i = 0 ; i < n ; ++i) {
+        const char *content = lookup(rels[i]);
+        if (!strcmp(rels[i], "d.libsonnet")) continue;
+        counts->batched++;
+        if (content == NULL) {
+            contents[i] = copy(counts->vm, "not found");
+            continue;
+        }
+        found_here[i] = copy(counts->vm, rels[i]);
+        contents[i] = copy(counts->vm, content);
+        success[i] = 1;
+    }
+}
+
+static char *import(void *ctx, const char *base, const char *rel, char **found_here,
+                    int *success)
+{
+    struct Counts *counts = ctx;
+    const char *content = lookup(rel);
+    (void) base;
+    counts->single++;
+    if (content == NULL) {
+        *success = 0;
+        return copy(counts->vm, "not found");
+    }
+    *found_here = copy(counts->vm, rel);
+    *success = 1;
+    return copy(counts->vm, content);
+}
+
+static int test(unsigned threads)
+{
+    int error, failed = 0;
+    char *output;
+    struct Counts counts = {NULL, 0, 0, 0};
+    counts.vm = jsonnet_make();
+    jsonnet_import_callback(counts.vm, import, &counts);
+    jsonnet_import_batch_callback(counts.vm, import_batch, &counts);
+    jsonnet_import_threads(counts.vm, threads);
+    output = jsonnet_evaluate_snippet(counts.vm, "main.jsonnet", MAIN, &error);
+    if (error || strcmp(output, EXPECTED)) {
+        fprintf(stderr, "With %u threads, got:\n%s", threads, output);
+        failed = 1;
+    }
+    /* One batch for main.jsonnet, with a, missing, b and c; one for a.libsonnet, with d.  Only d
+     * is left to the import callback. */
+    if (counts.batches != 2 || counts.batched != 4 || counts.single != 1) {
+        fprintf(stderr, "With %u threads, %u batches of %u imports, and %u single imports\n",
+                threads, counts.batches, counts.batched, counts.single);
+        failed = 1;
+    }
+    jsonnet_realloc(counts.vm, output, 0);
+    jsonnet_destroy(counts.vm);
+    return failed;
+}
+
+/* Checks that the files imported by external code go to the batch callback too. */
+static int test_ext_code(void)
+{
+    int error, failed = 0;
+    char *output;
+    struct Counts counts = {NULL, 0, 0, 0};
+    counts.vm = jsonnet_make();
+    jsonnet_import_callback(counts.vm, import, &counts);
+    jsonnet_import_batch_callback(counts.vm, import_batch, &counts);
+    jsonnet_ext_code(counts.vm, "b", "import \"b.libsonnet\"");
+    output = jsonnet_evaluate_snippet(counts.vm, "main.jsonnet", "std.extVar(\"b\").y", &error);
+    if (error || strcmp(output, "41\n")) {
+        fprintf(stderr, "With external code, got:\n%s", output);
+        failed = 1;
+    }
+    if (counts.batches != 1 || counts.batched != 1 || counts.single != 0) {
+        fprintf(stderr, "With external code, %u batches of %u imports, and %u single imports\n",
+                counts.batches, counts.batched, counts.single);
+        failed = 1;
+    }
+    jsonnet_realloc(counts.vm, output, 0);
+    jsonnet_destroy(counts.vm);
+    return failed;
+}
+
+/* Checks that a .libsonnet file is parsed on an import thread.  main.jsonnet first needs wait.txt,
+ * which the import callback only returns once the batch callback has been asked for d.libsonnet.
+ * That happens when a.libsonnet is parsed, so the interpreter thread cannot be the one parsing it.
+ */
+
+static const char *WAITING_MAIN = "importstr \"wait.txt\" + (import \"a.libsonnet\").x\n";
+
+struct Waiting {
+    struct JsonnetVm *vm;
+    pthread_t interpreter;
+    pthread_mutex_t mutex;
+    pthread_cond_t parsed;
+    int parsed_off_thread;
+    int parsed_on_thread;
+};
+
+static void waiting_import_batch(void *ctx, const char *base, const char * const *rels, size_t n,
+                                 char **found_here, char **contents, int *success)
+{
+    struct Waiting *waiting = ctx;
+    size_t i;
+    (void) base;
+    for (i = 0 ; i < n ; ++i) {
+        const char *content = lookup(rels[i]);
+        if (!strcmp(rels[i], "d.libsonnet")) {
+            pthread_mutex_lock(&waiting->mutex);
+            if (pthread_equal(pthread_self(), waiting->interpreter))
+                waiting->parsed_on_thread = 1;
+            else
+                waiting->parsed_off_thread = 1;
+            pthread_cond_broadcast(&waiting->parsed);
+            pthread_mutex_unlock(&waiting->mutex);
+        }
+        if (content == NULL) continue;
+        found_here[i] = copy(waiting->vm, rels[i]);
+        contents[i] = copy(waiting->vm, content);
+        success[i] = 1;
+    }
+}
+
+static char *waiting_import(void *ctx, const char *base, const char *rel, char **found_here,
+                            int *success)
+{
+    struct Waiting *waiting = ctx;
+    struct timespec deadline;
+    (void) base;
+    (void) rel;
+    /* Give up eventually, rather than hang if nothing parses a.libsonnet. */
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 10;
+    pthread_mutex_lock(&waiting->mutex);
+    while (!waiting->parsed_off_thread && !waiting->parsed_on_thread) {
+        if (pthread_cond_timedwait(&waiting->parsed, &waiting->mutex, &deadline)) break;
+    }
+    pthread_mutex_unlock(&waiting->mutex);
+    *found_here = copy(waiting->vm, "wait.txt");
+    *success = 1;
+    return copy(waiting->vm, "");
+}
+
+static int test_parsed_off_thread(void)
+{
+    int error, failed = 0;
+    char *output;
+    struct Waiting waiting;
+    waiting.vm = jsonnet_make();
+    waiting.interpreter = pthread_self();
+    pthread_mutex_init(&waiting.mutex, NULL);
+    pthread_cond_init(&waiting.parsed, NULL);
+    waiting.parsed_off_thread = 0;
+    waiting.parsed_on_thread = 0;
+    jsonnet_import_callback(waiting.vm, waiting_import, &waiting);
+    jsonnet_import_batch_callback(waiting.vm, waiting_import_batch, &waiting);
+    jsonnet_import_threads(waiting.vm, 2);
+    output = jsonnet_evaluate_snippet(waiting.vm, "main.jsonnet", WAITING_MAIN, &error);
+    if (error || strcmp(output, "\"42\"\n")) {
+        fprintf(stderr, "Waiting for a.libsonnet, got:\n%s", output);
+        failed = 1;
+    }
+    if (!waiting.parsed_off_thread) {
+        fprintf(stderr, "a.libsonnet was %s\n",
+                waiting.parsed_on_thread ? "parsed by the interpreter thread" : "never parsed");
+        failed = 1;
+    }
+    jsonnet_realloc(waiting.vm, output, 0);
+    jsonnet_destroy(waiting.vm);
+    pthread_cond_destroy(&waiting.parsed);
+    pthread_mutex_destroy(&waiting.mutex);
+    return failed;
+}
+
+int main(int argc, const char **argv)
+{
+    (void) argv;
+    if (argc != 1) {
+        fprintf(stderr, "libjsonnet_test_import\n");
+        return EXIT_FAILURE;
+    }
+    if (test(0) || test(4) || test_ext_code() || test_parsed_off_thread()) return EXIT_FAILURE;
+    printf("true\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,375 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <string>
+
+#include "core/number.h"
+
+/* The shortest digits are found with Grisu2, from Florian Loitsch, "Printing Floating-Point
+ * Numbers Quickly and Accurately with Integers", PLDI 2010.  It works with 64 bit integers only.
+ * The result always reads back as the same double, and is the shortest such in all but a tiny
+ * fraction of cases.
+ */
+
+/** A floating point number f * 2^e with a 64 bit significand and no hidden bit. */
+struct DiyFp {
+    uint64_t f;
+    int e;
+
+    DiyFp(uint64_t f, int e) : f(f), e(e) { }
+
+    /** The exact value of a positive finite double. */
+    explicit DiyFp(double d)
+    {
+        uint64_t u;
+        std::memcpy(&u, &d, sizeof u);
+        int biased_e = int((u >> 52) & 0x7ff);
+        uint64_t significand = u & ((uint64_t(1) << 52) - 1);
+        if (biased_e != 0) {
+            f = significand | (uint64_t(1) << 52);
+            e = biased_e - 1075;
+        } else {
+            // Subnormal.
+            f = significand;
+            e = -1074;
+        }
+    }
+
+    DiyFp operator-(const DiyFp &other) const
+    {
+        return DiyFp(f - other.f, e);
+    }
+
+    /** The top 64 bits of the product, rounded. */
+    DiyFp operator*(const DiyFp &other) const
+    {
+        const uint64_t mask = 0xffffffff;
+        uint64_t a = f >> 32, b = f & mask, c = other.f >> 32, d = other.f & mask;
+        uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+        uint64_t mid = (bd >> 32) + (ad & mask) + (bc & mask) + (uint64_t(1) << 31);
+        return DiyFp(ac + (ad >> 32) + (bc >> 32) + (mid >> 32), e + other.e + 64);
+    }
+
+    /** Shift so that the top bit of f is set. */
+    DiyFp normalize(void) const
+    {
+        DiyFp r = *this;
+        while (!(r.f & (uint64_t(1) << 63))) {
+            r.f <<= 1;
+            r.e--;
+        }
+        return r;
+    }
+};
+
+/** The normalized cached powers 10^-348, 10^-340, ... 10^340, rounded to 64 bits. */
+static const struct { uint64_t f; int e; } CACHED_POWERS[] = {
+    {0xfa8fd5a0081c0288ULL, -1220},
+    {0xbaaee17fa23ebf76ULL, -1193},
+    {0x8b16fb203055ac76ULL, -1166},
+    {0xcf42894a5dce35eaULL, -1140},
+    {0x9a6bb0aa55653b2dULL, -1113},
+    {0xe61acf033d1a45dfULL, -1087},
+    {0xab70fe17c79ac6caULL, -1060},
+    {0xff77b1fcbebcdc4fULL, -1034},
+    {0xbe5691ef416bd60cULL, -1007},
+    {0x8dd01fad907ffc3cULL, -980},
+    {0xd3515c2831559a83ULL, -954},
+    {0x9d71ac8fada6c9b5ULL, -927},
+    {0xea9c227723ee8bcbULL, -901},
+    {0xaecc49914078536dULL, -874},
+    {0x823c12795db6ce57ULL, -847},
+    {0xc21094364dfb5637ULL, -821},
+    {0x9096ea6f3848984fULL, -794},
+    {0xd77485cb25823ac7ULL, -768},
+    {0xa086cfcd97bf97f4ULL, -741},
+    {0xef340a98172aace5ULL, -715},
+    {0xb23867fb2a35b28eULL, -688},
+    {0x84c8d4dfd2c63f3bULL, -661},
+    {0xc5dd44271ad3cdbaULL, -635},
+    {0x936b9fcebb25c996ULL, -608},
+    {0xdbac6c247d62a584ULL, -582},
+    {0xa3ab66580d5fdaf6ULL, -555},
+    {0xf3e2f893dec3f126ULL, -529},
+    {0xb5b5ada8aaff80b8ULL, -502},
+    {0x87625f056c7c4a8bULL, -475},
+    {0xc9bcff6034c13053ULL, -449},
+    {0x964e858c91ba2655ULL, -422},
+    {0xdff9772470297ebdULL, -396},
+    {0xa6dfbd9fb8e5b88fULL, -369},
+    {0xf8a95fcf88747d94ULL, -343},
+    {0xb94470938fa89bcfULL, -316},
+    {0x8a08f0f8bf0f156bULL, -289},
+    {0xcdb02555653131b6ULL, -263},
+    {0x993fe2c6d07b7facULL, -236},
+    {0xe45c10c42a2b3b06ULL, -210},
+    {0xaa242499697392d3ULL, -183},
+    {0xfd87b5f28300ca0eULL, -157},
+    {0xbce5086492111aebULL, -130},
+    {0x8cbccc096f5088ccULL, -103},
+    {0xd1b71758e219652cULL, -77},
+    {0x9c40000000000000ULL, -50},
+    {0xe8d4a51000000000ULL, -24},
+    {0xad78ebc5ac620000ULL, 3},
+    {0x813f3978f8940984ULL, 30},
+    {0xc097ce7bc90715b3ULL, 56},
+    {0x8f7e32ce7bea5c70ULL, 83},
+    {0xd5d238a4abe98068ULL, 109},
+    {0x9f4f2726179a2245ULL, 136},
+    {0xed63a231d4c4fb27ULL, 162},
+    {0xb0de65388cc8ada8ULL, 189},
+    {0x83c7088e1aab65dbULL, 216},
+    {0xc45d1df942711d9aULL, 242},
+    {0x924d692ca61be758ULL, 269},
+    {0xda01ee641a708deaULL, 295},
+    {0xa26da3999aef774aULL, 322},
+    {0xf209787bb47d6b85ULL, 348},
+    {0xb454e4a179dd1877ULL, 375},
+    {0x865b86925b9bc5c2ULL, 402},
+    {0xc83553c5c8965d3dULL, 428},
+    {0x952ab45cfa97a0b3ULL, 455},
+    {0xde469fbd99a05fe3ULL, 481},
+    {0xa59bc234db398c25ULL, 508},
+    {0xf6c69a72a3989f5cULL, 534},
+    {0xb7dcbf5354e9beceULL, 561},
+    {0x88fcf317f22241e2ULL, 588},
+    {0xcc20ce9bd35c78a5ULL, 614},
+    {0x98165af37b2153dfULL, 641},
+    {0xe2a0b5dc971f303aULL, 667},
+    {0xa8d9d1535ce3b396ULL, 694},
+    {0xfb9b7cd9a4a7443cULL, 720},
+    {0xbb764c4ca7a44410ULL, 747},
+    {0x8bab8eefb6409c1aULL, 774},
+    {0xd01fef10a657842cULL, 800},
+    {0x9b10a4e5e9913129ULL, 827},
+    {0xe7109bfba19c0c9dULL, 853},
+    {0xac2820d9623bf429ULL, 880},
+    {0x80444b5e7aa7cf85ULL, 907},
+    {0xbf21e44003acdd2dULL, 933},
+    {0x8e679c2f5e44ff8fULL, 960},
+    {0xd433179d9c8cb841ULL, 986},
+    {0x9e19db92b4e31ba9ULL, 1013},
+    {0xeb96bf6ebadf77d9ULL, 1039},
+    {0xaf87023b9bf0ee6bULL, 1066},
+};
+
+/** Find a cached power c = 10^-k such that e + c.e + 64 is in [-60, -32]. */
+static DiyFp cached_power(int e, int &k)
+{
+    // log10(2) * (-61 - e), rounded up and made non-negative.
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int ik = int(dk);
+    if (dk - ik > 0.0) ik++;
+    unsigned index = unsigned((ik >> 3) + 1);
+    k = -(-348 + int(index << 3));
+    return DiyFp(CACHED_POWERS[index].f, CACHED_POWERS[index].e);
+}
+
+static const uint64_t POW10[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL,
+    1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+    1000000000000000000ULL, 10000000000000000000ULL
+};
+
+/** Move the last digit towards w while it stays inside the rounding interval. */
+static void grisu_round(char *digits, unsigned len, uint64_t delta, uint64_t rest,
+                        uint64_t ten_kappa, uint64_t wp_w)
+{
+    while (rest < wp_w && delta - rest >= ten_kappa
+           && (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+        digits[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+/** Generate the digits of mp until they are inside the interval (mp - delta, mp].
+ *
+ * \param w The scaled number itself.
+ * \param mp The scaled upper boundary.
+ * \param delta The width of the interval.
+ * \param digits Set to the digits.
+ * \param len Set to the number of digits.
+ * \param k Incremented by the decimal exponent of the last digit.
+ */
+static void digit_gen(const DiyFp &w, const DiyFp &mp, uint64_t delta, char *digits,
+                      unsigned &len, int &k)
+{
+    const DiyFp one(uint64_t(1) << -mp.e, mp.e);
+    const uint64_t wp_w = (mp - w).f;
+    uint32_t p1 = uint32_t(mp.f >> -one.e);
+    uint64_t p2 = mp.f & (one.f - 1);
+    int kappa = 1;
+    while (kappa < 10 && p1 >= POW10[kappa])
+        kappa++;
+    len = 0;
+
+    // The integral part.
+    while (kappa > 0) {
+        uint32_t d = uint32_t(p1 / POW10[kappa - 1]);
+        p1 %= uint32_t(POW10[kappa - 1]);
+        if (d || len)
+            digits[len++] = char('0' + d);
+        kappa--;
+        uint64_t rest = (uint64_t(p1) << -one.e) + p2;
+        if (rest <= delta) {
+            k += kappa;
+            grisu_round(digits, len, delta, rest, POW10[kappa] << -one.e, wp_w);
+            return;
+        }
+    }
+
+    // The fractional part.
+    for (;;) {
+        p2 *= 10;
+        delta *= 10;
+        char d = char(p2 >> -one.e);
+        if (d || len)
+            digits[len++] = char('0' + d);
+        p2 &= one.f - 1;
+        kappa--;
+        if (p2 < delta) {
+            k += kappa;
+            unsigned index = unsigned(-kappa);
+            grisu_round(digits, len, delta, p2, one.f, wp_w * (index < 20 ? POW10[index] : 0));
+            return;
+        }
+    }
+}
+
+/** Find the digits of a positive finite v, so that v reads back from digits * 10^k. */
+static void grisu2(double v, char *digits, unsigned &len, int &k)
+{
+    const DiyFp d(v);
+
+    // The boundaries halfway to the neighbouring doubles, with the same exponent.  The lower one
+    // is closer when v is a power of two, as the exponent changes below it.
+    DiyFp plus = DiyFp((d.f << 1) + 1, d.e - 1).normalize();
+    DiyFp minus = d.f == (uint64_t(1) << 52) && d.e > -1074
+                ? DiyFp((d.f << 2) - 1, d.e - 2)
+                : DiyFp((d.f << 1) - 1, d.e - 1);
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+
+    const DiyFp c_mk = cached_power(plus.e, k);
+    const DiyFp w = d.normalize() * c_mk;
+    DiyFp wp = plus * c_mk;
+    DiyFp wm = minus * c_mk;
+    // Allow for the error of the multiplications.
+    wm.f++;
+    wp.f--;
+    digit_gen(w, wp, wp.f - wm.f, digits, len, k);
+}
+
+/** Write the digits of an integer below 2^64, returning the number of characters. */
+static unsigned format_integer(uint64_t v, char *buf)
+{
+    char tmp[20];
+    unsigned len = 0;
+    do {
+        tmp[len++] = char('0' + v % 10);
+        v /= 10;
+    } while (v != 0);
+    for (unsigned i = 0 ; i < len ; ++i)
+        buf[i] = tmp[len - 1 - i];
+    return len;
+}
+
+/** Lay out digits * 10^k the way %.17g would, but with integers below 1e21 in full. */
+static unsigned format_digits(const char *digits, unsigned len, int k, char *buf)
+{
+    int exponent = int(len) + k - 1;
+    char *c = buf;
+    if (exponent >= -4 && exponent < 21) {
+        if (k >= 0) {
+            std::memcpy(c, digits, len);
+            c += len;
+            for (int i = 0 ; i < k ; ++i)
+                *(c++) = '0';
+        } else if (exponent >= 0) {
+            std::memcpy(c, digits, exponent + 1);
+            c += exponent + 1;
+            *(c++) = '.';
+            std::memcpy(c, digits + exponent + 1, len - exponent - 1);
+            c += len - exponent - 1;
+        } else {
+            *(c++) = '0';
+            *(c++) = '.';
+            for (int i = 0 ; i < -exponent - 1 ; ++i)
+                *(c++) = '0';
+            std::memcpy(c, digits, len);
+            c += len;
+        }
+    } else {
+        *(c++) = digits[0];
+        if (len > 1) {
+            *(c++) = '.';
+            std::memcpy(c, digits + 1, len - 1);
+            c += len - 1;
+        }
+        *(c++) = 'e';
+        *(c++) = exponent < 0 ? '-' : '+';
+        unsigned abs_exponent = unsigned(exponent < 0 ? -exponent : exponent);
+        if (abs_exponent < 10)
+            *(c++) = '0';
+        c += format_integer(abs_exponent, c);
+    }
+    return unsigned(c - buf);
+}
+
+unsigned jsonnet_format_number(double v, bool compat, char *buf)
+{
+    char *c = buf;
+    if (std::signbit(v)) {
+        *(c++) = '-';
+        v = -v;
+    }
+    if (v == std::floor(v) && v < 1e17) {
+        // The common case of integers, the same in both formats.
+        c += format_integer(uint64_t(v), c);
+    } else if (compat || !std::isfinite(v)) {
+        // See "What Every Computer Scientist Should Know About Floating-Point Arithmetic"
+        // Theorem 15
+        // http://docs.oracle.com/cd/E19957-01/806-3568/ncg_goldberg.html
+        int n = std::snprintf(c, JSONNET_NUMBER_BUFFER - 1, v == std::floor(v) ? "%.0f" : "%.17g",
+                              v);
+        c += n;
+    } else {
+        char digits[20];
+        unsigned len;
+        int k;
+        grisu2(v, digits, len, k);
+        while (len > 1 && digits[len - 1] == '0') {
+            len--;
+            k++;
+        }
+        c += format_digits(digits, len, k, c);
+    }
+    *c = '\0';
+    return unsigned(c - buf);
+}
+
+std::string jsonnet_unparse_number(double v, bool compat)
+{
+    char buf[JSONNET_NUMBER_BUFFER];
+    unsigned len = jsonnet_format_number(v, compat, buf);
+    return std::string(buf, len);
+}
@@ -0,0 +1,45 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef JSONNET_NUMBER_H
+#define JSONNET_NUMBER_H
+
+#include <string>
+
+/** Enough room for any output of jsonnet_format_number, including the \0.  The compatible format
+ * writes integers in full, which can take 309 digits.
+ */
+#define JSONNET_NUMBER_BUFFER 320
+
+/** Write a number as text.
+ *
+ * By default this is the shortest decimal that reads back as exactly the same double, found with
+ * the Grisu2 algorithm.  It is laid out like printf's %g: plain digits from 1e-4 up to 1e21, and
+ * exponent notation outside that.  So integers below 1e17 come out as they always have, e.g. 42,
+ * and other numbers lose the noise digits, e.g. 0.1 rather than 0.10000000000000001.
+ *
+ * \param v The number.
+ * \param compat Instead give exactly the text of earlier versions: every digit of integers, and
+ * %.17g for everything else.
+ * \param buf Where to write the text, of size JSONNET_NUMBER_BUFFER.
+ * \returns The length of the text, which is followed by a \0.
+ */
+unsigned jsonnet_format_number(double v, bool compat, char *buf);
+
+/** As jsonnet_format_number, but returns the text as a string. */
+std::string jsonnet_unparse_number(double v, bool compat=false);
+
+#endif  // JSONNET_NUMBER_H
@@ -0,0 +1,177 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "core/number.h"
+
+// Checks that numbers read back from jsonnet_format_number as the same double, that the digits are
+// (nearly always) the shortest possible, and that the compatible format matches the old
+// stringstream code byte for byte.  With --benchmark, reports the speed of each.
+
+/** How numbers were formatted before jsonnet_format_number. */
+static std::string old_unparse_number(double v)
+{
+    std::stringstream ss;
+    if (v == floor(v)) {
+        ss << std::fixed << std::setprecision(0) << v;
+    } else {
+        ss << std::setprecision(17);
+        ss << v;
+    }
+    return ss.str();
+}
+
+/** The number of significant digits in the shortest %g that reads back as v. */
+static unsigned shortest_digits(double v)
+{
+    char buf[64];
+    for (unsigned precision = 1 ; precision < 17 ; ++precision) {
+        std::snprintf(buf, sizeof buf, "%.*g", precision, v);
+        if (std::strtod(buf, nullptr) == v) return precision;
+    }
+    return 17;
+}
+
+/** The number of significant digits in formatted text. */
+static unsigned count_digits(const char *text)
+{
+    std::string digits;
+    for (const char *c = text ; *c != '\0' && *c != 'e' ; ++c) {
+        if (*c >= '0' && *c <= '9') digits += *c;
+    }
+    digits.erase(0, digits.find_first_not_of('0'));
+    digits.erase(digits.find_last_not_of('0') + 1);
+    return digits.length() == 0 ? 1 : digits.length();
+}
+
+/** Random doubles of every magnitude, and some that are more common in practice. */
+static std::vector<double> test_numbers(unsigned n)
+{
+    std::mt19937_64 rng(42);
+    std::vector<double> r = {
+        0, -0.0, 1, -1, 0.1, 0.2, 0.3, 1.5, 100, 1e16, 1e17, 1e21, 1e22, 1e23, 1e-4, 1e-5,
+        0.0001234, 123456789.125, 9007199254740992.0, 9007199254740993.0, 1.0 / 3, 2.0 / 3,
+        5e-324, 2.2250738585072009e-308, 2.2250738585072014e-308, 1.7976931348623157e308,
+    };
+    for (unsigned i = 0 ; i < n ; ++i) {
+        uint64_t bits = rng();
+        double d;
+        std::memcpy(&d, &bits, sizeof d);
+        if (std::isfinite(d)) r.push_back(d);
+        r.push_back(double(rng() % 100000) / 100);
+        r.push_back(double(int64_t(rng() % 2000000) - 1000000) * 0.001);
+    }
+    return r;
+}
+
+static int test(void)
+{
+    unsigned longer = 0;
+    std::vector<double> numbers = test_numbers(300000);
+    for (double v : numbers) {
+        char buf[JSONNET_NUMBER_BUFFER];
+        unsigned len = jsonnet_format_number(v, false, buf);
+        if (len != std::strlen(buf) || std::strtod(buf, nullptr) != v
+            || std::signbit(std::strtod(buf, nullptr)) != std::signbit(v)) {
+            std::cerr << "Number " << std::setprecision(17) << v << " formatted as " << buf
+                      << std::endl;
+            return EXIT_FAILURE;
+        }
+        unsigned digits = count_digits(buf), shortest = shortest_digits(v);
+        if (digits < shortest) {
+            std::cerr << "Number " << std::setprecision(17) << v << " formatted as " << buf
+                      << ", expected " << shortest << " digits" << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (digits > shortest) longer++;
+
+        std::string compat = jsonnet_unparse_number(v, true);
+        std::string old = old_unparse_number(v);
+        if (compat != old) {
+            std::cerr << "Number " << old << " formatted as " << compat << " in compatible mode"
+                      << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    // Grisu2 misses the shortest digits when they are exactly halfway between two doubles, as
+    // for 1e23, and in a few other cases.
+    if (longer * 1000 > numbers.size()) {
+        std::cerr << longer << " of " << numbers.size() << " numbers were not the shortest"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/** The time taken by f for each number, in nanoseconds. */
+template <class F> static double time_each(const std::vector<double> &numbers, F f)
+{
+    auto start = std::chrono::steady_clock::now();
+    unsigned long total = 0;
+    for (double v : numbers)
+        total += f(v);
+    std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+    if (total == 0) std::cerr << "No output" << std::endl;
+    return secs.count() * 1e9 / numbers.size();
+}
+
+static int benchmark(void)
+{
+    std::vector<double> numbers = test_numbers(1000000);
+    char buf[JSONNET_NUMBER_BUFFER];
+    double old = time_each(numbers, [&] (double v) { return old_unparse_number(v).length(); });
+    double compat = time_each(numbers, [&] (double v) {
+        return jsonnet_format_number(v, true, buf);
+    });
+    double shortest = time_each(numbers, [&] (double v) {
+        return jsonnet_format_number(v, false, buf);
+    });
+    unsigned long old_bytes = 0, shortest_bytes = 0;
+    for (double v : numbers) {
+        old_bytes += old_unparse_number(v).length();
+        shortest_bytes += jsonnet_format_number(v, false, buf);
+    }
+    std::cout << "stringstream: " << old << " ns/number, " << old_bytes << " bytes" << std::endl;
+    std::cout << "compatible: " << compat << " ns/number" << std::endl;
+    std::cout << "shortest: " << shortest << " ns/number, " << shortest_bytes << " bytes"
+              << std::endl;
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, const char **argv)
+{
+    if (argc == 2 && std::string(argv[1]) == "--benchmark") {
+        return benchmark();
+    }
+    if (argc != 1) {
+        std::cerr << "number_test [--benchmark]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    return test();
+}
@@ -0,0 +1,897 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern "C" {
+#include "core/libjsonnet.h"
+}
+
+#include "core/constant_folding.h"
+#include "core/desugaring.h"
+#include "core/hash.h"
+#include "core/parse_cache.h"
+#include "core/parser.h"
+#include "core/static_analysis.h"
+#include "core/strictness_analysis.h"
+
+/* A cache entry is a header followed by the serialized AST.  The header has:
+ *
+ *   MAGIC, FORMAT_VERSION and ENDIAN_MARK, the last two as 4 byte numbers;
+ *   the key of the entry, which is also its file name, and the name of the parsed file;
+ *   the hash of the rest of the entry, so that damaged entries are never used.
+ *
+ * The AST is a table of identifiers, a table of file names (of locations), and then the nodes,
+ * each of which only refers to nodes before it.  All numbers are 4 bytes in the order of the
+ * machine that wrote them, and references are indices into the tables, or NONE for null.
+ *
+ * Every file is parsed with its own copy of the standard library, which is most of its AST.  So
+ * the standard library is written to an entry of its own, the prelude, named after its hash.  The
+ * entry of a file starts with the name of its prelude, and its tables carry on from the prelude's.
+ */
+
+namespace {
+
+const char MAGIC[8] = {'J', 'S', 'O', 'N', 'N', 'E', 'T', '\0'};
+
+/** Bump this whenever the AST structs, or what the analyses leave in them, change. */
+const uint32_t FORMAT_VERSION = 1;
+
+const uint32_t ENDIAN_MARK = 0x01020304;
+
+const uint32_t NONE = 0xffffffff;
+
+void put(std::string &out, uint32_t v)
+{
+    char buf[sizeof v];
+    std::memcpy(buf, &v, sizeof v);
+    out.append(buf, sizeof v);
+}
+
+void put(std::string &out, const std::string &v)
+{
+    put(out, uint32_t(v.length()));
+    out += v;
+}
+
+void put(std::string &out, const String &v)
+{
+    put(out, uint32_t(v.length()));
+    out.append(reinterpret_cast<const char*>(v.data()), v.length() * sizeof(char32_t));
+}
+
+bool name_less(const Identifier *a, const Identifier *b)
+{
+    return a->name < b->name;
+}
+
+/** Writes ASTs in segments, each with the identifiers, file names and nodes that were new to it.
+ *
+ * Identifiers are compared by address in the AST, which depends on the order they were interned
+ * in.  The writer orders them by name instead, so that the same code is always written the same
+ * way, whatever was parsed before it.
+ */
+class Writer {
+    std::string identifiers;
+    std::map<const Identifier*, uint32_t> identifierIndex;
+    std::string files;
+    std::map<const std::string*, uint32_t> fileIndex;
+    std::string nodes;
+    std::map<const AST*, uint32_t> nodeIndex;
+
+    /** The sizes of the indexes at the start of the segment. */
+    uint32_t identifiersBefore;
+    uint32_t filesBefore;
+    uint32_t nodesBefore;
+
+    uint32_t identifier(const Identifier *id)
+    {
+        if (id == nullptr) return NONE;
+        auto it = identifierIndex.find(id);
+        if (it != identifierIndex.end()) return it->second;
+        put(identifiers, id->name);
+        uint32_t r = identifierIndex.size();
+        identifierIndex[id] = r;
+        return r;
+    }
+
+    uint32_t file(const std::string *f)
+    {
+        if (f == nullptr) return NONE;
+        auto it = fileIndex.find(f);
+        if (it != fileIndex.end()) return it->second;
+        put(files, *f);
+        uint32_t r = fileIndex.size();
+        fileIndex[f] = r;
+        return r;
+    }
+
+    void putIdentifiers(std::string &out, const std::vector<const Identifier*> &ids)
+    {
+        put(out, uint32_t(ids.size()));
+        for (const auto *id : ids)
+            put(out, identifier(id));
+    }
+
+    void putNodes(std::string &out, const std::vector<AST*> &asts)
+    {
+        put(out, uint32_t(asts.size()));
+        for (const auto *ast : asts)
+            put(out, node(ast));
+    }
+
+    void putSpecs(std::string &out, const std::vector<ComprehensionSpec> &specs)
+    {
+        put(out, uint32_t(specs.size()));
+        for (const auto &spec : specs) {
+            put(out, uint32_t(spec.kind));
+            put(out, identifier(spec.var));
+            put(out, node(spec.expr));
+        }
+    }
+
+    public:
+
+    Writer(void)
+      : identifiersBefore(0), filesBefore(0), nodesBefore(0)
+    { }
+
+    /** Writes the node after its children, and returns its index. */
+    uint32_t node(const AST *ast_)
+    {
+        if (ast_ == nullptr) return NONE;
+        auto it = nodeIndex.find(ast_);
+        if (it != nodeIndex.end()) return it->second;
+
+        std::string out;
+        put(out, uint32_t(ast_->type));
+        put(out, file(ast_->location.file));
+        put(out, ast_->location.begin.line);
+        put(out, ast_->location.begin.column);
+        put(out, ast_->location.end.line);
+        put(out, ast_->location.end.column);
+        std::vector<const Identifier*> free_variables = ast_->freeVariables;
+        std::sort(free_variables.begin(), free_variables.end(), name_less);
+        putIdentifiers(out, free_variables);
+
+        switch (ast_->type) {
+            case AST_APPLY: {
+                const auto *ast = static_cast<const Apply*>(ast_);
+                put(out, node(ast->target));
+                putNodes(out, ast->arguments);
+                put(out, uint32_t(ast->tailstrict));
+            } break;
+
+            case AST_ARRAY: {
+                const auto *ast = static_cast<const Array*>(ast_);
+                putNodes(out, ast->elements);
+            } break;
+
+            case AST_ARRAY_COMPREHENSION: {
+                const auto *ast = static_cast<const ArrayComprehension*>(ast_);
+                put(out, node(ast->body));
+                putSpecs(out, ast->specs);
+            } break;
+
+            case AST_BINARY: {
+                const auto *ast = static_cast<const Binary*>(ast_);
+                put(out, node(ast->left));
+                put(out, uint32_t(ast->op));
+                put(out, node(ast->right));
+            } break;
+
+            case AST_BUILTIN_FUNCTION: {
+                const auto *ast = static_cast<const BuiltinFunction*>(ast_);
+                put(out, uint32_t(ast->id));
+                putIdentifiers(out, ast->params);
+            } break;
+
+            case AST_CONDITIONAL: {
+                const auto *ast = static_cast<const Conditional*>(ast_);
+                put(out, node(ast->cond));
+                put(out, node(ast->branchTrue));
+                put(out, node(ast->branchFalse));
+            } break;
+
+            case AST_ERROR: {
+                const auto *ast = static_cast<const Error*>(ast_);
+                put(out, node(ast->expr));
+            } break;
+
+            case AST_FUNCTION: {
+                const auto *ast = static_cast<const Function*>(ast_);
+                putIdentifiers(out, ast->parameters);
+                put(out, node(ast->body));
+                put(out, uint32_t(ast->strictParams.size()));
+                for (bool strict : ast->strictParams)
+                    put(out, uint32_t(strict));
+            } break;
+
+            case AST_IMPORT: {
+                const auto *ast = static_cast<const Import*>(ast_);
+                put(out, ast->file);
+            } break;
+
+            case AST_IMPORTSTR: {
+                const auto *ast = static_cast<const Importstr*>(ast_);
+                put(out, ast->file);
+            } break;
+
+            case AST_INDEX: {
+                const auto *ast = static_cast<const Index*>(ast_);
+                put(out, node(ast->target));
+                put(out, node(ast->index));
+            } break;
+
+            case AST_LOCAL: {
+                const auto *ast = static_cast<const Local*>(ast_);
+                std::vector<const Identifier*> ids;
+                for (const auto &bind : ast->binds)
+                    ids.push_back(bind.first);
+                std::sort(ids.begin(), ids.end(), name_less);
+                put(out, uint32_t(ids.size()));
+                for (const auto *id : ids) {
+                    put(out, identifier(id));
+                    put(out, node(ast->binds.at(id)));
+                }
+                put(out, node(ast->body));
+            } break;
+
+            case AST_LITERAL_BOOLEAN: {
+                const auto *ast = static_cast<const LiteralBoolean*>(ast_);
+                put(out, uint32_t(ast->value));
+            } break;
+
+            case AST_LITERAL_NUMBER: {
+                const auto *ast = static_cast<const LiteralNumber*>(ast_);
+                char buf[sizeof ast->value];
+                std::memcpy(buf, &ast->value, sizeof ast->value);
+                out.append(buf, sizeof buf);
+            } break;
+
+            case AST_LITERAL_STRING: {
+                const auto *ast = static_cast<const LiteralString*>(ast_);
+                put(out, ast->value);
+            } break;
+
+            case AST_OBJECT: {
+                const auto *ast = static_cast<const Object*>(ast_);
+                put(out, uint32_t(ast->fields.size()));
+                for (const auto &field : ast->fields) {
+                    put(out, node(field.name));
+                    put(out, uint32_t(field.hide));
+                    put(out, node(field.body));
+                }
+                putNodes(out, ast->asserts);
+            } break;
+
+            case AST_OBJECT_COMPREHENSION_SIMPLE: {
+                const auto *ast = static_cast<const ObjectComprehensionSimple*>(ast_);
+                put(out, node(ast->field));
+                put(out, node(ast->value));
+                put(out, identifier(ast->id));
+                put(out, node(ast->array));
+            } break;
+
+            case AST_LITERAL_NULL:
+            case AST_SELF:
+            case AST_SUPER:
+            break;
+
+            case AST_UNARY: {
+                const auto *ast = static_cast<const Unary*>(ast_);
+                put(out, uint32_t(ast->op));
+                put(out, node(ast->expr));
+            } break;
+
+            case AST_VAR: {
+                const auto *ast = static_cast<const Var*>(ast_);
+                put(out, identifier(ast->id));
+                put(out, identifier(ast->original));
+            } break;
+
+            default:
+            std::cerr << "INTERNAL ERROR: Cannot serialize AST type " << ast_->type << std::endl;
+            std::abort();
+        }
+
+        nodes += out;
+        uint32_t r = nodeIndex.size();
+        nodeIndex[ast_] = r;
+        return r;
+    }
+
+    /** The tables and nodes written since the last segment. */
+    std::string segment(void)
+    {
+        std::string r;
+        put(r, uint32_t(identifierIndex.size() - identifiersBefore));
+        r += identifiers;
+        put(r, uint32_t(fileIndex.size() - filesBefore));
+        r += files;
+        put(r, uint32_t(nodeIndex.size() - nodesBefore));
+        r += nodes;
+        identifiers.clear();
+        files.clear();
+        nodes.clear();
+        identifiersBefore = identifierIndex.size();
+        filesBefore = fileIndex.size();
+        nodesBefore = nodeIndex.size();
+        return r;
+    }
+
+    /** The last segment, followed by the given root and imports. */
+    std::string finish(uint32_t root, const std::vector<uint32_t> &imports)
+    {
+        std::string r = segment();
+        put(r, root);
+        put(r, uint32_t(imports.size()));
+        for (uint32_t import : imports)
+            put(r, import);
+        return r;
+    }
+};
+
+/** Thrown by Reader when the bytes end early or refer to something that does not exist. */
+struct Corrupt { };
+
+class Reader {
+    Allocator *alloc;
+    const char *p;
+    const char *end;
+    std::vector<const Identifier*> identifiers;
+    std::vector<const std::string*> files;
+    std::vector<AST*> nodes;
+
+    public:
+
+    Reader(Allocator *alloc, const char *data, std::size_t length)
+      : alloc(alloc), p(data), end(data + length)
+    { }
+
+    bool atEnd(void) const
+    {
+        return p == end;
+    }
+
+    /** Go on to another segment, which may refer to what was read before. */
+    void reset(const char *data, std::size_t length)
+    {
+        p = data;
+        end = data + length;
+    }
+
+    uint32_t u32(void)
+    {
+        uint32_t r;
+        if (std::size_t(end - p) < sizeof r) throw Corrupt();
+        std::memcpy(&r, p, sizeof r);
+        p += sizeof r;
+        return r;
+    }
+
+    /** A value of an enum whose values run from 0 to last. */
+    template <class T> T enumeration(T last)
+    {
+        uint32_t r = u32();
+        if (r > uint32_t(last)) throw Corrupt();
+        return T(r);
+    }
+
+    /** A count of things that each take at least size bytes. */
+    uint32_t count(std::size_t size)
+    {
+        uint32_t r = u32();
+        if (r > std::size_t(end - p) / size) throw Corrupt();
+        return r;
+    }
+
+    std::string string(void)
+    {
+        uint32_t length = count(1);
+        std::string r(p, length);
+        p += length;
+        return r;
+    }
+
+    String string32(void)
+    {
+        uint32_t length = count(sizeof(char32_t));
+        String r(length, U'\0');
+        std::memcpy(&r[0], p, length * sizeof(char32_t));
+        p += length * sizeof(char32_t);
+        return r;
+    }
+
+    const Identifier *identifier(void)
+    {
+        uint32_t i = u32();
+        if (i == NONE) return nullptr;
+        if (i >= identifiers.size()) throw Corrupt();
+        return identifiers[i];
+    }
+
+    std::vector<const Identifier*> identifierVector(void)
+    {
+        std::vector<const Identifier*> r(count(sizeof(uint32_t)));
+        for (auto &id : r)
+            id = identifier();
+        return r;
+    }
+
+    /** A reference to a node that has already been read. */
+    AST *node(void)
+    {
+        uint32_t i = u32();
+        if (i == NONE) return nullptr;
+        if (i >= nodes.size()) throw Corrupt();
+        return nodes[i];
+    }
+
+    std::vector<AST*> nodeVector(void)
+    {
+        std::vector<AST*> r(count(sizeof(uint32_t)));
+        for (auto &ast : r)
+            ast = node();
+        return r;
+    }
+
+    std::vector<ComprehensionSpec> specs(void)
+    {
+        std::vector<ComprehensionSpec> r;
+        uint32_t n = count(3 * sizeof(uint32_t));
+        for (uint32_t i = 0 ; i < n ; ++i) {
+            auto kind = enumeration(ComprehensionSpec::IF);
+            const Identifier *var = identifier();
+            AST *expr = node();
+            r.emplace_back(kind, var, expr);
+        }
+        return r;
+    }
+
+    /** Read a node and append it to the nodes. */
+    void readNode(void)
+    {
+        auto type = enumeration(AST_VAR);
+        uint32_t file = u32();
+        if (file != NONE && file >= files.size()) throw Corrupt();
+        Location begin, end;
+        begin.line = u32();
+        begin.column = u32();
+        end.line = u32();
+        end.column = u32();
+        LocationRange lr(file == NONE ? nullptr : files[file], begin, end);
+        std::vector<const Identifier*> free_variables = identifierVector();
+        // As jsonnet_static_analysis leaves them.
+        std::sort(free_variables.begin(), free_variables.end());
+
+        AST *r;
+        switch (type) {
+            case AST_APPLY: {
+                AST *target = node();
+                std::vector<AST*> arguments = nodeVector();
+                bool tailstrict = u32();
+                r = alloc->make<Apply>(lr, target, arguments, tailstrict);
+            } break;
+
+            case AST_ARRAY: {
+                r = alloc->make<Array>(lr, nodeVector());
+            } break;
+
+            case AST_ARRAY_COMPREHENSION: {
+                AST *body = node();
+                r = alloc->make<ArrayComprehension>(lr, body, specs());
+            } break;
+
+            case AST_BINARY: {
+                AST *left = node();
+                auto op = enumeration(BOP_OR);
+                AST *right = node();
+                r = alloc->make<Binary>(lr, left, op, right);
+            } break;
+
+            case AST_BUILTIN_FUNCTION: {
+                unsigned long id = u32();
+                r = alloc->make<BuiltinFunction>(lr, id, identifierVector());
+            } break;
+
+            case AST_CONDITIONAL: {
+                AST *cond = node();
+                AST *branch_true = node();
+                AST *branch_false = node();
+                r = alloc->make<Conditional>(lr, cond, branch_true, branch_false);
+            } break;
+
+            case AST_ERROR: {
+                r = alloc->make<Error>(lr, node());
+            } break;
+
+            case AST_FUNCTION: {
+                std::vector<const Identifier*> parameters = identifierVector();
+                AST *body = node();
+                auto *function = alloc->make<Function>(lr, parameters, body);
+                function->strictParams.resize(count(sizeof(uint32_t)));
+                for (std::size_t i = 0 ; i < function->strictParams.size() ; ++i)
+                    function->strictParams[i] = u32();
+                r = function;
+            } break;
+
+            case AST_IMPORT: {
+                r = alloc->make<Import>(lr, string32());
+            } break;
+
+            case AST_IMPORTSTR: {
+                r = alloc->make<Importstr>(lr, string32());
+            } break;
+
+            case AST_INDEX: {
+                AST *target = node();
+                AST *index = node();
+                r = alloc->make<Index>(lr, target, index);
+            } break;
+
+            case AST_LOCAL: {
+                Local::Binds binds;
+                uint32_t n = count(2 * sizeof(uint32_t));
+                for (uint32_t i = 0 ; i < n ; ++i) {
+                    const Identifier *id = identifier();
+                    binds[id] = node();
+                }
+                r = alloc->make<Local>(lr, binds, node());
+            } break;
+
+            case AST_LITERAL_BOOLEAN: {
+                r = alloc->make<LiteralBoolean>(lr, u32() != 0);
+            } break;
+
+            case AST_LITERAL_NULL: {
+                r = alloc->make<LiteralNull>(lr);
+            } break;
+
+            case AST_LITERAL_NUMBER: {
+                double value;
+                if (std::size_t(this->end - p) < sizeof value) throw Corrupt();
+                std::memcpy(&value, p, sizeof value);
+                p += sizeof value;
+                r = alloc->make<LiteralNumber>(lr, value);
+            } break;
+
+            case AST_LITERAL_STRING: {
+                r = alloc->make<LiteralString>(lr, string32());
+            } break;
+
+            case AST_OBJECT: {
+                Object::Fields fields;
+                uint32_t n = count(3 * sizeof(uint32_t));
+                for (uint32_t i = 0 ; i < n ; ++i) {
+                    AST *name = node();
+                    auto hide = enumeration(Object::Field::VISIBLE);
+                    AST *body = node();
+                    fields.emplace_back(name, hide, body);
+                }
+                r = alloc->make<Object>(lr, fields, nodeVector());
+            } break;
+
+            case AST_OBJECT_COMPREHENSION_SIMPLE: {
+                AST *field = node();
+                AST *value = node();
+                const Identifier *id = identifier();
+                AST *array = node();
+                r = alloc->make<ObjectComprehensionSimple>(lr, field, value, id, array);
+            } break;
+
+            case AST_SELF: {
+                r = alloc->make<Self>(lr);
+            } break;
+
+            case AST_SUPER: {
+                r = alloc->make<Super>(lr);
+            } break;
+
+            case AST_UNARY: {
+                auto op = enumeration(UOP_MINUS);
+                r = alloc->make<Unary>(lr, op, node());
+            } break;
+
+            case AST_VAR: {
+                const Identifier *id = identifier();
+                const Identifier *original = identifier();
+                r = alloc->make<Var>(lr, id, original);
+            } break;
+
+            default:
+            throw Corrupt();
+        }
+        r->freeVariables = free_variables;
+        nodes.push_back(r);
+    }
+
+    void readSegment(void)
+    {
+        uint32_t n = count(sizeof(uint32_t));
+        identifiers.reserve(identifiers.size() + n);
+        for (uint32_t i = 0 ; i < n ; ++i)
+            identifiers.push_back(alloc->makeIdentifier(string32()));
+
+        n = count(sizeof(uint32_t));
+        files.reserve(files.size() + n);
+        for (uint32_t i = 0 ; i < n ; ++i)
+            files.push_back(alloc->internFile(string()));
+
+        // Each node takes at least its type, location and free variables.
+        n = count(6 * sizeof(uint32_t));
+        nodes.reserve(nodes.size() + n);
+        for (uint32_t i = 0 ; i < n ; ++i)
+            readNode();
+    }
+
+    AST *read(std::vector<const AST*> *imports)
+    {
+        readSegment();
+        AST *root = node();
+        if (root == nullptr) throw Corrupt();
+        std::vector<AST*> import_asts = nodeVector();
+        for (const AST *import : import_asts) {
+            if (import == nullptr
+                || (import->type != AST_IMPORT && import->type != AST_IMPORTSTR))
+                throw Corrupt();
+        }
+        if (imports != nullptr)
+            imports->assign(import_asts.begin(), import_asts.end());
+        return root;
+    }
+};
+
+/** The fields of the std object that jsonnet_parse binds around every file, apart from
+ * std.thisFile.  These are the same for every file, so they are written to an entry of their own.
+ */
+std::vector<const AST*> std_prelude(const AST *ast)
+{
+    std::vector<const AST*> r;
+    const auto *local = dynamic_cast<const Local*>(ast);
+    if (local == nullptr) return r;
+    for (const auto &bind : local->binds) {
+        const auto *std_obj = dynamic_cast<const Object*>(bind.second);
+        if (bind.first->name != U"std" || std_obj == nullptr) continue;
+        for (const auto &field : std_obj->fields) {
+            const auto *name = dynamic_cast<const LiteralString*>(field.name);
+            if (name != nullptr && name->value == U"thisFile") continue;
+            r.push_back(field.name);
+            r.push_back(field.body);
+        }
+    }
+    return r;
+}
+
+/** The header of an entry, up to the hash of the rest. */
+std::string header(const std::string &key, const std::string &file)
+{
+    std::string r(MAGIC, sizeof MAGIC);
+    put(r, FORMAT_VERSION);
+    put(r, ENDIAN_MARK);
+    put(r, key);
+    put(r, file);
+    return r;
+}
+
+/** A cache entry mapped into memory.  The body is what follows the header and hash, and is null
+ * unless the entry exists, has the expected header, and matches its hash.
+ */
+class Entry {
+    void *map;
+    std::size_t length;
+
+    public:
+    const char *body;
+    std::size_t bodyLength;
+    std::string hash;
+
+    Entry(const std::string &path, const std::string &expected_header)
+      : map(MAP_FAILED), length(0), body(nullptr), bodyLength(0)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            length = st.st_size;
+            map = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        ::close(fd);
+        if (map == MAP_FAILED) return;
+
+        const char *data = static_cast<const char*>(map);
+        std::size_t offset = expected_header.length() + 32;
+        if (length < offset
+            || std::memcmp(data, expected_header.data(), expected_header.length()) != 0)
+            return;
+        hash = jsonnet_hash(data + offset, length - offset);
+        if (std::memcmp(data + expected_header.length(), hash.data(), 32) != 0) return;
+        body = data + offset;
+        bodyLength = length - offset;
+    }
+
+    Entry(const Entry &) = delete;
+
+    ~Entry()
+    {
+        if (map != MAP_FAILED) ::munmap(map, length);
+    }
+};
+
+/** Write a cache entry at path, unless something goes wrong. */
+void store(const std::string &dir, const std::string &path, const std::string &header,
+           const std::string &body)
+{
+    if (::mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST) return;
+    std::string tmp = path + ".XXXXXX";
+    int fd = ::mkstemp(&tmp[0]);
+    if (fd < 0) return;
+    // mkstemp makes the file private, but the cache may be shared with other users.
+    ::fchmod(fd, 0644);
+    std::string entry = header + jsonnet_hash(body) + body;
+    std::size_t written = 0;
+    while (written < entry.length()) {
+        ssize_t n = ::write(fd, entry.data() + written, entry.length() - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        written += n;
+    }
+    bool ok = ::close(fd) == 0 && written == entry.length();
+    // Renaming over an existing entry is fine: it was written from the same input.
+    if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0)
+        ::unlink(tmp.c_str());
+}
+
+/** Something whose address is in the file this code was loaded from. */
+const char BUILD_ANCHOR = 0;
+
+/** Identifies the file this code was loaded from, with its size and modification time, or "". */
+std::string build_id(void)
+{
+    Dl_info info;
+    if (::dladdr(&BUILD_ANCHOR, &info) == 0 || info.dli_fname == nullptr) return "";
+    // For the main program, the name may be argv[0], which need not be a path to it.
+    const char *file = info.dli_fname;
+    struct stat st;
+    if (::stat(file, &st) != 0) {
+        file = "/proc/self/exe";
+        if (::stat(file, &st) != 0) return "";
+    }
+    std::string r;
+    put(r, uint32_t(st.st_dev));
+    put(r, uint32_t(st.st_ino));
+    put(r, uint32_t(st.st_size));
+    put(r, uint32_t(st.st_mtime));
+    return r;
+}
+
+}  // namespace
+
+const std::string &jsonnet_cache_fingerprint(void)
+{
+    static const std::string r = [] {
+        std::string build = build_id();
+        if (build.length() == 0) return std::string();
+        std::string id = LIB_JSONNET_VERSION;
+        put(id, FORMAT_VERSION);
+        id += jsonnet_hash(jsonnet_std_code(), std::strlen(jsonnet_std_code()));
+        id += build;
+        return jsonnet_hash(id);
+    }();
+    return r;
+}
+
+std::string jsonnet_ast_serialize(const AST *ast, const std::vector<const AST*> &imports,
+                                  std::string *prelude)
+{
+    Writer writer;
+    if (prelude != nullptr) {
+        for (const AST *prelude_ast : std_prelude(ast))
+            writer.node(prelude_ast);
+        *prelude = writer.segment();
+    }
+    uint32_t root = writer.node(ast);
+    std::vector<uint32_t> import_indexes;
+    for (const AST *import : imports)
+        import_indexes.push_back(writer.node(import));
+    return writer.finish(root, import_indexes);
+}
+
+AST *jsonnet_ast_deserialize(Allocator *alloc, const char *prelude, std::size_t prelude_length,
+                             const char *data, std::size_t length,
+                             std::vector<const AST*> *imports)
+{
+    try {
+        Reader reader(alloc, prelude, prelude_length);
+        if (prelude != nullptr) {
+            reader.readSegment();
+            if (!reader.atEnd()) return nullptr;
+        }
+        reader.reset(data, length);
+        AST *r = reader.read(imports);
+        return reader.atEnd() ? r : nullptr;
+    } catch (Corrupt &) {
+        return nullptr;
+    }
+}
+
+AST *jsonnet_parse_cached(Allocator *alloc, const std::string &cache_dir, const std::string &file,
+                          const char *input, std::vector<const AST*> *imports)
+{
+    std::string dir, key;
+    bool prelude_damaged = false;
+    if (cache_dir.length() > 0 && jsonnet_cache_fingerprint().length() > 0) {
+        dir = cache_dir;
+        if (dir[dir.length() - 1] != '/') dir += '/';
+        std::string id = jsonnet_cache_fingerprint();
+        id += file;
+        id += '\0';
+        id += jsonnet_hash(input, std::strlen(input));
+        key = jsonnet_hash(id);
+
+        // The body of the entry is the key of its prelude, then the rest of the AST.
+        Entry entry(dir + key + ".ast", header(key, file));
+        if (entry.body != nullptr && entry.bodyLength >= 32) {
+            std::string prelude_key(entry.body, 32);
+            Entry prelude(dir + prelude_key + ".ast", header(prelude_key, ""));
+            if (prelude.body == nullptr || prelude.hash != prelude_key) {
+                prelude_damaged = true;
+            } else {
+                AST *r = jsonnet_ast_deserialize(alloc, prelude.body, prelude.bodyLength,
+                                                 entry.body + 32, entry.bodyLength - 32,
+                                                 imports);
+                if (r != nullptr) return r;
+            }
+        }
+    }
+
+    std::vector<const AST*> found_imports;
+    AST *expr = jsonnet_parse(alloc, file, input);
+    jsonnet_desugar(alloc, expr);
+    jsonnet_static_analysis(expr, &found_imports);
+    jsonnet_constant_folding(alloc, expr);
+    jsonnet_strictness_analysis(expr);
+
+    if (dir.length() > 0) {
+        std::string prelude;
+        std::string body = jsonnet_ast_serialize(expr, found_imports, &prelude);
+        std::string prelude_key = jsonnet_hash(prelude);
+        std::string prelude_path = dir + prelude_key + ".ast";
+        // Usually the prelude was written by an earlier run, and is only checked when it is used.
+        if (prelude_damaged || ::access(prelude_path.c_str(), F_OK) != 0)
+            store(cache_dir, prelude_path, header(prelude_key, ""), prelude);
+        store(cache_dir, dir + key + ".ast", header(key, file), prelude_key + body);
+    }
+    if (imports != nullptr)
+        *imports = found_imports;
+    return expr;
+}
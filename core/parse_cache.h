@@ -0,0 +1,87 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef JSONNET_PARSE_CACHE_H
+#define JSONNET_PARSE_CACHE_H
+
+#include <string>
+#include <vector>
+
+#include "core/ast.h"
+
+/** Parse a file and prepare it for execution: desugaring, static analysis, constant folding and
+ * strictness analysis.
+ *
+ * If cache_dir is not empty, the result is looked for there first, under a hash of the file
+ * name, its content and jsonnet_cache_fingerprint, so that other processes can reuse it.  A
+ * cache entry is a serialization of the finished AST, which is mapped into memory and turned
+ * back into nodes without lexing, parsing or analysing anything.  The standard library is kept in
+ * an entry of its own, which all the others share.  Entries that are missing, from other builds,
+ * truncated or otherwise damaged are ignored and replaced.  Files with static errors are not
+ * cached, so the error is reported every time.
+ *
+ * New entries are written to a temporary file and renamed into place, so any number of processes
+ * can share the directory: readers see a whole entry or none, and writers of the same entry write
+ * the same bytes.  Failing to read or write the cache is never an error.  The directory is created
+ * if its parent exists.  Nothing is ever removed from it, that is left to the user.
+ *
+ * \param alloc Used to allocate the AST nodes.
+ * \param cache_dir The cache directory, or "" for none.
+ * \param file Used in error messages and embedded in the AST nodes.
+ * \param input The Jsonnet code, followed by a \0.
+ * \param imports If not null, set to the Import and Importstr ASTs, as by jsonnet_static_analysis.
+ * \throws StaticError if the file is not valid Jsonnet.
+ */
+AST *jsonnet_parse_cached(Allocator *alloc, const std::string &cache_dir, const std::string &file,
+                          const char *input, std::vector<const AST*> *imports=nullptr);
+
+/** Identifies everything that goes into a cache entry apart from the file itself: the version,
+ * the format of the cache, the standard library, and the build of the code that parses and
+ * analyses files.  A rebuild can change the desugarer or the analyses without changing the
+ * version, so the build is identified by the file the library was loaded from, with its size and
+ * modification time.
+ *
+ * \returns A hash, or "" if the build cannot be identified, in which case nothing is cached.
+ */
+const std::string &jsonnet_cache_fingerprint(void);
+
+/** Write an AST as the bytes stored in the cache, after the header.  Shared subtrees are written
+ * once and stay shared.
+ *
+ * \param ast A tree from jsonnet_parse_cached, which must not contain AST_OBJECT_COMPREHENSION.
+ * \param imports The Import and Importstr ASTs in the tree, which are stored in this order.
+ * \param prelude If not null, the standard library that jsonnet_parse put around the file,
+ * except for std.thisFile, is written here instead.  It comes out the same for every file.
+ * \returns The rest of the AST.
+ */
+std::string jsonnet_ast_serialize(const AST *ast, const std::vector<const AST*> &imports,
+                                  std::string *prelude=nullptr);
+
+/** Read an AST written by jsonnet_ast_serialize.
+ *
+ * \param alloc Used to allocate the AST nodes and intern the identifiers.
+ * \param prelude The prelude written with the AST, or null if there was none.
+ * \param prelude_length The number of bytes in the prelude.
+ * \param data The rest of the AST.
+ * \param length The number of bytes in the rest.
+ * \param imports If not null, set to the Import and Importstr ASTs.
+ * \returns The AST, or nullptr if the bytes are not a whole serialization.
+ */
+AST *jsonnet_ast_deserialize(Allocator *alloc, const char *prelude, std::size_t prelude_length,
+                             const char *data, std::size_t length,
+                             std::vector<const AST*> *imports=nullptr);
+
+#endif  // JSONNET_PARSE_CACHE_H
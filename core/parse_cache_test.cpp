@@ -0,0 +1,284 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include "core/hash.h"
+#include "core/parse_cache.h"
+#include "core/parser.h"
+#include "core/static_error.h"
+
+// Checks that ASTs read back from the parse cache are the ones that were written, that damaged
+// entries are ignored, and that the hash gives the published MurmurHash3 results.  With
+// --benchmark and some files, compares the time to parse each file with the time to load it from
+// the cache.
+
+/** Between them, these have every kind of node that survives desugaring. */
+static const char *SNIPPETS[] = {
+    "local f(x, y) = x + y; f(1, 2) tailstrict",
+    "[x * y for x in [1, 2, 3] if x > 1 for y in std.range(1, x)]",
+    "{ [k]: k + \"v\" for k in [\"a\", \"b\"] }",
+    "{ a: 1, b:: self.a, c::: super.d, assert self.a == 1 : \"msg\", local l = 3, e: l }"
+    " + { d: 4 }",
+    "function(n) if n == 0 then error \"no\" else -1.5e300 / ~n % 2 < 4 && !true || null == n",
+    "{ x: import \"lib.libsonnet\", y: importstr \"data.txt\", z: \"caf\\u00e9 \\ud83d\\ude00\" }",
+    "{ x: 1, f(a, b): a[b] + a.c[1] + std.format(\"%s\", [a]) + $.x }",
+    "local a = { b: a }; a.b.b",
+};
+
+/** Every byte of the AST, in the cache format, so comparing these compares everything. */
+static std::string dump(const AST *ast, const std::vector<const AST*> &imports)
+{
+    return jsonnet_ast_serialize(ast, imports);
+}
+
+/** The prelude of the first snippet, which all the others should share. */
+static std::string first_prelude;
+
+static std::vector<std::string> list_dir(const std::string &dir)
+{
+    std::vector<std::string> r;
+    DIR *d = ::opendir(dir.c_str());
+    if (d == nullptr) return r;
+    while (struct dirent *e = ::readdir(d)) {
+        std::string name = e->d_name;
+        if (name != "." && name != "..") r.push_back(name);
+    }
+    ::closedir(d);
+    return r;
+}
+
+static bool check_round_trip(const char *code)
+{
+    Allocator alloc;
+    std::vector<const AST*> imports;
+    AST *ast = jsonnet_parse_cached(&alloc, "", "snippet.jsonnet", code, &imports);
+    std::string bytes = dump(ast, imports);
+
+    std::vector<const AST*> loaded_imports;
+    AST *loaded = jsonnet_ast_deserialize(&alloc, nullptr, 0, bytes.data(), bytes.length(),
+                                          &loaded_imports);
+    if (loaded == nullptr) {
+        std::cerr << "Could not read back: " << code << std::endl;
+        return false;
+    }
+    if (dump(loaded, loaded_imports) != bytes
+        || jsonnet_unparse_jsonnet(loaded) != jsonnet_unparse_jsonnet(ast)) {
+        std::cerr << "Read back differently: " << code << std::endl;
+        return false;
+    }
+
+    // The same, with the standard library written separately.
+    std::string prelude;
+    std::string rest = jsonnet_ast_serialize(ast, imports, &prelude);
+    if (first_prelude.length() == 0) first_prelude = prelude;
+    if (prelude != first_prelude) {
+        std::cerr << "Different prelude: " << code << std::endl;
+        return false;
+    }
+    loaded = jsonnet_ast_deserialize(&alloc, prelude.data(), prelude.length(), rest.data(),
+                                     rest.length(), &loaded_imports);
+    if (loaded == nullptr || dump(loaded, loaded_imports) != bytes) {
+        std::cerr << "Read back differently with a prelude: " << code << std::endl;
+        return false;
+    }
+    if (loaded->location.fileName() != "snippet.jsonnet") {
+        std::cerr << "Wrong file " << loaded->location << ": " << code << std::endl;
+        return false;
+    }
+
+    // Every prefix is an incomplete serialization, step through them in a few hundred steps.
+    for (std::size_t i = 0 ; i < bytes.length() ; i += 1 + bytes.length() / 300) {
+        if (jsonnet_ast_deserialize(&alloc, nullptr, 0, bytes.data(), i) != nullptr) {
+            std::cerr << "Read " << i << " of " << bytes.length() << " bytes: " << code
+                      << std::endl;
+            return false;
+        }
+    }
+
+    // Overwrite words with values that are out of range for anything they could be, in a few
+    // hundred steps: the result may or may not be read, but must not misbehave.  Best run under
+    // sanitizers.
+    std::string damaged = bytes;
+    for (std::size_t i = 0 ; i + 4 <= bytes.length() ; i += 4 * (1 + bytes.length() / 1200)) {
+        for (uint32_t v : {uint32_t(0x7fff), uint32_t(0xfffffffe)}) {
+            Allocator scratch;
+            std::memcpy(&damaged[i], &v, sizeof v);
+            jsonnet_ast_deserialize(&scratch, nullptr, 0, damaged.data(), damaged.length());
+        }
+        damaged.replace(i, 4, bytes, i, 4);
+    }
+    return true;
+}
+
+static std::string read_file(const std::string &path)
+{
+    std::ifstream in(path, std::ios::binary);
+    std::stringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+
+static bool check_cache_dir(void)
+{
+    char tmpl[] = "/tmp/parse_cache_test.XXXXXX";
+    if (::mkdtemp(tmpl) == nullptr) {
+        std::cerr << "Could not make a temporary directory" << std::endl;
+        return false;
+    }
+    std::string dir = std::string(tmpl) + "/cache";
+    const char *code = SNIPPETS[5];
+    bool ok = true;
+
+    Allocator alloc;
+    std::vector<const AST*> imports;
+    std::string expected = dump(jsonnet_parse_cached(&alloc, "", "a.jsonnet", code, &imports),
+                                imports);
+
+    // Written on the first use, with its prelude, and read on the second.
+    for (int i = 0 ; i < 2 ; ++i) {
+        AST *ast = jsonnet_parse_cached(&alloc, dir, "a.jsonnet", code, &imports);
+        std::size_t entries = list_dir(dir).size();
+        if (entries != 2 || dump(ast, imports) != expected) {
+            std::cerr << "After use " << i << ", " << entries << " entries" << std::endl;
+            ok = false;
+        }
+    }
+
+    // Damage each entry in turn: it is not used, and is written again.
+    for (const auto &entry : list_dir(dir)) {
+        std::string path = dir + "/" + entry;
+        std::string good = read_file(path);
+        std::string bad = good;
+        bad[bad.length() - 5] ^= 1;
+        std::ofstream(path, std::ios::binary) << bad;
+        AST *ast = jsonnet_parse_cached(&alloc, dir, "a.jsonnet", code, &imports);
+        if (dump(ast, imports) != expected || read_file(path) != good) {
+            std::cerr << "Damaged entry was used or not replaced" << std::endl;
+            ok = false;
+        }
+    }
+
+    // Another name or content is another entry, with the same prelude.
+    jsonnet_parse_cached(&alloc, dir, "b.jsonnet", code, &imports);
+    jsonnet_parse_cached(&alloc, dir, "a.jsonnet", SNIPPETS[0], &imports);
+    if (list_dir(dir).size() != 4) {
+        std::cerr << "Expected 4 entries, got " << list_dir(dir).size() << std::endl;
+        ok = false;
+    }
+
+    // Static errors are not cached.
+    try {
+        jsonnet_parse_cached(&alloc, dir, "c.jsonnet", "{ x: }", &imports);
+        std::cerr << "No static error" << std::endl;
+        ok = false;
+    } catch (StaticError &) {
+    }
+    if (list_dir(dir).size() != 4) {
+        std::cerr << "Static error was cached" << std::endl;
+        ok = false;
+    }
+
+    for (const auto &entry : list_dir(dir))
+        ::unlink((dir + "/" + entry).c_str());
+    ::rmdir(dir.c_str());
+    ::rmdir(tmpl);
+    return ok;
+}
+
+static bool check_hash(void)
+{
+    const char *cases[][2] = {
+        {"", "00000000000000000000000000000000"},
+        {"hello", "029bbd41b3a7d8cb191dae486a901e5b"},
+        {"The quick brown fox jumps over the lazy dog", "6c1b07bc7bbc4be347939ac4a93c437a"},
+    };
+    for (const auto &c : cases) {
+        if (jsonnet_hash(c[0]) != c[1]) {
+            std::cerr << "Hash of \"" << c[0] << "\" is " << jsonnet_hash(c[0]) << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+static int test(void)
+{
+    bool ok = check_hash();
+    for (const char *code : SNIPPETS)
+        ok = check_round_trip(code) && ok;
+    ok = check_cache_dir() && ok;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int benchmark(const std::vector<std::string> &files)
+{
+    char tmpl[] = "/tmp/parse_cache_test.XXXXXX";
+    if (::mkdtemp(tmpl) == nullptr) {
+        std::cerr << "Could not make a temporary directory" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::string dir = tmpl;
+    for (const auto &file : files) {
+        std::string code = read_file(file);
+        const unsigned reps = 50;
+        double secs[2];
+        for (int cached = 0 ; cached < 2 ; ++cached) {
+            if (cached) {
+                Allocator alloc;
+                jsonnet_parse_cached(&alloc, dir, file, code.c_str());
+            }
+            auto start = std::chrono::steady_clock::now();
+            for (unsigned i = 0 ; i < reps ; ++i) {
+                Allocator alloc;
+                jsonnet_parse_cached(&alloc, cached ? dir : "", file, code.c_str());
+            }
+            std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+            secs[cached] = d.count() / reps;
+        }
+        std::cout << file << ": parse " << secs[0] * 1e3 << " ms, from cache "
+                  << secs[1] * 1e3 << " ms" << std::endl;
+    }
+    for (const auto &entry : list_dir(dir))
+        ::unlink((dir + "/" + entry).c_str());
+    ::rmdir(tmpl);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, const char **argv)
+{
+    if (argc >= 2 && std::string(argv[1]) == "--benchmark") {
+        return benchmark(std::vector<std::string>(argv + 2, argv + argc));
+    }
+    if (argc != 1) {
+        std::cerr << "parse_cache_test [--benchmark <file>...]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    return test();
+}
@@ -27,6 +27,7 @@ limitations under the License.
 
 #include "core/ast.h"
 #include "core/desugaring.h"
+#include "core/json.h"
 #include "core/lexer.h"
 #include "core/parser.h"
 #include "core/static_error.h"
@@ -37,50 +38,9 @@ static const LocationRange gen;
 
 String jsonnet_unparse_escape(const String &str)
 {
-    StringStream ss;
-    ss << U'\"';
-    for (std::size_t i=0 ; i<str.length() ; ++i) {
-        char32_t c = str[i];
-        switch (c) {
-            case U'"': ss << U"\\\""; break;
-            case U'\\': ss << U"\\\\"; break;
-            case U'\b': ss << U"\\b"; break;
-            case U'\f': ss << U"\\f"; break;
-            case U'\n': ss << U"\\n"; break;
-            case U'\r': ss << U"\\r"; break;
-            case U'\t': ss << U"\\t"; break;
-            case U'\0': ss << U"\\u0000"; break;
-            default: {
-                if (c < 0x20 || (c >= 0x7f && c <= 0x9f)) {
-                    //Unprintable, use \u
-                    std::stringstream ss8;
-                    ss8 << "\\u" << std::hex << std::setfill('0') << std::setw(4)
-                       << (unsigned long)(c);
-                    ss << decode_utf8(ss8.str());
-                } else {
-                    // Printable, write verbatim
-                    ss << c;
-                }
-            }
-        }
-    }
-    ss << U'\"';
-    return ss.str();
-}
-
-std::string jsonnet_unparse_number(double v)
-{
-    std::stringstream ss;
-    if (v == floor(v)) {
-        ss << std::fixed << std::setprecision(0) << v;
-    } else {
-        // See "What Every Computer Scientist Should Know About Floating-Point Arithmetic"
-        // Theorem 15
-        // http://docs.oracle.com/cd/E19957-01/806-3568/ncg_goldberg.html
-        ss << std::setprecision(17);
-        ss << v;
-    }
-    return ss.str();
+    std::string json;
+    jsonnet_json_escape(str, false, json);
+    return decode_utf8(json);
 }
 
 static std::string unparse(const AST *ast_)
@@ -350,45 +310,44 @@ namespace {
         return true;
     }
 
-    LocationRange span(const Token &begin)
-    {
-        return LocationRange(begin.location.file, begin.location.begin, begin.location.end);
-    }
-
-    LocationRange span(const Token &begin, const Token &end)
-    {
-        return LocationRange(begin.location.file, begin.location.begin, end.location.end);
-    }
-
-    LocationRange span(const Token &begin, AST *end)
-    {
-        return LocationRange(begin.location.file, begin.location.begin, end->location.end);
-    }
-
     /** Holds state while parsing a given token list.
      */
     class Parser {
 
         // The private member functions are utilities for dealing with the token stream.
 
+        LocationRange span(const Token &begin)
+        {
+            return LocationRange(file, begin.begin, begin.end);
+        }
+
+        LocationRange span(const Token &begin, const Token &end)
+        {
+            return LocationRange(file, begin.begin, end.end);
+        }
+
+        LocationRange span(const Token &begin, AST *end)
+        {
+            return LocationRange(file, begin.begin, end->location.end);
+        }
+
         StaticError unexpected(const Token &tok, const std::string &while_)
         {
             std::stringstream ss;
             ss << "Unexpected: " << tok.kind << " while " << while_;
-            return StaticError(tok.location, ss.str());
+            return StaticError(span(tok), ss.str());
         }
 
         Token pop(void)
         {
             Token tok = peek();
-            tokens->pop_front();
+            position++;
             return tok;
         }
 
-        Token peek(void)
+        const Token &peek(void)
         {
-            Token tok = tokens->front();
-            return tok;
+            return tokens.tokens[position];
         }
 
         Token popExpect(Token::Kind k, const char *data=nullptr)
@@ -397,25 +356,40 @@ namespace {
             if (tok.kind != k) {
                 std::stringstream ss;
                 ss << "Expected token " << k << " but got " << tok;
-                throw StaticError(tok.location, ss.str());
+                throw StaticError(span(tok), ss.str());
             }
             if (data != nullptr && tok.data != data) {
                 std::stringstream ss;
                 ss << "Expected operator " << data << " but got " << tok.data;
-                throw StaticError(tok.location, ss.str());
+                throw StaticError(span(tok), ss.str());
             }
             return tok;
         }
 
-        std::list<Token> *tokens;
+        const Tokens &tokens;
+        /** The interned name of the file, for the locations of the AST nodes. */
+        const std::string *file;
+        /** Index of the next token to be consumed. */
+        unsigned long position;
         Allocator *alloc;
 
         public:
 
-        Parser(std::list<Token> *tokens, Allocator *alloc)
-          : tokens(tokens), alloc(alloc)
+        Parser(const Tokens &tokens, Allocator *alloc)
+          : tokens(tokens), file(alloc->internFile(tokens.file)), position(0), alloc(alloc)
         { }
 
+        /** Check that there are no tokens left over after parsing. */
+        void expectEndOfFile(void)
+        {
+            const Token &tok = peek();
+            if (tok.kind != Token::END_OF_FILE) {
+                std::stringstream ss;
+                ss << "Did not expect: " << tok;
+                throw StaticError(span(tok), ss.str());
+            }
+        }
+
         /** Parse a comma-separated list of expressions.
          *
          * Allows an optional ending comma.
@@ -446,7 +420,7 @@ namespace {
                 if (!got_comma) {
                     std::stringstream ss;
                     ss << "Expected a comma before next " << element_kind <<  ".";
-                    throw StaticError(next.location, ss.str());
+                    throw StaticError(span(next), ss.str());
                 }
                 exprs.push_back(parse(MAX_PRECEDENCE, obj_level));
                 got_comma = false;
@@ -479,8 +453,8 @@ namespace {
             Token var_id = popExpect(Token::IDENTIFIER);
             auto *id = alloc->makeIdentifier(var_id.data32());
             if (binds.find(id) != binds.end()) {
-                throw StaticError(var_id.location,
-                                  "Duplicate local var: " + var_id.data);
+                throw StaticError(span(var_id),
+                                  "Duplicate local var: " + var_id.data.str());
             }
             AST *init;
             if (peek().kind == Token::PAREN_L) {
@@ -546,11 +520,11 @@ namespace {
                     // It's a comprehension
                     if (fields.size() != 1) {
                         auto msg = "Object comprehension can only have one field/value pair.";
-                        throw StaticError(next.location, msg);
+                        throw StaticError(span(next), msg);
                     }
                     if (last_was_local) {
                         auto msg = "Locals must appear first in an object comprehension.";
-                        throw StaticError(next.location, msg);
+                        throw StaticError(span(next), msg);
                     }
                     AST *field = fields.front().name;
                     Object::Field::Hide field_hide = fields.front().hide;
@@ -560,7 +534,7 @@ namespace {
                     }
                     if (field_hide != Object::Field::INHERIT) {
                         auto msg = "Object comprehensions cannot have hidden fields.";
-                        throw StaticError(next.location, msg);
+                        throw StaticError(span(next), msg);
                     }
 
                     std::vector<ComprehensionSpec> specs;
@@ -570,7 +544,7 @@ namespace {
                     return last;
                 }
                 if (!got_comma)
-                    throw StaticError(next.location, "Expected a comma before next field.");
+                    throw StaticError(span(next), "Expected a comma before next field.");
 
                 switch (next.kind) {
                     case Token::IDENTIFIER: case Token::STRING: {
@@ -586,13 +560,13 @@ namespace {
                         bool plus_sugar = false;
                         LocationRange plus_loc;
                         if (peek().kind == Token::OPERATOR && peek().data == "+") {
-                            plus_loc = peek().location;
+                            plus_loc = span(peek());
                             plus_sugar = true;
                             pop();
                         }
 
                         if (is_method && plus_sugar) {
-                            throw StaticError(next.location, "Cannot use +: syntax sugar in a method: "+next.data);
+                            throw StaticError(span(next), "Cannot use +: syntax sugar in a method: "+next.data.str());
                         }
 
                         popExpect(Token::COLON);
@@ -605,10 +579,10 @@ namespace {
                                 field_hide = Object::Field::VISIBLE;
                             }
                         }
-                        if (!literal_fields.insert(next.data).second) {
-                            throw StaticError(next.location, "Duplicate field: "+next.data);
+                        if (!literal_fields.insert(next.data.str()).second) {
+                            throw StaticError(span(next), "Duplicate field: "+next.data.str());
                         }
-                        AST *field_expr = alloc->make<LiteralString>(next.location, next.data32());
+                        AST *field_expr = alloc->make<LiteralString>(span(next), next.data32());
 
                         AST *body = parse(MAX_PRECEDENCE, obj_level+1);
                         if (is_method) {
@@ -688,7 +662,7 @@ namespace {
                 specs.emplace_back(ComprehensionSpec::FOR, id, arr);
 
                 Token maybe_if = pop();
-                for (; maybe_if == Token::IF; maybe_if = pop()) {
+                for (; maybe_if.kind == Token::IF; maybe_if = pop()) {
                     AST *cond = parse(MAX_PRECEDENCE, obj_level);
                     specs.emplace_back(ComprehensionSpec::IF, nullptr, cond);
                 }
@@ -698,7 +672,7 @@ namespace {
                 if (maybe_if.kind != Token::FOR) {
                     std::stringstream ss;
                     ss << "Expected for, if or " << end << " after for clause, got: " << maybe_if;
-                    throw StaticError(maybe_if.location, ss.str());
+                    throw StaticError(span(maybe_if), ss.str());
                 }
             } 
         }
@@ -728,7 +702,7 @@ namespace {
                 throw unexpected(tok, "parsing terminal");
 
                 case Token::END_OF_FILE:
-                throw StaticError(tok.location, "Unexpected end of file.");
+                throw StaticError(span(tok), "Unexpected end of file.");
 
                 case Token::BRACE_L: {
                     AST *obj;
@@ -770,7 +744,7 @@ namespace {
                         if (!got_comma) {
                             std::stringstream ss;
                             ss << "Expected a comma before next array element.";
-                            throw StaticError(next.location, ss.str());
+                            throw StaticError(span(next), ss.str());
                         }
                         elements.push_back(parse(MAX_PRECEDENCE, obj_level));
                         next = peek();
@@ -793,7 +767,7 @@ namespace {
 
                 // Literals
                 case Token::NUMBER:
-                return alloc->make<LiteralNumber>(span(tok), strtod(tok.data.c_str(), nullptr));
+                return alloc->make<LiteralNumber>(span(tok), strtod(tok.data.str().c_str(), nullptr));
 
                 case Token::STRING:
                 return alloc->make<LiteralString>(span(tok), tok.data32());
@@ -822,7 +796,7 @@ namespace {
                 // Variables
                 case Token::DOLLAR:
                 if (obj_level == 0) {
-                    throw StaticError(tok.location, "No top-level object found.");
+                    throw StaticError(span(tok), "No top-level object found.");
                 }
                 return alloc->make<Var>(span(tok), alloc->makeIdentifier(U"$"));
 
@@ -858,7 +832,7 @@ namespace {
                         msg = parse(MAX_PRECEDENCE, obj_level);
                     } else {
                         auto msg_str = U"Assertion failed.";
-                        msg = alloc->make<LiteralString>(begin.location, msg_str);
+                        msg = alloc->make<LiteralString>(span(begin), msg_str);
                     }
                     popExpect(Token::SEMICOLON);
                     AST *rest = parse(MAX_PRECEDENCE, obj_level);
@@ -912,7 +886,7 @@ namespace {
                     } else {
                         std::stringstream ss;
                         ss << "Expected ( but got " << next;
-                        throw StaticError(next.location, ss.str());
+                        throw StaticError(span(next), ss.str());
                     }
                 }
 
@@ -925,7 +899,7 @@ namespace {
                         if (delim.kind != Token::SEMICOLON && delim.kind != Token::COMMA) {
                             std::stringstream ss;
                             ss << "Expected , or ; but got " << delim;
-                            throw StaticError(delim.location, ss.str());
+                            throw StaticError(span(delim), ss.str());
                         }
                         if (delim.kind == Token::SEMICOLON) break;
                     } while (true);
@@ -938,10 +912,10 @@ namespace {
                 // Unary operator.
                 if (begin.kind == Token::OPERATOR) {
                     UnaryOp uop;
-                    if (!op_is_unary(begin.data, uop)) {
+                    if (!op_is_unary(begin.data.str(), uop)) {
                         std::stringstream ss;
                         ss << "Not a unary operator: " << begin.data;
-                        throw StaticError(begin.location, ss.str());
+                        throw StaticError(span(begin), ss.str());
                     }
                     if (UNARY_PRECEDENCE == precedence) {
                         Token op = pop();
@@ -971,10 +945,10 @@ namespace {
                         if (peek().data == "%") {
                             if (PERCENT_PRECEDENCE != precedence) return lhs;
                         } else {
-                            if (!op_is_binary(peek().data, bop)) {
+                            if (!op_is_binary(peek().data.str(), bop)) {
                                 std::stringstream ss;
                                 ss << "Not a binary operator: " << peek().data;
-                                throw StaticError(peek().location, ss.str());
+                                throw StaticError(span(peek()), ss.str());
                             }
                             if (precedence_map[bop] != precedence) return lhs;
                         }
@@ -1053,7 +1027,7 @@ namespace {
     };
 }
 
-static unsigned long max_builtin = 24;
+static unsigned long max_builtin = 26;
 BuiltinDecl jsonnet_builtin_decl(unsigned long builtin)
 {
     switch (builtin) {
@@ -1082,6 +1056,8 @@ BuiltinDecl jsonnet_builtin_decl(unsigned long builtin)
         case 22: return {U"modulo", {U"a", U"b"}};
         case 23: return {U"extVar", {U"x"}};
         case 24: return {U"primitiveEquals", {U"a", U"b"}};
+        case 25: return {U"parseJson", {U"str"}};
+        case 26: return {U"escapeStringJson", {U"str_"}};
         default:
         std::cerr << "INTERNAL ERROR: Unrecognized builtin function: " << builtin << std::endl;
         std::abort();
@@ -1093,16 +1069,12 @@ BuiltinDecl jsonnet_builtin_decl(unsigned long builtin)
 static AST *do_parse(Allocator *alloc, const std::string &file, const char *input)
 {
     // Lex the input.
-    auto token_list = jsonnet_lex(file, input);
+    Tokens tokens = jsonnet_lex(file, input);
 
     // Parse the input.
-    Parser parser(&token_list, alloc);
+    Parser parser(tokens, alloc);
     AST *expr = parser.parse(MAX_PRECEDENCE, 0);
-    if (token_list.front().kind != Token::END_OF_FILE) {
-        std::stringstream ss;
-        ss << "Did not expect: " << token_list.front();
-        throw StaticError(token_list.front().location, ss.str());
-    }
+    parser.expectEndOfFile();
 
     return expr;
 }
@@ -1111,6 +1083,11 @@ static constexpr char STD_CODE[] = {
     #include "stdlib/std.jsonnet.h"
 };
 
+const char *jsonnet_std_code(void)
+{
+    return STD_CODE;
+}
+
 AST *jsonnet_parse(Allocator *alloc, const std::string &file, const char *input)
 {
     // Parse the actual file.
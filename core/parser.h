@@ -33,14 +33,13 @@ limitations under the License.
  */
 AST *jsonnet_parse(Allocator *alloc, const std::string &file, const char *input);
 
+/** The source of the standard library that jsonnet_parse binds around every file. */
+const char *jsonnet_std_code(void);
+
 /** Escapes a string for JSON output.
  */
 String jsonnet_unparse_escape(const String &str);
 
-/** Outputs a number, trying to preserve precision as well as possible.
- */
-std::string jsonnet_unparse_number(double v);
-
 struct BuiltinDecl {
     String name;
     std::vector<String> params;
@@ -17,6 +17,12 @@ limitations under the License.
 #ifndef JSONNET_STATE_H
 #define JSONNET_STATE_H
 
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+
 namespace {
 
     /** Mark & sweep: advanced by 1 each GC cycle.
@@ -27,12 +33,20 @@ namespace {
      */
     struct HeapEntity {
         GarbageCollectionMark mark;
+        /** Never collected, \see Heap::makeImmortalEntity. */
+        bool immortal;
         virtual ~HeapEntity() { }
     };
 
     /** Tagged union of all values.
      *
      * Primitives (<= 8 bytes) are copied by value.  Otherwise a pointer to a HeapEntity is used.
+     *
+     * If JSONNET_NAN_BOXING is defined, the value is packed into 8 bytes.  Doubles are stored as
+     * themselves, and all other values live in the payload of a negative quiet NaN, with the type
+     * in bits 48-50 (NaN doubles are canonicalized so they cannot clash).  This requires heap
+     * pointers to fit in 48 bits.  Otherwise, the value is a 16 byte tagged union.  Either way,
+     * the representation should only be accessed via the member functions.
      */
     struct Value {
         enum Type {
@@ -45,16 +59,151 @@ namespace {
             OBJECT = 0x12,
             STRING = 0x13
         };
+
+        #ifdef JSONNET_NAN_BOXING
+
+        private:
+
+        /** Every bit pattern at or above this is a boxed non-double. */
+        static const uint64_t BOX = 0xFFF8000000000000ull;
+
+        /** The bits holding a pointer or boolean in a boxed value. */
+        static const uint64_t PAYLOAD = 0x0000FFFFFFFFFFFFull;
+
+        /** The bit that is set in the tag of all heap types. */
+        static const uint64_t HEAP_TAG = 0x0004000000000000ull;
+
+        uint64_t bits;
+
+        /** The 3 bit tag is the bottom 2 bits of the type, plus bit 2 for heap types. */
+        static uint64_t box(Type t)
+        {
+            return BOX | (uint64_t((t & 0x3) | ((t & 0x10) >> 2)) << 48);
+        }
+
+        public:
+
+        Value(void) : bits(box(NULL_TYPE)) { }
+
+        Type type(void) const
+        {
+            if (bits < BOX) return DOUBLE;
+            unsigned tag = (bits >> 48) & 0x7;
+            return Type((tag & 0x3) | ((tag & 0x4) << 2));
+        }
+
+        bool isHeap(void) const
+        {
+            return bits >= BOX && (bits & HEAP_TAG);
+        }
+
+        bool getBoolean(void) const
+        {
+            return bits & PAYLOAD;
+        }
+
+        double getDouble(void) const
+        {
+            double d;
+            std::memcpy(&d, &bits, sizeof d);
+            return d;
+        }
+
+        HeapEntity *getHeap(void) const
+        {
+            return reinterpret_cast<HeapEntity*>(uintptr_t(bits & PAYLOAD));
+        }
+
+        void setNull(void)
+        {
+            bits = box(NULL_TYPE);
+        }
+
+        void setBoolean(bool b)
+        {
+            bits = box(BOOLEAN) | uint64_t(b);
+        }
+
+        void setDouble(double d)
+        {
+            if (std::isnan(d)) {
+                bits = 0x7FF8000000000000ull;
+            } else {
+                std::memcpy(&bits, &d, sizeof d);
+            }
+        }
+
+        void setHeap(Type t, HeapEntity *h)
+        {
+            uint64_t p = uint64_t(reinterpret_cast<uintptr_t>(h));
+            assert((p & ~PAYLOAD) == 0);
+            bits = box(t) | p;
+        }
+
+        #else
+
+        private:
+
         Type t;
         union {
             HeapEntity *h;
             double d;
             bool b;
         } v;
+
+        public:
+
+        Value(void) : t(NULL_TYPE) { }
+
+        Type type(void) const
+        {
+            return t;
+        }
+
         bool isHeap(void) const
         {
             return t & 0x10;
         }
+
+        bool getBoolean(void) const
+        {
+            return v.b;
+        }
+
+        double getDouble(void) const
+        {
+            return v.d;
+        }
+
+        HeapEntity *getHeap(void) const
+        {
+            return v.h;
+        }
+
+        void setNull(void)
+        {
+            t = NULL_TYPE;
+        }
+
+        void setBoolean(bool b)
+        {
+            t = BOOLEAN;
+            v.b = b;
+        }
+
+        void setDouble(double d)
+        {
+            t = DOUBLE;
+            v.d = d;
+        }
+
+        void setHeap(Type t_, HeapEntity *h)
+        {
+            t = t_;
+            v.h = h;
+        }
+
+        #endif
     };
 
     /** Convert the type into a string, for error messages. */
@@ -78,7 +227,7 @@ namespace {
     /** Convert the value's type into a string, for error messages. */
     std::string type_str(const Value &v)
     {
-        return type_str(v.t);
+        return type_str(v.type());
     }
 
     struct HeapThunk;
@@ -92,37 +241,62 @@ namespace {
 
     /** Supertype of all objects.  Types of Value::OBJECT will point at these.  */
     struct HeapObject : public HeapEntity {
+        /** How far checking the object's assertions (with self bound to it) has got.
+         *
+         * Assertions cannot give a different answer the second time, so once they have passed they
+         * are never run again.  While they are running, the object is used as if they had passed,
+         * which stops an assertion that uses self from checking itself forever.
+         */
+        enum AssertState {
+            ASSERTS_NOT_RUN,
+            ASSERTS_RUNNING,
+            ASSERTS_PASSED
+        };
+        AssertState assertState;
+
+        HeapObject(void)
+          : assertState(ASSERTS_NOT_RUN)
+        { }
     };
 
     /** Hold an unevaluated expression.  This implements lazy semantics.
+     *
+     * The members are ordered so that the small ones pack into the padding after
+     * HeapEntity::mark.  A thunk can also be created already filled, in which case it has no
+     * captured environment at all.
      */
     struct HeapThunk : public HeapEntity {
         /** Whether or not the thunk was forced. */
         bool filled;
 
-        /** The result when the thunk was forced, if filled == true. */
-        Value content;
+        /** The offset from the captured self variable. \see CallFrame. */
+        unsigned offset;
 
         /** Used in error tracebacks. */
         const Identifier *name;
 
-        /** The captured environment.
-         *
-         * Note, this is non-const because we have to add cyclic references to it.
-         */
-        BindingFrame upValues;
+        /** The result when the thunk was forced, if filled == true. */
+        Value content;
 
         /** The captured self variable, or nullptr if there was none.  \see CallFrame. */
         HeapObject *self;
 
-        /** The offset from the captured self variable. \see CallFrame. */
-        unsigned offset;
-
         /** Evaluated to force the thunk. */
         const AST *body;
 
+        /** The captured environment.
+         *
+         * Note, this is non-const because we have to add cyclic references to it.
+         */
+        BindingFrame upValues;
+
         HeapThunk(const Identifier *name, HeapObject *self, unsigned offset, const AST *body)
-          : filled(false), name(name), self(self), offset(offset), body(body)
+          : filled(false), offset(offset), name(name), self(self), body(body)
+        { }
+
+        /** Create a thunk that is already filled with the given value. */
+        HeapThunk(const Identifier *name, const Value &content)
+          : filled(true), offset(0), name(name), content(content), self(nullptr), body(nullptr)
         { }
 
         void fill(const Value &v)
@@ -222,13 +396,16 @@ namespace {
          * For each field, holds the value that should be bound to id.  This is the corresponding
          * array element from the original array used to define this object.  This should not really
          * be a thunk, but it makes the implementation easier.
+         *
+         * Field names are interned, so hashing the identifier is the same as hashing the name.
+         * The table is filled in place while the comprehension is evaluated, and never changes
+         * after that.
          */
-        const std::map<const Identifier*, HeapThunk*> compValues;
+        std::unordered_map<const Identifier*, HeapThunk*> compValues;
 
         HeapComprehensionObject(const BindingFrame &up_values, const AST *value,
-                                const Identifier *id,
-                                const std::map<const Identifier*, HeapThunk*> &comp_values)
-          : upValues(up_values), value(value), id(id), compValues(comp_values)
+                                const Identifier *id)
+          : upValues(up_values), value(value), id(id)
         { }
     };
 
@@ -247,15 +424,19 @@ namespace {
         /** The offset from the captured self variable.  \see Frame.*/
         unsigned offset;
         const std::vector<const Identifier*> params;
+        /** Which params are always forced by the body, or nullptr for builtins (which force
+         * all of them). */
+        const std::vector<bool> *strictParams;
         const AST *body;
         const unsigned long builtin;
         HeapClosure(const BindingFrame &up_values,
                      HeapObject *self,
                      unsigned offset,
                      const std::vector<const Identifier*> &params,
+                     const std::vector<bool> *strict_params,
                      const AST *body, unsigned long builtin)
           : upValues(up_values), self(self), offset(offset),
-            params(params), body(body), builtin(builtin)
+            params(params), strictParams(strict_params), body(body), builtin(builtin)
         { }
     };
 
@@ -289,6 +470,13 @@ namespace {
          */
         std::vector<HeapEntity*> entities;
 
+        /** Entities that are never collected, e.g. the strings of string literals.
+         *
+         * These are not in entities, so sweep() never considers them.  They can still be marked,
+         * which is harmless.  They are deleted along with the heap.
+         */
+        std::vector<HeapEntity*> immortalEntities;
+
         /** The number of heap entities at the last garbage collection cycle. */
         unsigned long lastNumEntities;
 
@@ -299,7 +487,7 @@ namespace {
          */
         void addIfHeapEntity(Value v, std::vector<HeapEntity*> &vec)
         {
-            if (v.isHeap()) vec.push_back(v.v.h);
+            if (v.isHeap()) vec.push_back(v.getHeap());
         }
 
         /** Add the HeapEntity inside v to vec, if the value exists on the heap.   
@@ -321,12 +509,15 @@ namespace {
         {
             // Nothing is marked, everything will be collected.
             sweep();
+            for (auto *x : immortalEntities) {
+                delete x;
+            }
         }
 
         /** Garbage collection: Mark v, and entities reachable from v. */
         void markFrom(Value v)
         {
-            if (v.isHeap()) markFrom(v.v.h);
+            if (v.isHeap()) markFrom(v.getHeap());
         }
 
         /** Garbage collection: Mark heap entities reachable from the given heap entity. */
@@ -347,7 +538,9 @@ namespace {
                 size_t curr_index = stack.size() - 1;
                 State &s = stack[curr_index];
                 HeapEntity *curr = s.ent;
-                if (curr->mark != thisMark) {
+                // Immortal entities only refer to other immortal entities, so there is no need to
+                // go inside them.
+                if (curr->mark != thisMark && !curr->immortal) {
                     curr->mark = thisMark;
 
                     if (auto *obj = dynamic_cast<HeapSimpleObject*>(curr)) {
@@ -381,7 +574,7 @@ namespace {
                     } else if (auto *thunk = dynamic_cast<HeapThunk*>(curr)) {
                         if (thunk->filled) {
                             if (thunk->content.isHeap())
-                                addIfHeapEntity(thunk->content.v.h, s.children);
+                                addIfHeapEntity(thunk->content.getHeap(), s.children);
                         } else {
                             for (auto upv : thunk->upValues)
                                 addIfHeapEntity(upv.second, s.children);
@@ -438,10 +631,44 @@ namespace {
             T *r = new T(std::forward<Args>(args)...);
             entities.push_back(r);
             r->mark = lastMark;
+            r->immortal = false;
             numEntities = entities.size();
             return r;
         }
 
+        /** Allocate a heap entity that is never garbage collected.
+         *
+         * The entity lives until the heap is destroyed.  It must not refer to collectable
+         * entities, as they would not be kept alive by it.  Marking does not go inside it.
+         */
+        template <class T, class... Args> T* makeImmortalEntity(Args&&... args)
+        {
+            T *r = new T(std::forward<Args>(args)...);
+            immortalEntities.push_back(r);
+            r->mark = lastMark;
+            r->immortal = true;
+            return r;
+        }
+
+        /** The number of immortal entities made so far. */
+        unsigned long numImmortalEntities(void) const
+        {
+            return immortalEntities.size();
+        }
+
+        /** Delete the immortal entities made since there were the given number of them.
+         *
+         * This is for abandoning a structure that turned out not to be needed, before anything
+         * else can refer to it.
+         */
+        void deleteImmortalEntities(unsigned long num)
+        {
+            for (unsigned long i = num ; i < immortalEntities.size() ; ++i) {
+                delete immortalEntities[i];
+            }
+            immortalEntities.resize(num);
+        }
+
     };
 
 }
@@ -14,158 +14,222 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
-#include <set>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include "core/static_analysis.h"
 #include "core/static_error.h"
 #include "core/ast.h"
 
-typedef std::set<const Identifier *> IdSet;
+namespace {
 
-/** Inserts all of s into r. */
-static void append(IdSet &r, const IdSet &s)
-{
-    r.insert(s.begin(), s.end());
-}
-
-/** Statically analyse the given ast.
+/** Holds the state of a single pass over the AST.
  *
- * \param ast_ The AST.
- * \param in_object Whether or not ast_ is within the lexical scope of an object AST.
- * \param vars The variables defined within lexical scope of ast_.
- * \returns The free variables in ast_.
+ * The variables in scope are counted in a hash table rather than copied into a new set at each
+ * binding construct.  The free variables are collected on a single vector: each AST appends
+ * its own to the end, and its parent takes them from there.
  */
-static IdSet static_analysis(AST *ast_, bool in_object, const IdSet &vars)
-{
-    IdSet r;
-
-    if (auto *ast = dynamic_cast<const Apply*>(ast_)) {
-        append(r, static_analysis(ast->target, in_object, vars));
-        for (AST *arg : ast->arguments)
-            append(r, static_analysis(arg, in_object, vars));
-
-    } else if (auto *ast = dynamic_cast<const Array*>(ast_)) {
-        for (AST *el : ast->elements)
-            append(r, static_analysis(el, in_object, vars));
-
-    } else if (auto *ast = dynamic_cast<const Binary*>(ast_)) {
-        append(r, static_analysis(ast->left, in_object, vars));
-        append(r, static_analysis(ast->right, in_object, vars));
-
-    } else if (dynamic_cast<const BuiltinFunction*>(ast_)) {
-        // Nothing to do.
-
-    } else if (auto *ast = dynamic_cast<const Conditional*>(ast_)) {
-        append(r, static_analysis(ast->cond, in_object, vars));
-        append(r, static_analysis(ast->branchTrue, in_object, vars));
-        append(r, static_analysis(ast->branchFalse, in_object, vars));
-
-    } else if (auto *ast = dynamic_cast<const Error*>(ast_)) {
-        append(r, static_analysis(ast->expr, in_object, vars));
-
-    } else if (auto *ast = dynamic_cast<const Function*>(ast_)) {
-        auto new_vars = vars;
-        IdSet params;
-        for (auto *p : ast->parameters) {
-            if (params.find(p) != params.end()) {
-                std::string msg = "Duplicate function parameter: " + encode_utf8(p->name);
-                throw StaticError(ast_->location, msg);
-            }
-            params.insert(p);
-            new_vars.insert(p);
-        }
-        auto fv = static_analysis(ast->body, in_object, new_vars);
-        for (auto *p : ast->parameters)
-            fv.erase(p);
-        append(r, fv);
+class StaticAnalysis {
 
-    } else if (dynamic_cast<const Import*>(ast_)) {
-        // Nothing to do.
+    /** For each variable, how many enclosing constructs bind it. */
+    std::unordered_map<const Identifier *, unsigned> scope;
 
-    } else if (dynamic_cast<const Importstr*>(ast_)) {
-        // Nothing to do.
+    /** The free variables of the ASTs analysed so far, that have not yet been taken by their
+     * parents.
+     */
+    std::vector<const Identifier *> free;
 
-    } else if (auto *ast = dynamic_cast<const Index*>(ast_)) {
-        append(r, static_analysis(ast->target, in_object, vars));
-        append(r, static_analysis(ast->index, in_object, vars));
+    /** Where to collect the imports, if anywhere. */
+    std::vector<const AST *> *imports;
 
-    } else if (auto *ast = dynamic_cast<const Local*>(ast_)) {
-        IdSet ast_vars;
-        for (const auto &bind: ast->binds) {
-            ast_vars.insert(bind.first);
-        }
-        auto new_vars = vars;
-        append(new_vars, ast_vars);
-        IdSet fvs;
-        for (const auto &bind: ast->binds)
-            append(fvs, static_analysis(bind.second, in_object, new_vars));
+    void bind(const Identifier *id)
+    {
+        scope[id]++;
+    }
 
-        append(fvs, static_analysis(ast->body, in_object, new_vars));
+    void unbind(const Identifier *id)
+    {
+        scope[id]--;
+    }
 
-        for (const auto &bind: ast->binds)
-            fvs.erase(bind.first);
+    typedef std::unordered_set<const Identifier *> Bound;
 
-        append(r, fvs);
+    /** Removes the bound variables from the free variables from position begin onwards, in one
+     * pass however many there are.
+     */
+    void erase(std::size_t begin, const Bound &bound)
+    {
+        if (bound.empty()) return;
+        auto is_bound = [&](const Identifier *id) { return bound.count(id) > 0; };
+        free.erase(std::remove_if(free.begin() + begin, free.end(), is_bound), free.end());
+    }
 
-    } else if (dynamic_cast<const LiteralBoolean*>(ast_)) {
-        // Nothing to do.
+    public:
+
+    StaticAnalysis(std::vector<const AST *> *imports)
+      : imports(imports)
+    { }
+
+    /** Statically analyse the given ast.
+     *
+     * Leaves the free variables of ast_ at the end of free, sorted and without duplicates, and
+     * also stores them in ast_->freeVariables.
+     *
+     * \param ast_ The AST.
+     * \param in_object Whether or not ast_ is within the lexical scope of an object AST.
+     */
+    void analyse(AST *ast_, bool in_object)
+    {
+        std::size_t begin = free.size();
+
+        if (auto *ast = dynamic_cast<const Apply*>(ast_)) {
+            analyse(ast->target, in_object);
+            for (AST *arg : ast->arguments)
+                analyse(arg, in_object);
+
+        } else if (auto *ast = dynamic_cast<const Array*>(ast_)) {
+            for (AST *el : ast->elements)
+                analyse(el, in_object);
+
+        } else if (auto *ast = dynamic_cast<const ArrayComprehension*>(ast_)) {
+            // Each spec can see the variables of the for specs before it, the body sees them all.
+            Bound bound;
+            for (const auto &spec : ast->specs) {
+                std::size_t spec_begin = free.size();
+                analyse(spec.expr, in_object);
+                erase(spec_begin, bound);
+                if (spec.kind == ComprehensionSpec::FOR) {
+                    bind(spec.var);
+                    bound.insert(spec.var);
+                }
+            }
+            std::size_t body_begin = free.size();
+            analyse(ast->body, in_object);
+            erase(body_begin, bound);
+            for (const auto &spec : ast->specs) {
+                if (spec.kind == ComprehensionSpec::FOR)
+                    unbind(spec.var);
+            }
 
-    } else if (dynamic_cast<const LiteralNumber*>(ast_)) {
-        // Nothing to do.
+        } else if (auto *ast = dynamic_cast<const Binary*>(ast_)) {
+            analyse(ast->left, in_object);
+            analyse(ast->right, in_object);
 
-    } else if (dynamic_cast<const LiteralString*>(ast_)) {
-        // Nothing to do.
+        } else if (dynamic_cast<const BuiltinFunction*>(ast_)) {
+            // Nothing to do.
 
-    } else if (dynamic_cast<const LiteralNull*>(ast_)) {
-        // Nothing to do.
+        } else if (auto *ast = dynamic_cast<const Conditional*>(ast_)) {
+            analyse(ast->cond, in_object);
+            analyse(ast->branchTrue, in_object);
+            analyse(ast->branchFalse, in_object);
 
-    } else if (auto *ast = dynamic_cast<Object*>(ast_)) {
-        for (auto assert : ast->asserts) {
-            append(r, static_analysis(assert, true, vars));
-        }
-        for (auto field : ast->fields) {
-            append(r, static_analysis(field.name, in_object, vars));
-            append(r, static_analysis(field.body, true, vars));
-        }
+        } else if (auto *ast = dynamic_cast<const Error*>(ast_)) {
+            analyse(ast->expr, in_object);
 
-    } else if (auto *ast = dynamic_cast<ObjectComprehensionSimple*>(ast_)) {
-        auto new_vars = vars;
-        new_vars.insert(ast->id);
-        append(r, static_analysis(ast->field, false, new_vars));
-        append(r, static_analysis(ast->value, true, new_vars));
-        r.erase(ast->id);
-        append(r, static_analysis(ast->array, in_object, vars));
+        } else if (auto *ast = dynamic_cast<const Function*>(ast_)) {
+            Bound bound;
+            for (auto *p : ast->parameters) {
+                if (!bound.insert(p).second) {
+                    std::string msg = "Duplicate function parameter: " + encode_utf8(p->name);
+                    throw StaticError(ast_->location, msg);
+                }
+            }
+            for (auto *p : ast->parameters)
+                bind(p);
+            analyse(ast->body, in_object);
+            erase(begin, bound);
+            for (auto *p : ast->parameters)
+                unbind(p);
+
+        } else if (dynamic_cast<const Import*>(ast_)) {
+            if (imports != nullptr) imports->push_back(ast_);
+
+        } else if (dynamic_cast<const Importstr*>(ast_)) {
+            if (imports != nullptr) imports->push_back(ast_);
+
+        } else if (auto *ast = dynamic_cast<const Index*>(ast_)) {
+            analyse(ast->target, in_object);
+            analyse(ast->index, in_object);
+
+        } else if (auto *ast = dynamic_cast<const Local*>(ast_)) {
+            Bound bound;
+            for (const auto &bind: ast->binds) {
+                this->bind(bind.first);
+                bound.insert(bind.first);
+            }
+            for (const auto &bind: ast->binds)
+                analyse(bind.second, in_object);
+            analyse(ast->body, in_object);
+            erase(begin, bound);
+            for (const auto &bind: ast->binds)
+                unbind(bind.first);
 
-    } else if (dynamic_cast<const Self*>(ast_)) {
-        if (!in_object)
-            throw StaticError(ast_->location, "Can't use self outside of an object.");
+        } else if (dynamic_cast<const LiteralBoolean*>(ast_)) {
+            // Nothing to do.
 
-    } else if (dynamic_cast<const Super*>(ast_)) {
-        if (!in_object)
-            throw StaticError(ast_->location, "Can't use super outside of an object.");
+        } else if (dynamic_cast<const LiteralNumber*>(ast_)) {
+            // Nothing to do.
 
-    } else if (auto *ast = dynamic_cast<const Unary*>(ast_)) {
-        append(r, static_analysis(ast->expr, in_object, vars));
+        } else if (dynamic_cast<const LiteralString*>(ast_)) {
+            // Nothing to do.
 
-    } else if (auto *ast = dynamic_cast<const Var*>(ast_)) {
-        if (vars.find(ast->id) == vars.end()) {
-            throw StaticError(ast->location, "Unknown variable: "+encode_utf8(ast->id->name));
-        }
-        r.insert(ast->id);
+        } else if (dynamic_cast<const LiteralNull*>(ast_)) {
+            // Nothing to do.
 
-    } else {
-        std::cerr << "INTERNAL ERROR: Unknown AST: " << ast_ << std::endl;
-        std::abort();
+        } else if (auto *ast = dynamic_cast<Object*>(ast_)) {
+            for (auto assert : ast->asserts) {
+                analyse(assert, true);
+            }
+            for (auto field : ast->fields) {
+                analyse(field.name, in_object);
+                analyse(field.body, true);
+            }
 
-    }
+        } else if (auto *ast = dynamic_cast<ObjectComprehensionSimple*>(ast_)) {
+            bind(ast->id);
+            // Like an object's field names, these are evaluated in the enclosing object.
+            analyse(ast->field, in_object);
+            analyse(ast->value, true);
+            erase(begin, Bound{ast->id});
+            unbind(ast->id);
+            analyse(ast->array, in_object);
+
+        } else if (dynamic_cast<const Self*>(ast_)) {
+            if (!in_object)
+                throw StaticError(ast_->location, "Can't use self outside of an object.");
+
+        } else if (dynamic_cast<const Super*>(ast_)) {
+            if (!in_object)
+                throw StaticError(ast_->location, "Can't use super outside of an object.");
+
+        } else if (auto *ast = dynamic_cast<const Unary*>(ast_)) {
+            analyse(ast->expr, in_object);
+
+        } else if (auto *ast = dynamic_cast<const Var*>(ast_)) {
+            auto it = scope.find(ast->id);
+            if (it == scope.end() || it->second == 0) {
+                throw StaticError(ast->location, "Unknown variable: "+encode_utf8(ast->id->name));
+            }
+            free.push_back(ast->id);
 
-    for (auto *id : r)
-        ast_->freeVariables.push_back(id);
+        } else {
+            std::cerr << "INTERNAL ERROR: Unknown AST: " << ast_ << std::endl;
+            std::abort();
 
-    return r;
-}
+        }
+
+        // The children left theirs sorted, so this is usually cheap.
+        std::sort(free.begin() + begin, free.end());
+        free.erase(std::unique(free.begin() + begin, free.end()), free.end());
+        ast_->freeVariables.assign(free.begin() + begin, free.end());
+    }
+};
+
+}  // namespace
 
-void jsonnet_static_analysis(AST *ast)
+void jsonnet_static_analysis(AST *ast, std::vector<const AST*> *imports)
 {
-    static_analysis(ast, false, IdSet{});
+    StaticAnalysis(imports).analyse(ast, false);
 }
@@ -19,9 +19,13 @@ limitations under the License.
 
 #include "core/ast.h"
 
+#include <vector>
+
 /** Check the ast for appropriate use of self, super, and correctly bound variables.  Also
  * initialize the freeVariables member of function and object ASTs.
+ *
+ * \param imports If not null, the Import and Importstr ASTs found are appended to it.
  */
-void jsonnet_static_analysis(AST *ast);
+void jsonnet_static_analysis(AST *ast, std::vector<const AST*> *imports=nullptr);
 
 #endif
@@ -17,13 +17,17 @@ limitations under the License.
 #ifndef JSONNET_STATIC_ERROR_H
 #define JSONNET_STATIC_ERROR_H
 
+#include <memory>
+#include <ostream>
+#include <string>
+
 struct Location {
-    unsigned long line;
-    unsigned long column;
+    unsigned line;
+    unsigned column;
     Location(void)
       : line(0), column(0)
     { }
-    Location(unsigned long line_number, unsigned long column)
+    Location(unsigned line_number, unsigned column)
       : line(line_number), column(column)
     { }
     bool isSet(void) const
@@ -39,29 +43,40 @@ static inline std::ostream &operator<<(std::ostream &o, const Location &loc)
 }
 
 struct LocationRange {
-    std::string file;
+    /** From Allocator::internFile, or nullptr if there is no file.  Whatever it points to must
+     * outlive the location.
+     */
+    const std::string *file;
     Location begin, end;
     LocationRange(void)
+      : file(nullptr)
     { }
     /** This is useful for special locations, e.g. manifestation entry point. */
-    LocationRange(const std::string &msg)
+    explicit LocationRange(const std::string *msg)
       : file(msg)
     { }
-    LocationRange(const std::string &file, const Location &begin, const Location &end)
+    LocationRange(const std::string *file, const Location &begin, const Location &end)
       : file(file), begin(begin), end(end)
     { }
     bool isSet(void) const
     {
         return begin.isSet();
     }
+    /** The file name, or "" if there is none. */
+    const std::string &fileName(void) const
+    {
+        static const std::string none;
+        return file == nullptr ? none : *file;
+    }
 };
 
 static inline std::ostream &operator<<(std::ostream &o, const LocationRange &loc)
 {
-    if (loc.file.length() > 0)
-        o << loc.file;
+    const std::string &file = loc.fileName();
+    if (file.length() > 0)
+        o << file;
     if (loc.isSet()) {
-        if (loc.file.length() > 0)
+        if (file.length() > 0)
             o << ":";
         if (loc.begin.line == loc.end.line) {
             if (loc.begin.column == loc.end.column) {
@@ -77,6 +92,10 @@ static inline std::ostream &operator<<(std::ostream &o, const LocationRange &loc
 }
 
 struct StaticError {
+    /** The file name, for errors found before there is an Allocator to intern it, i.e. by the
+     * lexer.  Copies of the error share it.
+     */
+    std::shared_ptr<const std::string> file;
     LocationRange location;
     std::string msg;
     StaticError(const std::string &msg)
@@ -84,7 +103,8 @@ struct StaticError {
     {
     }
     StaticError(const std::string &filename, const Location &location, const std::string &msg)
-      : location(filename, location, location), msg(msg)
+      : file(std::make_shared<const std::string>(filename)),
+        location(file.get(), location, location), msg(msg)
     {
     }
     StaticError(const LocationRange &location, const std::string &msg)
@@ -0,0 +1,398 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <set>
+
+#include "core/strictness_analysis.h"
+#include "core/ast.h"
+
+namespace {
+
+typedef std::set<const Identifier *> IdSet;
+
+/** The variables that are certainly forced by the time an expression yields its value. */
+struct Forced {
+    /** The expression never yields a value (e.g. it is an error), so it vacuously forces
+     * every variable. */
+    bool all;
+    IdSet ids;
+    Forced(void) : all(false) { }
+};
+
+/** Inserts all of s into r. */
+void append(Forced &r, const Forced &s)
+{
+    r.all = r.all || s.all;
+    r.ids.insert(s.ids.begin(), s.ids.end());
+}
+
+/** The variables forced by both a and b. */
+Forced intersect(const Forced &a, const Forced &b)
+{
+    if (a.all) return b;
+    if (b.all) return a;
+    Forced r;
+    std::set_intersection(a.ids.begin(), a.ids.end(), b.ids.begin(), b.ids.end(),
+                          std::inserter(r.ids, r.ids.begin()));
+    return r;
+}
+
+/** What is known statically about a variable in scope. */
+struct Binding {
+    /** The AST bound by a local, or nullptr for function parameters and comprehension
+     * variables. */
+    AST *ast;
+    /** Whether forcing the variable may force a function parameter.  Other variables are left
+     * out of Forced::ids, which keeps the sets small. */
+    bool tracked;
+    Binding(AST *ast, bool tracked) : ast(ast), tracked(tracked) { }
+};
+
+/** If the AST is a function or builtin, return it, otherwise nullptr.
+ *
+ * Locals around the function are skipped, since object fields are wrapped in the object's
+ * locals, e.g. local $ = self.
+ */
+AST *function_ast(AST *ast)
+{
+    while (auto *local = dynamic_cast<Local*>(ast))
+        ast = local->body;
+    if (dynamic_cast<Function*>(ast) || dynamic_cast<BuiltinFunction*>(ast))
+        return ast;
+    return nullptr;
+}
+
+/** Computes the strict parameters of every function in an AST.
+ *
+ * Every function starts out strict in all of its parameters, and parameters that are not
+ * forced on some path through the body are cleared.  Calls are only resolved to functions bound
+ * by locals, so if a strictness bit that was already used at a call site is cleared, analysing
+ * the definitions of that local again is enough to reach a fixed point.  This finds parameters
+ * of recursive functions like sum(x) that are only forced in the base case and in the recursive
+ * call.
+ */
+class StrictnessAnalysis {
+
+    /** The object whose fields are being analysed, i.e. the value of self. */
+    Object *currentObject;
+
+    /** The variables in scope, innermost binding last. */
+    std::map<const Identifier *, std::vector<Binding>> scope;
+
+    /** Functions whose strictness was used at a call site. */
+    std::set<const Function *> used;
+
+    /** Whether a strictness bit that was used has been cleared. */
+    bool changed;
+
+    /** The fields of objects bound by locals, indexed by name.  If not all field names are
+     * literals, this is empty.  Duplicate field names are mapped to nullptr. */
+    std::map<const Object *, std::map<String, AST *>> objectFields;
+
+    void bind(const Identifier *id, AST *ast, bool tracked)
+    {
+        scope[id].emplace_back(ast, tracked);
+    }
+
+    void unbind(const Identifier *id)
+    {
+        scope[id].pop_back();
+    }
+
+    const Binding *lookUp(const Identifier *id)
+    {
+        auto it = scope.find(id);
+        if (it == scope.end() || it->second.empty()) return nullptr;
+        return &it->second.back();
+    }
+
+    /** The strictness bits of the function, initialised to true on first use. */
+    std::vector<bool> &strictParams(Function *ast)
+    {
+        if (ast->strictParams.size() != ast->parameters.size())
+            ast->strictParams.assign(ast->parameters.size(), true);
+        return ast->strictParams;
+    }
+
+    /** If the given expression certainly evaluates to a known function, return its AST (a
+     * Function or BuiltinFunction), otherwise nullptr.
+     *
+     * This recognizes functions bound by locals, e.g. local f(x) = ...; f(y), and methods of
+     * objects bound by locals, e.g. std.equals(a, b).
+     */
+    AST *resolve(AST *ast_)
+    {
+        if (auto *ast = dynamic_cast<Var*>(ast_)) {
+            const Binding *b = lookUp(ast->id);
+            if (b == nullptr || b->ast == nullptr) return nullptr;
+            return function_ast(b->ast);
+
+        } else if (auto *ast = dynamic_cast<Index*>(ast_)) {
+            auto *var = dynamic_cast<Var*>(ast->target);
+            auto *name = dynamic_cast<LiteralString*>(ast->index);
+            if (var == nullptr || name == nullptr) return nullptr;
+            const Binding *b = lookUp(var->id);
+            if (b == nullptr) return nullptr;
+            auto *obj = dynamic_cast<Object*>(b->ast);
+            if (obj == nullptr) return nullptr;
+            auto fit = objectFields.find(obj);
+            if (fit == objectFields.end()) {
+                auto &fields = objectFields[obj];
+                for (const auto &field : obj->fields) {
+                    auto *field_name = dynamic_cast<LiteralString*>(field.name);
+                    // Computed field names could be anything.
+                    if (field_name == nullptr) {
+                        fields.clear();
+                        break;
+                    }
+                    auto ins = fields.insert(std::make_pair(field_name->value, field.body));
+                    if (!ins.second) ins.first->second = nullptr;
+                }
+                fit = objectFields.find(obj);
+            }
+            auto found = fit->second.find(name->value);
+            if (found == fit->second.end() || found->second == nullptr) return nullptr;
+            return function_ast(found->second);
+
+        }
+        return function_ast(ast_);
+    }
+
+    /** Analyse the given ast, updating the strictness of any functions within it.
+     *
+     * \param ast_ The AST.
+     * \returns The variables forced by evaluating ast_.
+     */
+    Forced analyse(AST *ast_)
+    {
+        Forced r;
+
+        switch (ast_->type) {
+            case AST_APPLY: {
+                auto *ast = static_cast<Apply*>(ast_);
+                r = analyse(ast->target);
+                std::vector<Forced> args;
+                for (AST *arg : ast->arguments)
+                    args.push_back(analyse(arg));
+                AST *callee = resolve(ast->target);
+                if (ast->tailstrict) {
+                    for (const auto &arg : args)
+                        append(r, arg);
+                } else if (auto *func = dynamic_cast<Function*>(callee)) {
+                    if (func->parameters.size() == args.size()) {
+                        const auto &strict = strictParams(func);
+                        used.insert(func);
+                        for (unsigned i=0 ; i<args.size() ; ++i) {
+                            if (strict[i]) append(r, args[i]);
+                        }
+                    }
+                } else if (auto *func = dynamic_cast<BuiltinFunction*>(callee)) {
+                    // Builtins force all of their arguments.
+                    if (func->params.size() == args.size()) {
+                        for (const auto &arg : args)
+                            append(r, arg);
+                    }
+                }
+            } break;
+
+            case AST_ARRAY: {
+                // Elements are lazy.
+                for (AST *el : static_cast<Array*>(ast_)->elements)
+                    analyse(el);
+            } break;
+
+            case AST_BINARY: {
+                auto *ast = static_cast<Binary*>(ast_);
+                r = analyse(ast->left);
+                Forced right = analyse(ast->right);
+                // The right hand side of && and || is not always evaluated.
+                if (ast->op != BOP_AND && ast->op != BOP_OR)
+                    append(r, right);
+            } break;
+
+            case AST_CONDITIONAL: {
+                auto *ast = static_cast<Conditional*>(ast_);
+                r = analyse(ast->cond);
+                append(r, intersect(analyse(ast->branchTrue), analyse(ast->branchFalse)));
+            } break;
+
+            case AST_ERROR: {
+                analyse(static_cast<Error*>(ast_)->expr);
+                r.all = true;
+            } break;
+
+            case AST_FUNCTION: {
+                auto *ast = static_cast<Function*>(ast_);
+                for (auto *p : ast->parameters)
+                    bind(p, nullptr, true);
+                Forced body = analyse(ast->body);
+                for (auto *p : ast->parameters)
+                    unbind(p);
+                auto &strict = strictParams(ast);
+                for (unsigned i=0 ; i<ast->parameters.size() ; ++i) {
+                    auto *p = ast->parameters[i];
+                    bool forced = body.all || body.ids.find(p) != body.ids.end();
+                    if (strict[i] && !forced) {
+                        strict[i] = false;
+                        if (used.find(ast) != used.end()) changed = true;
+                    }
+                }
+                // Creating the closure forces nothing.
+            } break;
+
+            case AST_INDEX: {
+                auto *ast = static_cast<Index*>(ast_);
+                r = analyse(ast->target);
+                append(r, analyse(ast->index));
+            } break;
+
+            case AST_LOCAL: {
+                auto *ast = static_cast<Local*>(ast_);
+                for (const auto &bind : ast->binds) {
+                    // Assume self is not extended, e.g. for local std = self in the standard
+                    // library.
+                    AST *value = bind.second;
+                    if (value->type == AST_SELF) value = currentObject;
+                    this->bind(bind.first, value, true);
+                }
+                // The functions defined here can only be called from within this local, so the
+                // definitions are analysed until the strictness of those calls is stable.
+                std::map<const Identifier *, Forced> binds;
+                bool outer_changed = changed;
+                do {
+                    changed = false;
+                    for (const auto &bind : ast->binds)
+                        binds[bind.first] = analyse(bind.second);
+                } while (changed);
+                changed = outer_changed;
+                for (const auto &bind : ast->binds) {
+                    const Forced &forced = binds[bind.first];
+                    if (!forced.all && forced.ids.empty())
+                        scope[bind.first].back().tracked = false;
+                }
+                r = analyse(ast->body);
+                for (const auto &bind : ast->binds)
+                    unbind(bind.first);
+
+                // Forcing a local variable forces its definition.
+                std::vector<const Identifier *> todo(r.ids.begin(), r.ids.end());
+                IdSet done;
+                while (!todo.empty()) {
+                    const Identifier *id = todo.back();
+                    todo.pop_back();
+                    auto it = binds.find(id);
+                    if (it == binds.end() || done.find(id) != done.end()) continue;
+                    done.insert(id);
+                    for (const auto *id2 : it->second.ids) {
+                        if (r.ids.insert(id2).second) todo.push_back(id2);
+                    }
+                    r.all = r.all || it->second.all;
+                }
+
+                for (const auto &bind : ast->binds)
+                    r.ids.erase(bind.first);
+            } break;
+
+            case AST_OBJECT: {
+                auto *ast = static_cast<Object*>(ast_);
+                // Field names are evaluated when the object is created, the rest is lazy.
+                for (const auto &field : ast->fields)
+                    append(r, analyse(field.name));
+                Object *outer_object = currentObject;
+                currentObject = ast;
+                for (AST *assert : ast->asserts)
+                    analyse(assert);
+                for (const auto &field : ast->fields)
+                    analyse(field.body);
+                currentObject = outer_object;
+            } break;
+
+            case AST_ARRAY_COMPREHENSION: {
+                // Only the first array is certain to be evaluated.
+                auto *ast = static_cast<ArrayComprehension*>(ast_);
+                r = analyse(ast->specs[0].expr);
+                for (unsigned i = 0; i < ast->specs.size(); ++i) {
+                    const auto &spec = ast->specs[i];
+                    if (i > 0) analyse(spec.expr);
+                    if (spec.kind == ComprehensionSpec::FOR)
+                        bind(spec.var, nullptr, false);
+                }
+                analyse(ast->body);
+                for (const auto &spec : ast->specs) {
+                    if (spec.kind == ComprehensionSpec::FOR)
+                        unbind(spec.var);
+                }
+            } break;
+
+            case AST_OBJECT_COMPREHENSION_SIMPLE: {
+                auto *ast = static_cast<ObjectComprehensionSimple*>(ast_);
+                bind(ast->id, nullptr, false);
+                analyse(ast->field);
+                analyse(ast->value);
+                unbind(ast->id);
+                r = analyse(ast->array);
+            } break;
+
+            case AST_UNARY:
+            r = analyse(static_cast<Unary*>(ast_)->expr);
+            break;
+
+            case AST_VAR: {
+                auto *ast = static_cast<Var*>(ast_);
+                const Binding *b = lookUp(ast->id);
+                if (b != nullptr && b->tracked)
+                    r.ids.insert(ast->id);
+            } break;
+
+            case AST_BUILTIN_FUNCTION:
+            case AST_IMPORT:
+            case AST_IMPORTSTR:
+            case AST_LITERAL_BOOLEAN:
+            case AST_LITERAL_NULL:
+            case AST_LITERAL_NUMBER:
+            case AST_LITERAL_STRING:
+            case AST_SELF:
+            case AST_SUPER:
+            // Nothing to do.
+            break;
+
+            default:
+            std::cerr << "INTERNAL ERROR: Unknown AST: " << ast_ << std::endl;
+            std::abort();
+        }
+
+        return r;
+    }
+
+    public:
+
+    void run(AST *ast)
+    {
+        changed = false;
+        currentObject = nullptr;
+        analyse(ast);
+    }
+};
+
+}  // namespace
+
+void jsonnet_strictness_analysis(AST *ast)
+{
+    StrictnessAnalysis().run(ast);
+}
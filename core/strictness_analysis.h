@@ -0,0 +1,33 @@
+/*
+Copyright 2015 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef JSONNET_STRICTNESS_ANALYSIS_H
+#define JSONNET_STRICTNESS_ANALYSIS_H
+
+#include "core/ast.h"
+
+/** Find the parameters of each function that are always forced when its body is evaluated, and
+ * record them in the strictParams member of the function ASTs.
+ *
+ * The interpreter uses this to compute some arguments eagerly instead of allocating a thunk for
+ * them.  It only does so when that cannot fail, so the result affects performance but not
+ * behavior, and the analysis is free to make optimistic assumptions (e.g. that self in the
+ * standard library is not extended).  This is the last pass before execution, i.e. after static analysis and constant
+ * folding.
+ */
+void jsonnet_strictness_analysis(AST *ast);
+
+#endif
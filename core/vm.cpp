@@ -18,13 +18,26 @@ limitations under the License.
 
 #include <cassert>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <system_error>
+#include <thread>
 
+#include "core/constant_folding.h"
 #include "core/desugaring.h"
+#include "core/json.h"
+#include "core/number.h"
+#include "core/parse_cache.h"
 #include "core/parser.h"
 #include "core/state.h"
 #include "core/static_analysis.h"
+#include "core/strictness_analysis.h"
 
 namespace {
 
@@ -39,6 +52,13 @@ namespace {
         return "";
     }
 
+    /** The location of errors found while manifesting the result. */
+    LocationRange during_manifestation(void)
+    {
+        static const std::string msg = "During manifestation";
+        return LocationRange(&msg);
+    }
+
     /** Stack frames.
      *
      * Of these, FRAME_CALL is the most special, as it is the only frame the stack
@@ -46,6 +66,8 @@ namespace {
      */
     enum FrameKind {
         FRAME_APPLY_TARGET,  // e in e(...)
+        FRAME_ARRAY_COMP_FOR,  // e in [a for x in e], then binds x while iterating
+        FRAME_ARRAY_COMP_IF,  // e in [a for x in b if e]
         FRAME_BINARY_LEFT,  // a in a + b 
         FRAME_BINARY_RIGHT,  // b in a + b
         FRAME_BUILTIN_FILTER,  // When executing std.filter, used to hold intermediate state.
@@ -97,7 +119,12 @@ namespace {
          */
         LocationRange location;
 
-        /** Reuse this stack frame for the purpose of tail call optimization. */
+        /** Reuse this stack frame for the purpose of tail call optimization.
+         *
+         * Set on the FRAME_CALL of a function whose body is being evaluated.  A function call
+         * made from the body with nothing but FRAME_LOCAL above this frame is in tail position,
+         * so this frame can be dropped in favour of the new one.
+         */
         bool tailCall;
 
         /** Used for a variety of purposes. */
@@ -146,21 +173,39 @@ namespace {
         /** A set of variables introduced at this point. */
         BindingFrame bindings;
 
+        /** Whether the name of context for stack traces has already been found, in name.
+         * Usually it is looked up when needed, in the frames below this one, but a call frame
+         * made by a tail call has had those frames removed, so it is found beforehand.
+         */
+        bool named;
+
+        /** The name found for context, if named.  May be nullptr for an anonymous one. */
+        const Identifier *name;
+
+        /** A call frame that a tail call removed in favour of this one, for stack traces. */
+        struct Elided {
+            LocationRange location;
+            HeapEntity *context;
+            bool named;
+            const Identifier *name;
+        };
+
+        /** The call frames that tail calls removed in favour of this one, oldest first.  Only
+         * the oldest and the most recent are kept, elidedDropped counts the others.
+         */
+        std::vector<Elided> elided;
+
+        unsigned long elidedDropped;
+
         Frame(const FrameKind &kind, const AST *ast)
           : kind(kind), ast(ast), location(ast->location), tailCall(false), elementId(0),
-            context(NULL), self(NULL), offset(0)
-        {
-            val.t = Value::NULL_TYPE;
-            val2.t = Value::NULL_TYPE;
-        }
+            context(NULL), self(NULL), offset(0), named(false), name(nullptr), elidedDropped(0)
+        { }
 
         Frame(const FrameKind &kind, const LocationRange &location)
           : kind(kind), ast(nullptr), location(location), tailCall(false), elementId(0),
-            context(NULL), self(NULL), offset(0)
-        {
-            val.t = Value::NULL_TYPE;
-            val2.t = Value::NULL_TYPE;
-        }
+            context(NULL), self(NULL), offset(0), named(false), name(nullptr), elidedDropped(0)
+        { }
 
         /** Mark everything visible from this frame. */
         void mark(Heap &heap) const
@@ -175,6 +220,8 @@ namespace {
                 heap.markFrom(el.second);
             for (const auto &th : thunks)
                 heap.markFrom(th);
+            for (const auto &e : elided)
+                if (e.context) heap.markFrom(e.context);
         }
 
         bool isCall(void) const
@@ -250,26 +297,34 @@ namespace {
 
         /** Attempt to find a name for a given heap entity.  This may not be possible, but we try
          * reasonably hard.  We look in the bindings for a variable in the closest scope that
-         * happens to point at the entity in question.  Otherwise, the best we can do is use its
-         * type.
+         * happens to point at the entity in question.
+         *
+         * \returns The variable, or nullptr if there is none.
          */
-        std::string getName(unsigned from_here, const HeapEntity *e)
+        const Identifier *findName(unsigned from_here, const HeapEntity *e)
         {
-            std::string name;
+            const Identifier *name = nullptr;
             for (int i=from_here-1 ; i>=0; --i) {
                 const auto &f = stack[i];
                 for (const auto &pair : f.bindings) {
                     HeapThunk *thunk = pair.second;
                     if (!thunk->filled) continue;
                     if (!thunk->content.isHeap()) continue;
-                    if (e != thunk->content.v.h) continue;
-                    name = encode_utf8(pair.first->name);
+                    if (e != thunk->content.getHeap()) continue;
+                    name = pair.first;
                 }
                 // Do not go into the next call frame, keep local reasoning.
                 if (f.isCall()) break;
             }
+            return name;
+        }
 
-            if (name == "") name = "anonymous";
+        /** Describe a heap entity for a stack trace, by the name from findName if there is one.
+         * Otherwise, the best we can do is use its type.
+         */
+        std::string describe(const HeapEntity *e, const Identifier *id)
+        {
+            std::string name = id == nullptr ? "anonymous" : encode_utf8(id->name);
             if (dynamic_cast<const HeapObject*>(e)) {
                 return "object <" + name + ">";
             } else if (auto *thunk = dynamic_cast<const HeapThunk*>(e)) {
@@ -284,6 +339,12 @@ namespace {
             }
         }
 
+        /** Describe the context of the frame at the given index, or of one it replaced. */
+        std::string describe(unsigned i, const HeapEntity *e, bool named, const Identifier *id)
+        {
+            return describe(e, named ? id : findName(i, e));
+        }
+
         /** Dump the stack.
          *
          * This is useful to help debug the VM in gdb.  It is virtual to stop it
@@ -310,9 +371,23 @@ namespace {
                 if (f.isCall()) {
                     if (f.context != nullptr) {
                         // Give the last line a name.
-                        stack_trace[stack_trace.size()-1].name = getName(i, f.context);
+                        stack_trace[stack_trace.size()-1].name =
+                            describe(i, f.context, f.named, f.name);
                     }
                     stack_trace.push_back(TraceFrame(f.location));
+                    // The frames this one replaced, as if they were still below it.
+                    for (auto it = f.elided.rbegin() ; it != f.elided.rend() ; ++it) {
+                        if (it + 1 == f.elided.rend() && f.elidedDropped > 0) {
+                            // The last line was called from a dropped frame, so has no name.
+                            std::stringstream ss;
+                            ss << "(" << f.elidedDropped << " tail calls elided)";
+                            stack_trace.push_back(TraceFrame(LocationRange(), ss.str()));
+                        } else if (it->context != nullptr) {
+                            stack_trace[stack_trace.size()-1].name =
+                                describe(i, it->context, it->named, it->name);
+                        }
+                        stack_trace.push_back(TraceFrame(it->location));
+                    }
                 }
             }
             return RuntimeError(stack_trace, msg);
@@ -324,33 +399,72 @@ namespace {
             stack.emplace_back(args...);
         }
 
-        /** If there is a tailstrict annotated frame followed by some locals, pop them all. */
-        void tailCallTrimStack (void)
+        /** If there is a function call frame followed by some locals, the index of the call
+         * frame, otherwise -1.
+         */
+        int tailCallFrame(void)
         {
             for (int i=stack.size()-1 ; i>=0 ; --i) {
                 switch (stack[i].kind) {
                     case FRAME_CALL: {
                         if (!stack[i].tailCall || stack[i].thunks.size() > 0) {
-                            return;
+                            return -1;
                         }
-                        // Remove all stack frames including this one.
-                        while (stack.size() > unsigned(i)) stack.pop_back();
-                        calls--;
-                        return;
+                        return i;
                     } break;
 
                     case FRAME_LOCAL: break;
 
-                    default: return;
+                    default: return -1;
                 }
             }
+            return -1;
+        }
+
+        /** How many of the call frames removed by tail calls are kept for stack traces. */
+        static const unsigned MAX_ELIDED = 20;
+
+        /** New call frame for a user defined function called from the body of another.  If the
+         * call is in tail position, the caller's frame and its locals are popped first, and the
+         * caller is remembered in the new frame for stack traces.  A tail recursive function
+         * then runs in constant stack space.
+         */
+        void newTailCall(const LocationRange &loc, HeapClosure *func,
+                         const BindingFrame &up_values)
+        {
+            int i = tailCallFrame();
+            if (i < 0) {
+                newCall(loc, func, func->self, func->offset, up_values);
+                top().tailCall = true;
+                return;
+            }
+            // The name of func, as it would be found with the caller's frames still there.
+            const Identifier *name = findName(stack.size(), func);
+            Frame &caller = stack[i];
+            std::vector<Frame::Elided> elided;
+            elided.swap(caller.elided);
+            unsigned long dropped = caller.elidedDropped;
+            elided.push_back(Frame::Elided{caller.location, caller.context, caller.named,
+                                           caller.name});
+            if (elided.size() > MAX_ELIDED) {
+                // Keep the oldest, where the tail calls started.
+                elided.erase(elided.begin() + 1);
+                dropped++;
+            }
+            while (stack.size() > unsigned(i)) stack.pop_back();
+            calls--;
+            newCall(loc, func, func->self, func->offset, up_values);
+            top().tailCall = true;
+            top().named = true;
+            top().name = name;
+            top().elided.swap(elided);
+            top().elidedDropped = dropped;
         }
 
         /** New call frame. */
         void newCall(const LocationRange &loc, HeapEntity *context, HeapObject *self,
                      unsigned offset, const BindingFrame &up_values)
         {
-            tailCallTrimStack();
             if (calls >= limit) {
                 throw makeError(loc, "Max stack frames exceeded.");
             }
@@ -382,17 +496,6 @@ namespace {
                 }
             }
         }
-
-        /** Look up the stack to see if we're running assertions for this object. */
-        bool alreadyExecutingInvariants(HeapObject *self)
-        {
-            for (int i=stack.size() - 1 ; i>=0 ; --i) {
-                if (stack[i].kind == FRAME_INVARIANTS) {
-                    if (stack[i].self == self) return true;
-                }
-            }
-            return false;
-        }
     };
 
     /** Typedef to save some typing. */
@@ -401,6 +504,9 @@ namespace {
     /** Typedef to save some typing. */
     typedef std::map<std::string, std::string> StrMap;
 
+    /** The directory of the importing file, and the path it imports. */
+    typedef std::pair<std::string, String> ImportKey;
+
 
     /** Holds the intermediate state during execution and implements the necessary functions to
      * implement the semantics of the language.
@@ -433,24 +539,120 @@ namespace {
         /** Used to "name" thunks created to execute invariants. */
         const Identifier *idInvariant;
 
+        /** Bound to a field's thunk when indexing an object built from JSON. */
+        const Identifier *idJsonField;
+
+        /** The body of every field of an object built from JSON, a reference to idJsonField. */
+        const AST *jsonFieldBody;
+
         struct ImportCacheValue {
+            /** Whether the file is waiting for an import thread, being loaded by some thread, or
+             * loaded.  Nothing else is read until it is LOADED, except by the thread loading it.
+             */
+            enum { QUEUED, LOADING, LOADED } state;
+            /** Whether an import thread should also parse the file, because it was reached by
+             * import rather than importstr.
+             */
+            bool parse;
+            /** Whether a callback has returned the file, or an error.  The batch import callback
+             * can do that before the file is LOADED, so that an import thread only parses it.
+             */
+            bool loaded;
             std::string foundHere;
-            std::string content;
+            /** The file as returned by the import callback, or nullptr if the callback failed.  It
+             * is not copied, but freed along with the ImportCacheValue.
+             */
+            char *content;
+            /** The length of the content, up to its first \0. */
+            size_t length;
+            /** If the callback failed, its error message. */
+            std::string error;
+            /** Whether the content is JSON.  This is worked out when it is first imported. */
+            enum { JSON_UNKNOWN, JSON_NO, JSON_YES } json;
+            /** If json is JSON_YES, the value of the content. */
+            Value jsonValue;
+            /** If json is JSON_NO, the file parsed and analysed, once it has been. */
+            AST *expr;
+            /** If an import thread could not parse the file, the error, which is thrown when
+             * evaluation reaches the import.
+             */
+            std::unique_ptr<StaticError> parseError;
+
+            ImportCacheValue(void)
+              : state(QUEUED), parse(false), loaded(false), content(nullptr), length(0),
+                json(JSON_UNKNOWN), expr(nullptr)
+            { }
+
+            ~ImportCacheValue()
+            {
+                ::free(content);
+            }
         };
 
-        /** Cache for imported Jsonnet files. */
-        std::map<std::pair<std::string, String>,
-                 const ImportCacheValue *> cachedImports;
+        /** The LiteralString AST nodes holding a string materialized by this interpreter.
+         *
+         * The strings are immortal, so evaluating a literal a second time does not allocate.
+         */
+        std::vector<const LiteralString*> literalStrings;
+
+        /** Immortal strings holding a single code point, allocated on first use. */
+        HeapString *charStrings[256];
+
+        /** Cache for imported files, including those queued for the import threads. */
+        std::map<ImportKey, ImportCacheValue *> cachedImports;
+
+        /** Threads that load and parse imports ahead of evaluation, see queueImports. */
+        std::vector<std::thread> importThreads;
+
+        /** Guards cachedImports, importQueue, stopImportThreads, and the state of each
+         * ImportCacheValue.
+         */
+        std::mutex importMutex;
+
+        /** Signalled when an import is queued, or the import threads should stop. */
+        std::condition_variable importQueued;
+
+        /** Signalled when an import is LOADED. */
+        std::condition_variable importLoaded;
+
+        /** Imports waiting for an import thread. */
+        std::deque<ImportKey> importQueue;
+
+        /** Set when the interpreter is destroyed. */
+        bool stopImportThreads;
+
+        /** The import callbacks are only called by one thread at a time. */
+        std::mutex callbackMutex;
 
         /** External variables for std.extVar. */
         ExtMap externalVars;
 
+        /** The values of external variables that are code, created on first use.
+         *
+         * This way the code is only parsed (along with its copy of the standard library) and
+         * evaluated once, however many times std.extVar is called.  Each is a thunk, so it is
+         * only forced when needed.  The thunks are garbage collection roots.
+         */
+        std::map<std::string, HeapThunk*> externalCode;
+
         /** The callback used for loading imported files. */
         JsonnetImportCallback *importCallback;
 
         /** User context pointer for the import callback. */
         void *importCallbackContext;
 
+        /** The callback used for loading the files imported by a file all at once, or nullptr. */
+        JsonnetImportBatchCallback *importBatchCallback;
+
+        /** User context pointer for the batch import callback. */
+        void *importBatchCallbackContext;
+
+        /** Where parsed imports are cached, or "" for nowhere, see jsonnet_parse_cached. */
+        std::string cacheDir;
+
+        /** Whether to output numbers the way earlier versions did, see jsonnet_format_number. */
+        bool compatNumbers;
+
         RuntimeError makeError(const LocationRange &loc, const std::string &msg)
         {
             return stack.makeError(loc, msg);
@@ -473,6 +675,11 @@ namespace {
                 // Mark from the scratch register
                 heap.markFrom(scratch);
 
+                // Mark from the values of external code.
+                for (const auto &pair : externalCode) {
+                    if (pair.second != nullptr) heap.markFrom(pair.second);
+                }
+
                 // Delete unreachable objects.
                 heap.sweep();
             }
@@ -482,16 +689,14 @@ namespace {
         Value makeBoolean(bool v)
         {
             Value r;
-            r.t = Value::BOOLEAN;
-            r.v.b = v;
+            r.setBoolean(v);
             return r;
         }
 
         Value makeDouble(double v)
         {
             Value r;
-            r.t = Value::DOUBLE;
-            r.v.d = v;
+            r.setDouble(v);
             return r;
         }
 
@@ -509,27 +714,26 @@ namespace {
         Value makeNull(void)
         {
             Value r;
-            r.t = Value::NULL_TYPE;
+            r.setNull();
             return r;
         }
 
         Value makeArray(const std::vector<HeapThunk*> &v)
         {
             Value r;
-            r.t = Value::ARRAY;
-            r.v.h = makeHeap<HeapArray>(v);
+            r.setHeap(Value::ARRAY, makeHeap<HeapArray>(v));
             return r;
         }
 
         Value makeClosure(const BindingFrame &env,
                            HeapObject *self,
                            unsigned offset,
-                           const std::vector<const Identifier *> &params,
-                           AST *body)
+                           const Function &ast)
         {
             Value r;
-            r.t = Value::FUNCTION;
-            r.v.h = makeHeap<HeapClosure>(env, self, offset, params, body, 0);
+            r.setHeap(Value::FUNCTION,
+                      makeHeap<HeapClosure>(env, self, offset, ast.parameters, &ast.strictParams,
+                                            ast.body, 0));
             return r;
         }
 
@@ -537,25 +741,47 @@ namespace {
         {
             AST *body = nullptr;
             Value r;
-            r.t = Value::FUNCTION;
-            r.v.h = makeHeap<HeapClosure>(BindingFrame(), nullptr, 0,
-                                          params, body, builtin_id);
+            r.setHeap(Value::FUNCTION, makeHeap<HeapClosure>(BindingFrame(), nullptr, 0,
+                                                             params, nullptr, body, builtin_id));
             return r;
         }
 
         template <class T, class... Args> Value makeObject(Args... args)
         {
             Value r;
-            r.t = Value::OBJECT;
-            r.v.h = makeHeap<T>(args...);
+            r.setHeap(Value::OBJECT, makeHeap<T>(args...));
             return r;
         }
 
         Value makeString(const String &v)
         {
             Value r;
-            r.t = Value::STRING;
-            r.v.h = makeHeap<HeapString>(v);
+            r.setHeap(Value::STRING, makeHeap<HeapString>(v));
+            return r;
+        }
+
+        /** The value of a string literal.  The string is only materialized once per AST node. */
+        Value makeLiteralString(const LiteralString *ast)
+        {
+            if (ast->heapString == nullptr) {
+                ast->heapString = heap.makeImmortalEntity<HeapString>(ast->value);
+                literalStrings.push_back(ast);
+            }
+            Value r;
+            r.setHeap(Value::STRING, static_cast<HeapString*>(ast->heapString));
+            return r;
+        }
+
+        /** A string of length 1.  Common code points are served from an immortal table. */
+        Value makeCharString(char32_t c)
+        {
+            if (c >= sizeof(charStrings) / sizeof(*charStrings))
+                return makeString(String(&c, 1));
+            HeapString *&str = charStrings[c];
+            if (str == nullptr)
+                str = heap.makeImmortalEntity<HeapString>(String(&c, 1));
+            Value r;
+            r.setHeap(Value::STRING, str);
             return r;
         }
 
@@ -662,63 +888,500 @@ namespace {
             return r;
         }
 
+        /** State while building a value from the structure of a JSON document. */
+        struct JsonWalk {
+            const char *text;
+            unsigned long length;
+            /** \see jsonnet_json_index */
+            std::vector<uint32_t> offsets;
+            /** The offset to look at next. */
+            unsigned long next;
+            /** Whether to build the value, or only check that there is one. */
+            bool build;
+            /** Whether to make immortal entities. */
+            bool immortal;
+            /** Scratch space for decoding strings. */
+            std::string utf8;
+            JsonError err;
+            /** How many arrays and objects enclose the next value. */
+            unsigned depth;
+            /** Values are built recursively, so there has to be a limit on the depth. */
+            static const unsigned MAX_DEPTH = 1000;
+        };
+
+        /** Make a heap entity for a value being built from JSON.
+         *
+         * This never collects garbage, as the parts of the value are not reachable from anywhere
+         * until it is finished.
+         */
+        template <class T, class... Args> T* makeJsonEntity(JsonWalk &w, Args&&... args)
+        {
+            if (w.immortal)
+                return heap.makeImmortalEntity<T>(std::forward<Args>(args)...);
+            return heap.makeEntity<T>(std::forward<Args>(args)...);
+        }
+
+        /** Set the error to be about the character at the next offset. */
+        bool jsonUnexpected(JsonWalk &w, const std::string &expected)
+        {
+            unsigned long at = w.offsets[w.next];
+            if (at == w.length) {
+                w.err = JsonError{at, "unexpected end of input, expected " + expected};
+            } else {
+                w.err = JsonError{at, "unexpected '" + std::string(1, w.text[at])
+                                      + "', expected " + expected};
+            }
+            return false;
+        }
+
+        /** Decode the string whose opening quote is at the next offset into w.utf8. */
+        bool jsonString(JsonWalk &w)
+        {
+            unsigned long begin = w.offsets[w.next] + 1;
+            unsigned long end = w.offsets[w.next + 1];
+            w.next += 2;
+            if (!jsonnet_json_string(w.text + begin, w.text + end, w.utf8, w.err)) {
+                w.err.offset += begin;
+                return false;
+            }
+            return true;
+        }
+
+        /** Enter the array or object at the next offset, unless there are too many already. */
+        bool jsonEnter(JsonWalk &w)
+        {
+            if (++w.depth > JsonWalk::MAX_DEPTH) {
+                w.err = JsonError{w.offsets[w.next], "nesting too deep"};
+                return false;
+            }
+            return true;
+        }
+
+        /** Build the value that starts at the next offset, unless only checking.  Checking does
+         * not touch the interpreter, so can be done on any thread.
+         */
+        bool jsonValue(JsonWalk &w, Value &v)
+        {
+            const char *c = w.text + w.offsets[w.next];
+            switch (*c) {
+                case '{': {
+                    if (!jsonEnter(w)) return false;
+                    HeapComprehensionObject *obj = nullptr;
+                    std::set<std::string> checked_keys;
+                    if (w.build) {
+                        obj = makeJsonEntity<HeapComprehensionObject>(
+                            w, BindingFrame{}, jsonFieldBody, idJsonField);
+                        v.setHeap(Value::OBJECT, obj);
+                    }
+                    w.next++;
+                    if (w.text[w.offsets[w.next]] == '}') {
+                        w.next++;
+                        w.depth--;
+                        return true;
+                    }
+                    while (true) {
+                        unsigned long key = w.offsets[w.next];
+                        if (w.text[key] != '"') return jsonUnexpected(w, "a field name");
+                        if (!jsonString(w)) return false;
+                        const Identifier *fid = nullptr;
+                        std::pair<std::set<std::string>::iterator, bool> checked;
+                        if (w.build)
+                            fid = alloc->makeIdentifier(decode_utf8(w.utf8.data(),
+                                                                    w.utf8.length()));
+                        else
+                            checked = checked_keys.insert(w.utf8);
+                        if (w.text[w.offsets[w.next]] != ':') return jsonUnexpected(w, "':'");
+                        w.next++;
+                        Value field;
+                        if (!jsonValue(w, field)) return false;
+                        bool duplicate = w.build
+                            ? !obj->compValues.emplace(
+                                  fid, makeJsonEntity<HeapThunk>(w, fid, field)).second
+                            : !checked.second;
+                        if (duplicate) {
+                            std::string name = w.build ? encode_utf8(fid->name) : *checked.first;
+                            w.err = JsonError{key, "duplicate field name: \"" + name + "\""};
+                            return false;
+                        }
+                        char sep = w.text[w.offsets[w.next]];
+                        if (sep == '}') break;
+                        if (sep != ',') return jsonUnexpected(w, "',' or '}'");
+                        w.next++;
+                    }
+                    w.next++;
+                    w.depth--;
+                } return true;
+
+                case '[': {
+                    if (!jsonEnter(w)) return false;
+                    HeapArray *arr = nullptr;
+                    if (w.build) {
+                        arr = makeJsonEntity<HeapArray>(w, std::vector<HeapThunk*>{});
+                        v.setHeap(Value::ARRAY, arr);
+                    }
+                    w.next++;
+                    if (w.text[w.offsets[w.next]] == ']') {
+                        w.next++;
+                        w.depth--;
+                        return true;
+                    }
+                    while (true) {
+                        Value element;
+                        if (!jsonValue(w, element)) return false;
+                        if (w.build)
+                            arr->elements.push_back(
+                                makeJsonEntity<HeapThunk>(w, idArrayElement, element));
+                        char sep = w.text[w.offsets[w.next]];
+                        if (sep == ']') break;
+                        if (sep != ',') return jsonUnexpected(w, "',' or ']'");
+                        w.next++;
+                    }
+                    w.next++;
+                    w.depth--;
+                } return true;
+
+                case '"': {
+                    if (!jsonString(w)) return false;
+                    if (w.build)
+                        v.setHeap(Value::STRING, makeJsonEntity<HeapString>(
+                            w, decode_utf8(w.utf8.data(), w.utf8.length())));
+                } return true;
+
+                default: {
+                    // Numbers, true, false and null run up to the next whitespace or structural
+                    // character.
+                    const char *end;
+                    double d;
+                    if (std::strncmp(c, "true", 4) == 0) {
+                        end = c + 4;
+                        v = makeBoolean(true);
+                    } else if (std::strncmp(c, "false", 5) == 0) {
+                        end = c + 5;
+                        v = makeBoolean(false);
+                    } else if (std::strncmp(c, "null", 4) == 0) {
+                        end = c + 4;
+                        v = makeNull();
+                    } else if ((end = jsonnet_json_number(c, d)) != nullptr) {
+                        if (!std::isfinite(d)) {
+                            w.err = JsonError{w.offsets[w.next], "number out of range"};
+                            return false;
+                        }
+                        v = makeDouble(d);
+                    } else {
+                        return jsonUnexpected(w, "a value");
+                    }
+                    if (end != w.text + w.length && !jsonnet_json_delimiter(*end))
+                        return jsonUnexpected(w, "a value");
+                    w.next++;
+                } return true;
+            }
+        }
+
+        /** Build the value of a JSON document directly.
+         *
+         * Data files can be very large.  Parsing and evaluating them as Jsonnet creates ASTs,
+         * objects with captured environments, and a thunk per element.  Instead, the structure
+         * of the document is found with jsonnet_json_index, and the value is built from that.
+         * Objects are comprehension objects whose field thunks are already filled.
+         *
+         * \param text The document, followed by \0.
+         * \param length The length of the document.
+         * \param immortal Whether to make the value from immortal entities, for a value that lives
+         * as long as the interpreter.  The garbage collector never has to look inside it.
+         * \param v Set to the value.
+         * \param err Set if the text is not JSON.
+         * \returns Whether the text was JSON.  If not, any immortal entities made are deleted.
+         */
+        bool jsonDocument(const char *text, unsigned long length, bool immortal, Value &v,
+                          JsonError &err)
+        {
+            unsigned long num_immortal = heap.numImmortalEntities();
+            JsonWalk w{text, length, {}, 0, true, immortal, std::string(), JsonError(), 0};
+            if (jsonnet_json_index(text, length, w.offsets, w.err) && jsonValue(w, v)) {
+                if (w.next == w.offsets.size() - 1) return true;
+                jsonUnexpected(w, "the end of input");
+            }
+            if (immortal) heap.deleteImmortalEntities(num_immortal);
+            err = w.err;
+            return false;
+        }
+
+        /** Whether the text is a JSON document, without building its value.
+         *
+         * This does not touch the interpreter, so the import threads use it to decide which files
+         * to parse.
+         */
+        bool jsonCheck(const char *text, unsigned long length)
+        {
+            JsonWalk w{text, length, {}, 0, false, false, std::string(), JsonError(), 0};
+            Value v;
+            return jsonnet_json_index(text, length, w.offsets, w.err) && jsonValue(w, v)
+                   && w.next == w.offsets.size() - 1;
+        }
+
+        /** Store what an import callback returned in value, taking ownership of it. */
+        static void storeImport(ImportCacheValue *value, int success, char *found_here,
+                                char *content)
+        {
+            value->loaded = true;
+            if (!success) {
+                value->error = content;
+                ::free(content);
+                ::free(found_here);
+                return;
+            }
+            value->foundHere = found_here;
+            ::free(found_here);
+            value->content = content;
+            value->length = std::strlen(content);
+        }
+
+        /** Call the import callback, and store what it returns in value.
+         *
+         * This runs on the import threads as well as the interpreter's thread, without holding
+         * importMutex.
+         */
+        void loadImport(const ImportKey &key, ImportCacheValue *value)
+        {
+            int success = 0;
+            char *found_here_cptr = nullptr;
+            char *content;
+            {
+                std::lock_guard<std::mutex> lock(callbackMutex);
+                content = importCallback(importCallbackContext, key.first.c_str(),
+                                         encode_utf8(key.second).c_str(), &found_here_cptr,
+                                         &success);
+            }
+            storeImport(value, success, found_here_cptr, content);
+        }
+
+        /** Call the batch import callback once for each directory in keys, and store what it
+         * returns in the corresponding values.  Those it leaves alone are not marked loaded.
+         *
+         * Like loadImport, this runs on any thread, without holding importMutex.
+         */
+        void loadImportBatch(const std::vector<ImportKey> &keys,
+                             const std::vector<ImportCacheValue*> &values)
+        {
+            // The keys come from the imports of one file, so there is usually just one directory.
+            for (size_t begin = 0, end ; begin < keys.size() ; begin = end) {
+                const std::string &dir = keys[begin].first;
+                for (end = begin + 1 ; end < keys.size() && keys[end].first == dir ; ++end);
+                size_t n = end - begin;
+                std::vector<std::string> rels;
+                std::vector<const char*> rel_ptrs;
+                for (size_t i = begin ; i < end ; ++i)
+                    rels.push_back(encode_utf8(keys[i].second));
+                for (const auto &rel : rels)
+                    rel_ptrs.push_back(rel.c_str());
+                std::vector<char*> found_here(n, nullptr), contents(n, nullptr);
+                std::vector<int> success(n, 0);
+                {
+                    std::lock_guard<std::mutex> lock(callbackMutex);
+                    importBatchCallback(importBatchCallbackContext, dir.c_str(), &rel_ptrs[0], n,
+                                        &found_here[0], &contents[0], &success[0]);
+                }
+                for (size_t i = 0 ; i < n ; ++i) {
+                    if (contents[i] == nullptr) {
+                        // Left to the import callback, when the import is reached.
+                        ::free(found_here[i]);
+                        continue;
+                    }
+                    storeImport(values[begin + i], success[i], found_here[i], contents[i]);
+                }
+            }
+        }
+
+        /** Parse and analyse an imported file that is not JSON.
+         *
+         * This runs on the import threads as well as the interpreter's thread.  The files it
+         * imports in turn are passed to queueImports.
+         *
+         * \throws StaticError if the file is not valid Jsonnet.
+         */
+        AST *parseImport(const ImportCacheValue *input)
+        {
+            std::vector<const AST*> imports;
+            bool prefetch = !importThreads.empty() || importBatchCallback != nullptr;
+            AST *expr = jsonnet_parse_cached(alloc, cacheDir, input->foundHere, input->content,
+                                             prefetch ? &imports : nullptr);
+            queueImports(imports);
+            return expr;
+        }
+
+        /** The body of each import thread: load and parse queued imports until stopped. */
+        void importThread(void)
+        {
+            std::unique_lock<std::mutex> lock(importMutex);
+            while (true) {
+                importQueued.wait(lock, [this] {
+                    return stopImportThreads || !importQueue.empty();
+                });
+                if (stopImportThreads) return;
+                ImportKey key = importQueue.front();
+                importQueue.pop_front();
+                ImportCacheValue *value = cachedImports[key];
+                // The interpreter may have needed it first, and loaded it itself.
+                if (value->state != ImportCacheValue::QUEUED) continue;
+                value->state = ImportCacheValue::LOADING;
+                bool parse = value->parse;
+                lock.unlock();
+
+                if (!value->loaded)
+                    loadImport(key, value);
+                // JSON files are left to the interpreter, which builds their values on its heap.
+                if (parse && value->content != nullptr
+                    && !jsonCheck(value->content, value->length)) {
+                    value->json = ImportCacheValue::JSON_NO;
+                    try {
+                        value->expr = parseImport(value);
+                    } catch (const StaticError &e) {
+                        value->parseError.reset(new StaticError(e));
+                    }
+                }
+
+                lock.lock();
+                value->state = ImportCacheValue::LOADED;
+                importLoaded.notify_all();
+            }
+        }
+
+        /** Load the files imported by the given Import and Importstr ASTs ahead of evaluation,
+         * unless that has already been started, and parse those reached by import.
+         *
+         * The batch import callback, if there is one, is called right away for all of the new
+         * files at once.  The import threads, if there are any, load the files it leaves alone
+         * and parse the Jsonnet ones.  They go to the front of the thread's queue, in order:
+         * evaluation is depth first, so it usually needs the files imported by a file it has just
+         * reached before the rest of the files imported by its parent.
+         *
+         * Errors are kept until evaluation reaches the import, so that files which are imported
+         * but never used behave as before.
+         */
+        void queueImports(const std::vector<const AST*> &imports)
+        {
+            if (imports.empty() || (importThreads.empty() && importBatchCallback == nullptr))
+                return;
+            std::vector<ImportKey> keys;
+            std::vector<ImportCacheValue*> values;
+            {
+                std::lock_guard<std::mutex> lock(importMutex);
+                auto pos = importQueue.begin();
+                for (const AST *ast : imports) {
+                    bool is_import = ast->type == AST_IMPORT;
+                    const String &file = is_import ? static_cast<const Import*>(ast)->file
+                                                   : static_cast<const Importstr*>(ast)->file;
+                    ImportKey key(dir_name(ast->location.fileName()), file);
+                    ImportCacheValue *&value = cachedImports[key];
+                    if (value == nullptr) {
+                        value = new ImportCacheValue();
+                        if (importBatchCallback == nullptr) {
+                            pos = importQueue.insert(pos, key) + 1;
+                        } else {
+                            keys.push_back(key);
+                            values.push_back(value);
+                        }
+                    }
+                    if (is_import && value->state == ImportCacheValue::QUEUED)
+                        value->parse = true;
+                }
+                importQueued.notify_all();
+                if (keys.empty()) return;
+                // Nobody else touches them until the batch callback is done.
+                for (auto *value : values)
+                    value->state = ImportCacheValue::LOADING;
+            }
+
+            loadImportBatch(keys, values);
+
+            std::lock_guard<std::mutex> lock(importMutex);
+            auto pos = importQueue.begin();
+            for (size_t i = 0 ; i < keys.size() ; ++i) {
+                ImportCacheValue *value = values[i];
+                if (value->loaded && (!value->parse || importThreads.empty())) {
+                    value->state = ImportCacheValue::LOADED;
+                } else {
+                    value->state = ImportCacheValue::QUEUED;
+                    if (!importThreads.empty())
+                        pos = importQueue.insert(pos, keys[i]) + 1;
+                }
+            }
+            importQueued.notify_all();
+            importLoaded.notify_all();
+        }
+
         /** Import another Jsonnet file.
          *
          * If the file has already been imported, then use that version.  This maintains
-         * referential transparency in the case of writes to disk during execution.
+         * referential transparency in the case of writes to disk during execution.  The file is
+         * only parsed once, however many times it is imported.
+         *
+         * Files that are plain JSON (whatever they are called) are not parsed as Jsonnet, their
+         * value is built directly.  \see jsonDocument
          *
          * \param loc Location of the import statement.
          * \param file Path to the filename.
+         * \returns The AST of the file, or nullptr if it was JSON, in which case the value is left
+         * in scratch.
          */
         AST *import(const LocationRange &loc, const String &file)
         {
-            const ImportCacheValue *input = importString(loc, file);
-            AST *expr = jsonnet_parse(alloc, input->foundHere, input->content.c_str());
-            jsonnet_desugar(alloc, expr);
-            jsonnet_static_analysis(expr);
-            return expr;
+            ImportCacheValue *input = importString(loc, file);
+            if (input->json == ImportCacheValue::JSON_UNKNOWN) {
+                // Anything that is not JSON is left to the parser, including the errors.
+                JsonError err;
+                input->json = jsonDocument(input->content, input->length, true, input->jsonValue,
+                                           err)
+                            ? ImportCacheValue::JSON_YES : ImportCacheValue::JSON_NO;
+            }
+            if (input->json == ImportCacheValue::JSON_YES) {
+                scratch = input->jsonValue;
+                return nullptr;
+            }
+            if (input->parseError != nullptr)
+                throw *input->parseError;
+            if (input->expr == nullptr)
+                input->expr = parseImport(input);
+            return input->expr;
         }
 
         /** Import a file as a string.
          *
          * If the file has already been imported, then use that version.  This maintains
-         * referential transparency in the case of writes to disk during execution.
+         * referential transparency in the case of writes to disk during execution.  If an import
+         * thread is loading the file, this waits for it.
          *
          * \param loc Location of the import statement.
          * \param file Path to the filename.
-         * \param found_here If non-null, used to store the actual path of the file
          */
-        const ImportCacheValue *importString(const LocationRange &loc, const String &file)
+        ImportCacheValue *importString(const LocationRange &loc, const String &file)
         {
-            std::string dir = dir_name(loc.file);
-
-            std::pair<std::string, String> key(dir, file);
-            const ImportCacheValue *cached_value = cachedImports[key];
-            if (cached_value != nullptr)
-                return cached_value;
-
-
-            int success = 0;
-            char *found_here_cptr;
-            char *content =
-                importCallback(importCallbackContext, dir.c_str(), encode_utf8(file).c_str(),
-                               &found_here_cptr, &success);
-
-            std::string input(content);
-            ::free(content);
-
-            if (!success) {
-                    std::string msg = "Couldn't open import \"" + encode_utf8(file) + "\": ";
-                    msg += input;
-                    throw makeError(loc, msg);
+            ImportKey key(dir_name(loc.fileName()), file);
+            std::unique_lock<std::mutex> lock(importMutex);
+            ImportCacheValue *&value = cachedImports[key];
+            if (value == nullptr)
+                value = new ImportCacheValue();
+            ImportCacheValue *input = value;
+            if (input->state == ImportCacheValue::QUEUED) {
+                // Rather than wait for an import thread to get to it.
+                input->state = ImportCacheValue::LOADING;
+                lock.unlock();
+                if (!input->loaded)
+                    loadImport(key, input);
+                lock.lock();
+                input->state = ImportCacheValue::LOADED;
             }
-
-            auto *input_ptr = new ImportCacheValue();
-            input_ptr->foundHere = found_here_cptr;
-            input_ptr->content = input;
-            ::free(found_here_cptr);
-            cachedImports[key] = input_ptr;
-            return input_ptr;
+            importLoaded.wait(lock, [input] {
+                return input->state == ImportCacheValue::LOADED;
+            });
+            lock.unlock();
+
+            if (input->content == nullptr) {
+                std::string msg = "Couldn't open import \"" + encode_utf8(file) + "\": ";
+                msg += input->error;
+                throw makeError(loc, msg);
+            }
+            return input;
         }
 
         /** Capture the required variables from the environment. */
@@ -734,6 +1397,239 @@ namespace {
             return env;
         }
 
+        /** Get the array a comprehension iterates over from the value in scratch.
+         *
+         * Strings are iterated one character at a time, so are replaced by an array of their
+         * characters.  The array is left in scratch.
+         *
+         * \param loc The location of the expression that gave the value.
+         * \param var The variable that is bound to each element.
+         */
+        void comprehensionArray(const LocationRange &loc, const Identifier *var)
+        {
+            if (scratch.type() == Value::ARRAY) return;
+            if (scratch.type() != Value::STRING) {
+                throw makeError(loc, "In comprehension, can only iterate over array, got "
+                                     + type_str(scratch) + ".");
+            }
+            // Copy the string, it is no longer reachable once scratch is replaced.
+            const String str = static_cast<HeapString*>(scratch.getHeap())->value;
+            scratch = makeArray({});
+            auto &elements = static_cast<HeapArray*>(scratch.getHeap())->elements;
+            for (char32_t c : str) {
+                // The new thunk keeps the new string alive if the
+                // thunk's allocation triggers a GC cycle.
+                elements.push_back(makeHeap<HeapThunk>(var, makeCharString(c)));
+            }
+        }
+
+        /** Make progress on an array comprehension.
+         *
+         * Every for spec that is currently bound has a FRAME_ARRAY_COMP_FOR frame on the stack,
+         * innermost on top.  Each holds the index of its spec in elementId, the remaining
+         * elements to bind (in reverse order) in thunks, the binding itself, and the array being
+         * built in val.  An if spec has a FRAME_ARRAY_COMP_IF frame only while its condition is
+         * evaluated.
+         *
+         * \param ast The comprehension.
+         * \param spec The next spec to run, or specs.size() to add an element.
+         * \param advance Ignore spec and move the innermost for spec to its next element.
+         * \param result The array being built, only used when there is no frame yet.
+         * \returns The AST to evaluate next, or nullptr when the comprehension is complete, in
+         * which case the frame of the first spec is on top of the stack.
+         */
+        const AST *arrayComprehensionStep(const ArrayComprehension &ast, unsigned spec,
+                                          bool advance, const Value &result)
+        {
+            while (true) {
+                if (!advance) {
+                    if (spec < ast.specs.size()) {
+                        const ComprehensionSpec &s = ast.specs[spec];
+                        Value arr = spec == 0 ? result : stack.top().val;
+                        stack.newFrame(s.kind == ComprehensionSpec::FOR ? FRAME_ARRAY_COMP_FOR
+                                                                        : FRAME_ARRAY_COMP_IF,
+                                       &ast);
+                        stack.top().elementId = spec;
+                        stack.top().val = arr;
+                        return s.expr;
+                    }
+                    // All specs passed, add an element to the array.
+                    HeapObject *self;
+                    unsigned offset;
+                    stack.getSelfBinding(self, offset);
+                    auto *el_th = makeHeap<HeapThunk>(idArrayElement, self, offset, ast.body);
+                    el_th->upValues = capture(ast.body->freeVariables);
+                    static_cast<HeapArray*>(stack.top().val.getHeap())->elements.push_back(el_th);
+                }
+                // Move the innermost for spec on, or finish it and go to the one outside it.
+                Frame &f = stack.top();
+                if (f.thunks.size() > 0) {
+                    f.bindings[ast.specs[f.elementId].var] = f.thunks.back();
+                    f.thunks.pop_back();
+                    spec = f.elementId + 1;
+                    advance = false;
+                } else if (f.elementId == 0) {
+                    return nullptr;
+                } else {
+                    stack.pop();
+                    advance = true;
+                }
+            }
+        }
+
+        /** Try to compute the value of a simple expression without pushing any frames.
+         *
+         * Only literals, variables that were already forced, and arithmetic, comparison and
+         * logical operators on numbers and booleans are handled.  Anything else, and any
+         * operation that would raise an error (type mismatch, division by zero, overflow), gives
+         * up and returns false, leaving the expression to be evaluated in the normal way.  So
+         * this never raises an error or allocates, and calling it early is not observable.
+         *
+         * \param ast_ The expression.
+         * \param v Receives the value, if successful.
+         * \returns Whether the value could be computed.
+         */
+        bool simpleValue(const AST *ast_, Value &v)
+        {
+            switch (ast_->type) {
+                case AST_LITERAL_BOOLEAN:
+                v = makeBoolean(static_cast<const LiteralBoolean*>(ast_)->value);
+                return true;
+
+                case AST_LITERAL_NULL:
+                v = makeNull();
+                return true;
+
+                case AST_LITERAL_NUMBER: {
+                    double d = static_cast<const LiteralNumber*>(ast_)->value;
+                    if (std::isnan(d) || std::isinf(d)) return false;
+                    v = makeDouble(d);
+                    return true;
+                }
+
+                case AST_VAR: {
+                    HeapThunk *thunk = stack.lookUpVar(static_cast<const Var*>(ast_)->id);
+                    if (thunk == nullptr || !thunk->filled) return false;
+                    v = thunk->content;
+                    return true;
+                }
+
+                case AST_UNARY: {
+                    const auto &ast = *static_cast<const Unary*>(ast_);
+                    Value e;
+                    if (!simpleValue(ast.expr, e)) return false;
+                    if (e.type() == Value::BOOLEAN) {
+                        if (ast.op != UOP_NOT) return false;
+                        v = makeBoolean(!e.getBoolean());
+                        return true;
+                    }
+                    if (e.type() != Value::DOUBLE) return false;
+                    switch (ast.op) {
+                        case UOP_PLUS: v = e; return true;
+                        case UOP_MINUS: v = makeDouble(-e.getDouble()); return true;
+                        case UOP_BITWISE_NOT: v = makeDouble(~(long)e.getDouble()); return true;
+                        default: return false;
+                    }
+                }
+
+                case AST_BINARY: {
+                    const auto &ast = *static_cast<const Binary*>(ast_);
+                    Value l, r;
+                    if (!simpleValue(ast.left, l) || !simpleValue(ast.right, r)) return false;
+                    if (l.type() == Value::BOOLEAN && r.type() == Value::BOOLEAN) {
+                        switch (ast.op) {
+                            case BOP_AND: v = makeBoolean(l.getBoolean() && r.getBoolean()); break;
+                            case BOP_OR: v = makeBoolean(l.getBoolean() || r.getBoolean()); break;
+                            default: return false;
+                        }
+                        return true;
+                    }
+                    if (l.type() != Value::DOUBLE || r.type() != Value::DOUBLE) return false;
+                    double ld = l.getDouble(), rd = r.getDouble();
+                    double d;
+                    switch (ast.op) {
+                        case BOP_PLUS: d = ld + rd; break;
+                        case BOP_MINUS: d = ld - rd; break;
+                        case BOP_MULT: d = ld * rd; break;
+                        case BOP_DIV:
+                        if (rd == 0) return false;
+                        d = ld / rd;
+                        break;
+                        case BOP_SHIFT_L: d = (long)ld << (long)rd; break;
+                        case BOP_SHIFT_R: d = (long)ld >> (long)rd; break;
+                        case BOP_BITWISE_AND: d = (long)ld & (long)rd; break;
+                        case BOP_BITWISE_XOR: d = (long)ld ^ (long)rd; break;
+                        case BOP_BITWISE_OR: d = (long)ld | (long)rd; break;
+                        case BOP_LESS_EQ: v = makeBoolean(ld <= rd); return true;
+                        case BOP_GREATER_EQ: v = makeBoolean(ld >= rd); return true;
+                        case BOP_LESS: v = makeBoolean(ld < rd); return true;
+                        case BOP_GREATER: v = makeBoolean(ld > rd); return true;
+                        default: return false;
+                    }
+                    if (std::isnan(d) || std::isinf(d)) return false;
+                    v = makeDouble(d);
+                    return true;
+                }
+
+                default:
+                return false;
+            }
+        }
+
+        /** Try to avoid building a lazy thunk (with captured environment) for a function argument.
+         *
+         * Literals are wrapped in a thunk that is already filled.  A variable whose thunk was
+         * already forced is passed as that same thunk.  In both cases nothing is captured and,
+         * since evaluating them cannot fail, laziness is not observable.
+         *
+         * If the callee is strict in the parameter, simple arithmetic like n - 1 is also
+         * computed immediately.  See simpleValue for why this does not change error behavior.
+         *
+         * \param param The parameter that the argument is bound to.
+         * \param strict Whether the callee always forces the parameter.
+         * \param arg The argument expression.
+         * \returns The thunk to bind, or nullptr if a regular lazy thunk is required.
+         */
+        HeapThunk *argumentThunk(const Identifier *param, bool strict, const AST *arg)
+        {
+            if (strict) {
+                Value v;
+                if (arg->type != AST_VAR && simpleValue(arg, v))
+                    return makeHeap<HeapThunk>(param, v);
+            }
+            switch (arg->type) {
+                case AST_LITERAL_BOOLEAN: {
+                    const auto *ast = static_cast<const LiteralBoolean*>(arg);
+                    return makeHeap<HeapThunk>(param, makeBoolean(ast->value));
+                }
+
+                case AST_LITERAL_NULL:
+                return makeHeap<HeapThunk>(param, makeNull());
+
+                case AST_LITERAL_NUMBER: {
+                    // Out of range literals must only raise an error when forced.
+                    const auto *ast = static_cast<const LiteralNumber*>(arg);
+                    if (std::isnan(ast->value) || std::isinf(ast->value)) return nullptr;
+                    return makeHeap<HeapThunk>(param, makeDouble(ast->value));
+                }
+
+                case AST_LITERAL_STRING: {
+                    const auto *ast = static_cast<const LiteralString*>(arg);
+                    return makeHeap<HeapThunk>(param, makeLiteralString(ast));
+                }
+
+                case AST_VAR: {
+                    const auto *ast = static_cast<const Var*>(arg);
+                    HeapThunk *thunk = stack.lookUpVar(ast->id);
+                    if (thunk != nullptr && thunk->filled) return thunk;
+                    return nullptr;
+                }
+
+                default:
+                return nullptr;
+            }
+        }
+
         /** Count the number of leaves in the tree.
          *
          * \param obj The root of the tree.
@@ -754,25 +1650,65 @@ namespace {
 
         /** Create a new interpreter.
          *
-         * \param loc The location range of the file to be executed.
+         * \param import_threads How many threads to start for loading imports ahead of
+         * evaluation, see queueImports.
+         * \param cache_dir Where to cache parsed imports, or "" for none.
          */
         Interpreter(Allocator *alloc, const ExtMap &ext_vars,
                     unsigned max_stack, double gc_min_objects, double gc_growth_trigger,
-                    JsonnetImportCallback *import_callback, void *import_callback_context)
+                    JsonnetImportCallback *import_callback, void *import_callback_context,
+                    JsonnetImportBatchCallback *import_batch_callback,
+                    void *import_batch_callback_context, unsigned import_threads,
+                    const std::string &cache_dir, bool compat_numbers)
           : heap(gc_min_objects, gc_growth_trigger), stack(max_stack), alloc(alloc),
             idArrayElement(alloc->makeIdentifier(U"array_element")),
-            idInvariant(alloc->makeIdentifier(U"object_assert")), externalVars(ext_vars),
-            importCallback(import_callback), importCallbackContext(import_callback_context)
+            idInvariant(alloc->makeIdentifier(U"object_assert")),
+            idJsonField(alloc->makeIdentifier(U"json_field")),
+            jsonFieldBody(alloc->make<Var>(LocationRange(), idJsonField)),
+            stopImportThreads(false), externalVars(ext_vars), importCallback(import_callback),
+            importCallbackContext(import_callback_context),
+            importBatchCallback(import_batch_callback),
+            importBatchCallbackContext(import_batch_callback_context), cacheDir(cache_dir),
+            compatNumbers(compat_numbers)
         {
             scratch = makeNull();
+            for (auto &s : charStrings)
+                s = nullptr;
+            for (unsigned i = 0 ; i < import_threads ; ++i) {
+                try {
+                    importThreads.emplace_back(&Interpreter::importThread, this);
+                } catch (const std::system_error &) {
+                    // Make do with the threads we have, or load imports as they are reached.
+                    break;
+                }
+            }
         }
 
         /** Clean up the heap, stack, stash, and builtin function ASTs. */
         ~Interpreter()
         {
+            {
+                std::lock_guard<std::mutex> lock(importMutex);
+                stopImportThreads = true;
+            }
+            importQueued.notify_all();
+            for (auto &thread : importThreads)
+                thread.join();
             for (const auto &pair : cachedImports) {
                 delete pair.second;
             }
+            // The ASTs may outlive the immortal strings.
+            for (const auto *ast : literalStrings)
+                ast->heapString = nullptr;
+        }
+
+        /** Start loading the files imported by the program, see queueImports.
+         *
+         * \param imports The Import and Importstr ASTs, from jsonnet_static_analysis.
+         */
+        void prefetchImports(const std::vector<const AST*> &imports)
+        {
+            queueImports(imports);
         }
 
         const Value &getScratchRegister(void)
@@ -794,7 +1730,7 @@ namespace {
         {
             if (args.size() == params.size()) {
                 for (unsigned i=0 ; i<args.size() ; ++i) {
-                    if (args[i].t != params[i]) goto bad;
+                    if (args[i].type() != params[i]) goto bad;
                 }
                 return;
             }
@@ -820,7 +1756,13 @@ namespace {
 
         String toString(const LocationRange &loc)
         {
-            return manifestJson(loc, false, U"");
+            if (scratch.type() == Value::DOUBLE) {
+                // The common case, which does not need to go through UTF-8.
+                char buf[JSONNET_NUMBER_BUFFER];
+                unsigned len = jsonnet_format_number(scratch.getDouble(), compatNumbers, buf);
+                return String(buf, buf + len);
+            }
+            return decode_utf8(manifestJson(loc, false));
         }
 
 
@@ -887,29 +1829,46 @@ namespace {
             }
         }
 
-        void runInvariants(const LocationRange &loc, HeapObject *self)
+        /** Start checking the assertions of an object, unless that has already been done.
+         *
+         * \param loc Where the object was used.
+         * \param self The object, possibly a super object.
+         * \returns The first assertion to evaluate, in which case a FRAME_INVARIANTS frame and the
+         * assertion's call frame have been pushed, or nullptr if there is nothing to do.
+         */
+        const AST *startInvariants(const LocationRange &loc, HeapObject *self)
         {
-            HeapObject *self_marker = self;
-            while (auto *super = dynamic_cast<HeapSuperObject*>(self_marker)) {
-                self_marker = super->root;
+            // Supers share the assertions of the object they came from.
+            while (auto *super = dynamic_cast<HeapSuperObject*>(self)) {
+                self = super->root;
             }
-            if (stack.alreadyExecutingInvariants(self_marker)) return;
+            if (self->assertState != HeapObject::ASSERTS_NOT_RUN) return nullptr;
 
-            unsigned counter = 0;
             stack.newFrame(FRAME_INVARIANTS, loc);
-            std::vector<HeapThunk*> &thunks = stack.top().thunks;
-            objectInvariants(self, self, counter, thunks);
-            if (thunks.size() == 0) {
+            Frame &f = stack.top();
+            f.self = self;
+            unsigned counter = 0;
+            objectInvariants(self, self, counter, f.thunks);
+            if (f.thunks.size() == 0) {
+                self->assertState = HeapObject::ASSERTS_PASSED;
                 stack.pop();
-                return;
+                return nullptr;
             }
-            HeapThunk *thunk = thunks[0];
+            self->assertState = HeapObject::ASSERTS_RUNNING;
+            HeapThunk *thunk = f.thunks[0];
+            f.elementId = 1;
+            stack.newCall(loc, thunk, thunk->self, thunk->offset, thunk->upValues);
+            return thunk->body;
+        }
+
+        void runInvariants(const LocationRange &loc, HeapObject *self)
+        {
             unsigned initial_stack_size = stack.size();
-            stack.top().elementId = 1;
-            stack.top().self = self;
-            stack.newCall(loc, thunk,
-                          thunk->self, thunk->offset, thunk->upValues);
-            evaluate(thunk->body, initial_stack_size);
+            const AST *body = startInvariants(loc, self);
+            if (body == nullptr) return;
+            evaluate(body, initial_stack_size);
+            // Evaluating the assertions overwrote scratch, put the object back.
+            scratch.setHeap(Value::OBJECT, self);
         }
 
         /** Evaluate the given AST to a value.
@@ -942,7 +1901,7 @@ namespace {
                     unsigned offset;
                     stack.getSelfBinding(self, offset);
                     scratch = makeArray({});
-                    auto &elements = static_cast<HeapArray*>(scratch.v.h)->elements;
+                    auto &elements = static_cast<HeapArray*>(scratch.getHeap())->elements;
                     for (const AST *el : ast.elements) {
                         auto *el_th = makeHeap<HeapThunk>(idArrayElement, self, offset, el);
                         el_th->upValues =  capture(el->freeVariables);
@@ -950,6 +1909,13 @@ namespace {
                     }
                 } break;
 
+                case AST_ARRAY_COMPREHENSION: {
+                    const auto &ast = *static_cast<const ArrayComprehension*>(ast_);
+                    scratch = makeArray({});
+                    ast_ = arrayComprehensionStep(ast, 0, false, scratch);
+                    goto recurse;
+                } break;
+
                 case AST_BINARY: {
                     const auto &ast = *static_cast<const Binary*>(ast_);
                     stack.newFrame(FRAME_BINARY_LEFT, ast_);
@@ -982,12 +1948,13 @@ namespace {
                     HeapObject *self;
                     unsigned offset;
                     stack.getSelfBinding(self, offset);
-                    scratch = makeClosure(env, self, offset, ast.parameters, ast.body);
+                    scratch = makeClosure(env, self, offset, ast);
                 } break;
 
                 case AST_IMPORT: {
                     const auto &ast = *static_cast<const Import*>(ast_);
                     AST *expr = import(ast.location, ast.file);
+                    if (expr == nullptr) break;
                     ast_ = expr;
                     stack.newCall(ast.location, nullptr, nullptr, 0, BindingFrame());
                     goto recurse;
@@ -996,7 +1963,7 @@ namespace {
                 case AST_IMPORTSTR: {
                     const auto &ast = *static_cast<const Importstr*>(ast_);
                     const ImportCacheValue *value = importString(ast.location, ast.file);
-                    scratch = makeString(decode_utf8(value->content));
+                    scratch = makeString(decode_utf8(std::string(value->content, value->length)));
                 } break;
 
                 case AST_INDEX: {
@@ -1040,8 +2007,7 @@ namespace {
                 } break;
 
                 case AST_LITERAL_STRING: {
-                    const auto &ast = *static_cast<const LiteralString*>(ast_);
-                    scratch = makeString(ast.value);
+                    scratch = makeLiteralString(static_cast<const LiteralString*>(ast_));
                 } break;
 
                 case AST_LITERAL_NULL: {
@@ -1072,11 +2038,10 @@ namespace {
                 } break;
 
                 case AST_SELF: {
-                    scratch.t = Value::OBJECT;
                     HeapObject *self;
                     unsigned offset;
                     stack.getSelfBinding(self, offset);
-                    scratch.v.h = self;
+                    scratch.setHeap(Value::OBJECT, self);
                 } break;
 
                 case AST_SUPER: {
@@ -1129,12 +2094,12 @@ namespace {
                 switch (f.kind) {
                     case FRAME_APPLY_TARGET: {
                         const auto &ast = *static_cast<const Apply*>(f.ast);
-                        if (scratch.t != Value::FUNCTION) {
+                        if (scratch.type() != Value::FUNCTION) {
                             throw makeError(ast.location,
                                             "Only functions can be called, got "
                                             + type_str(scratch));
                         }
-                        auto *func = static_cast<HeapClosure*>(scratch.v.h);
+                        auto *func = static_cast<HeapClosure*>(scratch.getHeap());
                         if (ast.arguments.size() != func->params.size()) {
                             std::stringstream ss;
                             ss << "Expected " << func->params.size() <<
@@ -1145,11 +2110,16 @@ namespace {
                         // Create thunks for arguments.
                         for (unsigned i=0 ; i<ast.arguments.size() ; ++i) {
                             const auto *arg = ast.arguments[i];
-                            HeapObject *self;
-                            unsigned offset;
-                            stack.getSelfBinding(self, offset);
-                            auto *thunk = makeHeap<HeapThunk>(func->params[i], self, offset, arg);
-                            thunk->upValues = capture(arg->freeVariables);
+                            bool strict = func->strictParams == nullptr
+                                || (i < func->strictParams->size() && (*func->strictParams)[i]);
+                            HeapThunk *thunk = argumentThunk(func->params[i], strict, arg);
+                            if (thunk == nullptr) {
+                                HeapObject *self;
+                                unsigned offset;
+                                stack.getSelfBinding(self, offset);
+                                thunk = makeHeap<HeapThunk>(func->params[i], self, offset, arg);
+                                thunk->upValues = capture(arg->freeVariables);
+                            }
                             f.thunks.push_back(thunk);
                         }
                         // Popping stack frame invalidates the f reference.
@@ -1170,11 +2140,11 @@ namespace {
                             BindingFrame bindings = func->upValues;
                             for (unsigned i=0 ; i<func->params.size() ; ++i)
                                 bindings[func->params[i]] = args[i];
-                            stack.newCall(ast.location, func, func->self, func->offset, bindings);
-                            if (ast.tailstrict) {
+                            stack.newTailCall(ast.location, func, bindings);
+                            if (ast.tailstrict && args.size() > 0) {
+                                // Force the arguments before executing the body.
                                 stack.top().thunks = args;
                                 stack.top().val = scratch;
-                                stack.top().tailCall = true;
                                 goto replaceframe;
                             } else {
                                 ast_ = func->body;
@@ -1183,21 +2153,48 @@ namespace {
                         }
                     } break;
 
+                    case FRAME_ARRAY_COMP_FOR: {
+                        const auto &ast = *static_cast<const ArrayComprehension*>(f.ast);
+                        const ComprehensionSpec &spec = ast.specs[f.elementId];
+                        comprehensionArray(spec.expr->location, spec.var);
+                        const auto &elements = static_cast<HeapArray*>(scratch.getHeap())->elements;
+                        f.thunks.assign(elements.rbegin(), elements.rend());
+                        ast_ = arrayComprehensionStep(ast, 0, true, scratch);
+                        if (ast_ != nullptr) goto recurse;
+                        scratch = stack.top().val;
+                    } break;
+
+                    case FRAME_ARRAY_COMP_IF: {
+                        const auto &ast = *static_cast<const ArrayComprehension*>(f.ast);
+                        const ComprehensionSpec &spec = ast.specs[f.elementId];
+                        if (scratch.type() != Value::BOOLEAN) {
+                            throw makeError(spec.expr->location,
+                                            "Condition must be boolean, got "
+                                            + type_str(scratch) + ".");
+                        }
+                        unsigned next = f.elementId + 1;
+                        bool passed = scratch.getBoolean();
+                        stack.pop();
+                        ast_ = arrayComprehensionStep(ast, next, !passed, scratch);
+                        if (ast_ != nullptr) goto recurse;
+                        scratch = stack.top().val;
+                    } break;
+
                     case FRAME_BINARY_LEFT: {
                         const auto &ast = *static_cast<const Binary*>(f.ast);
                         const Value &lhs = scratch;
-                        if (lhs.t == Value::BOOLEAN) {
+                        if (lhs.type() == Value::BOOLEAN) {
                             // Handle short-cut semantics
                             switch (ast.op) {
                                 case BOP_AND: {
-                                    if (!lhs.v.b) {
+                                    if (!lhs.getBoolean()) {
                                         scratch = makeBoolean(false);
                                         goto popframe;
                                     }
                                 } break;
 
                                 case BOP_OR: {
-                                    if (lhs.v.b) {
+                                    if (lhs.getBoolean()) {
                                         scratch = makeBoolean(true);
                                         goto popframe;
                                     }
@@ -1216,7 +2213,7 @@ namespace {
                         const auto &ast = *static_cast<const Binary*>(f.ast);
                         const Value &lhs = stack.top().val;
                         const Value &rhs = scratch;
-                        if (lhs.t == Value::STRING || rhs.t == Value::STRING) {
+                        if (lhs.type() == Value::STRING || rhs.type() == Value::STRING) {
                             if (ast.op == BOP_PLUS) {
                                 // Handle co-ercions for string processing.
                                 stack.top().kind = FRAME_STRING_CONCAT;
@@ -1237,17 +2234,17 @@ namespace {
                             default:;
                         }
                         // Everything else requires matching types.
-                        if (lhs.t != rhs.t) {
+                        if (lhs.type() != rhs.type()) {
                             throw makeError(ast.location,
                                             "Binary operator " + bop_string(ast.op) + " requires "
                                             "matching types, got " + type_str(lhs) + " and " +
                                             type_str(rhs) + ".");
                         }
-                        switch (lhs.t) {
+                        switch (lhs.type()) {
                             case Value::ARRAY:
                             if (ast.op == BOP_PLUS) {
-                                auto *arr_l = static_cast<HeapArray*>(lhs.v.h);
-                                auto *arr_r = static_cast<HeapArray*>(rhs.v.h);
+                                auto *arr_l = static_cast<HeapArray*>(lhs.getHeap());
+                                auto *arr_r = static_cast<HeapArray*>(rhs.getHeap());
                                 std::vector<HeapThunk*> elements;
                                 for (auto *el : arr_l->elements)
                                     elements.push_back(el);
@@ -1264,11 +2261,11 @@ namespace {
                             case Value::BOOLEAN:
                             switch (ast.op) {
                                 case BOP_AND:
-                                scratch = makeBoolean(lhs.v.b && rhs.v.b);
+                                scratch = makeBoolean(lhs.getBoolean() && rhs.getBoolean());
                                 break;
 
                                 case BOP_OR:
-                                scratch = makeBoolean(lhs.v.b || rhs.v.b);
+                                scratch = makeBoolean(lhs.getBoolean() || rhs.getBoolean());
                                 break;
 
                                 default:
@@ -1281,69 +2278,69 @@ namespace {
                             case Value::DOUBLE:
                             switch (ast.op) {
                                 case BOP_PLUS:
-                                scratch = makeDoubleCheck(ast.location, lhs.v.d + rhs.v.d);
+                                scratch = makeDoubleCheck(ast.location, lhs.getDouble() + rhs.getDouble());
                                 break;
 
                                 case BOP_MINUS:
-                                scratch = makeDoubleCheck(ast.location, lhs.v.d - rhs.v.d);
+                                scratch = makeDoubleCheck(ast.location, lhs.getDouble() - rhs.getDouble());
                                 break;
 
                                 case BOP_MULT:
-                                scratch = makeDoubleCheck(ast.location, lhs.v.d * rhs.v.d);
+                                scratch = makeDoubleCheck(ast.location, lhs.getDouble() * rhs.getDouble());
                                 break;
 
                                 case BOP_DIV:
-                                if (rhs.v.d == 0)
+                                if (rhs.getDouble() == 0)
                                     throw makeError(ast.location, "Division by zero.");
-                                scratch = makeDoubleCheck(ast.location, lhs.v.d / rhs.v.d);
+                                scratch = makeDoubleCheck(ast.location, lhs.getDouble() / rhs.getDouble());
                                 break;
 
                                 // No need to check doubles made from longs
 
                                 case BOP_SHIFT_L: {
-                                    long long_l = lhs.v.d;
-                                    long long_r = rhs.v.d;
+                                    long long_l = lhs.getDouble();
+                                    long long_r = rhs.getDouble();
                                     scratch = makeDouble(long_l << long_r);
                                 } break;
 
                                 case BOP_SHIFT_R: {
-                                    long long_l = lhs.v.d;
-                                    long long_r = rhs.v.d;
+                                    long long_l = lhs.getDouble();
+                                    long long_r = rhs.getDouble();
                                     scratch = makeDouble(long_l >> long_r);
                                 } break;
 
                                 case BOP_BITWISE_AND: {
-                                    long long_l = lhs.v.d;
-                                    long long_r = rhs.v.d;
+                                    long long_l = lhs.getDouble();
+                                    long long_r = rhs.getDouble();
                                     scratch = makeDouble(long_l & long_r);
                                 } break;
 
                                 case BOP_BITWISE_XOR: {
-                                    long long_l = lhs.v.d;
-                                    long long_r = rhs.v.d;
+                                    long long_l = lhs.getDouble();
+                                    long long_r = rhs.getDouble();
                                     scratch = makeDouble(long_l ^ long_r);
                                 } break;
 
                                 case BOP_BITWISE_OR: {
-                                    long long_l = lhs.v.d;
-                                    long long_r = rhs.v.d;
+                                    long long_l = lhs.getDouble();
+                                    long long_r = rhs.getDouble();
                                     scratch = makeDouble(long_l | long_r);
                                 } break;
 
                                 case BOP_LESS_EQ:
-                                scratch = makeBoolean(lhs.v.d <= rhs.v.d);
+                                scratch = makeBoolean(lhs.getDouble() <= rhs.getDouble());
                                 break;
 
                                 case BOP_GREATER_EQ:
-                                scratch = makeBoolean(lhs.v.d >= rhs.v.d);
+                                scratch = makeBoolean(lhs.getDouble() >= rhs.getDouble());
                                 break;
 
                                 case BOP_LESS:
-                                scratch = makeBoolean(lhs.v.d < rhs.v.d);
+                                scratch = makeBoolean(lhs.getDouble() < rhs.getDouble());
                                 break;
 
                                 case BOP_GREATER:
-                                scratch = makeBoolean(lhs.v.d > rhs.v.d);
+                                scratch = makeBoolean(lhs.getDouble() > rhs.getDouble());
                                 break;
 
                                 default:
@@ -1367,17 +2364,17 @@ namespace {
                                                     "Binary operator " + bop_string(ast.op) +
                                                     " does not operate on objects.");
                                 }
-                                auto *lhs_obj = static_cast<HeapObject*>(lhs.v.h);
-                                auto *rhs_obj = static_cast<HeapObject*>(rhs.v.h);
+                                auto *lhs_obj = static_cast<HeapObject*>(lhs.getHeap());
+                                auto *rhs_obj = static_cast<HeapObject*>(rhs.getHeap());
                                 scratch = makeObject<HeapExtendedObject>(lhs_obj, rhs_obj);
                             }
                             break;
 
                             case Value::STRING: {
                                 const String &lhs_str =
-                                    static_cast<HeapString*>(lhs.v.h)->value;
+                                    static_cast<HeapString*>(lhs.getHeap())->value;
                                 const String &rhs_str =
-                                    static_cast<HeapString*>(rhs.v.h)->value;
+                                    static_cast<HeapString*>(rhs.getHeap())->value;
                                 switch (ast.op) {
                                     case BOP_PLUS:
                                     scratch = makeString(lhs_str + rhs_str);
@@ -1411,14 +2408,14 @@ namespace {
 
                     case FRAME_BUILTIN_FILTER: {
                         const auto &ast = *static_cast<const Apply*>(f.ast);
-                        auto *func = static_cast<HeapClosure*>(f.val.v.h);
-                        auto *arr = static_cast<HeapArray*>(f.val2.v.h);
-                        if (scratch.t != Value::BOOLEAN) {
+                        auto *func = static_cast<HeapClosure*>(f.val.getHeap());
+                        auto *arr = static_cast<HeapArray*>(f.val2.getHeap());
+                        if (scratch.type() != Value::BOOLEAN) {
                             throw makeError(ast.location,
                                             "filter function must return boolean, got: "
                                             + type_str(scratch));
                         }
-                        if (scratch.v.b) f.thunks.push_back(arr->elements[f.elementId]);
+                        if (scratch.getBoolean()) f.thunks.push_back(arr->elements[f.elementId]);
                         f.elementId++;
                         // Iterate through arr, calling the function on each.
                         if (f.elementId == arr->elements.size()) {
@@ -1435,7 +2432,7 @@ namespace {
 
                     case FRAME_BUILTIN_FORCE_THUNKS: {
                         const auto &ast = *static_cast<const Apply*>(f.ast);
-                        auto *func = static_cast<HeapClosure*>(f.val.v.h);
+                        auto *func = static_cast<HeapClosure*>(f.val.getHeap());
                         if (f.elementId == f.thunks.size()) {
                             // All thunks forced, now the builtin implementations.
                             const LocationRange &loc = ast.location;
@@ -1448,13 +2445,13 @@ namespace {
                                 case 0: { // makeArray
                                     validateBuiltinArgs(loc, builtin, args,
                                                         {Value::DOUBLE, Value::FUNCTION});
-                                    long sz = long(args[0].v.d);
+                                    long sz = long(args[0].getDouble());
                                     if (sz < 0) {
                                         std::stringstream ss;
                                         ss << "makeArray requires size >= 0, got " << sz;
                                         throw makeError(loc, ss.str());
                                     }
-                                    auto *func = static_cast<const HeapClosure*>(args[1].v.h);
+                                    auto *func = static_cast<const HeapClosure*>(args[1].getHeap());
                                     std::vector<HeapThunk*> elements;
                                     if (func->params.size() != 1) {
                                         std::stringstream ss;
@@ -1470,9 +2467,9 @@ namespace {
                                         f.thunks.push_back(th);
                                         th->upValues = func->upValues;
 
-                                        auto *el = makeHeap<HeapThunk>(func->params[0], nullptr,
-                                                                       0, nullptr);
-                                        el->fill(makeDouble(i));  // i guaranteed not to be inf/NaN
+                                        // i guaranteed not to be inf/NaN
+                                        auto *el = makeHeap<HeapThunk>(func->params[0],
+                                                                       makeDouble(i));
                                         th->upValues[func->params[0]] = el;
                                         elements[i] = th;
                                     }
@@ -1483,56 +2480,56 @@ namespace {
                                 validateBuiltinArgs(loc, builtin, args,
                                                     {Value::DOUBLE, Value::DOUBLE});
                                 scratch = makeDoubleCheck(loc,
-                                                             std::pow(args[0].v.d, args[1].v.d));
+                                                             std::pow(args[0].getDouble(), args[1].getDouble()));
                                 break;
 
                                 case 2:  // floor
                                 validateBuiltinArgs(loc, builtin, args, {Value::DOUBLE});
-                                scratch = makeDoubleCheck(loc, std::floor(args[0].v.d));
+                                scratch = makeDoubleCheck(loc, std::floor(args[0].getDouble()));
                                 break;
 
                                 case 3:  // ceil
                                 validateBuiltinArgs(loc, builtin, args, {Value::DOUBLE});
-                                scratch = makeDoubleCheck(loc, std::ceil(args[0].v.d));
+                                scratch = makeDoubleCheck(loc, std::ceil(args[0].getDouble()));
                                 break;
 
                                 case 4:  // sqrt
                                 validateBuiltinArgs(loc, builtin, args, {Value::DOUBLE});
-                                scratch = makeDoubleCheck(loc, std::sqrt(args[0].v.d));
+                                scratch = makeDoubleCheck(loc, std::sqrt(args[0].getDouble()));
                                 break;
 
                                 case 5:  // sin
                                 validateBuiltinArgs(loc, builtin, args, {Value::DOUBLE});
-                                scratch = makeDoubleCheck(loc, std::sin(args[0].v.d));
+                                scratch = makeDoubleCheck(loc, std::sin(args[0].getDouble()));
                                 break;
 
                                 case 6:  // cos
                                 validateBuiltinArgs(loc, builtin, args, {Value::DOUBLE});
-                                scratch = makeDoubleCheck(loc, std::cos(args[0].v.d));
+                                scratch = makeDoubleCheck(loc, std::cos(args[0].getDouble()));
                                 break;
 
                                 case 7:  // tan
                                 validateBuiltinArgs(loc, builtin, args, {Value::DOUBLE});
-                                scratch = makeDoubleCheck(loc, std::tan(args[0].v.d));
+                                scratch = makeDoubleCheck(loc, std::tan(args[0].getDouble()));
                                 break;
 
                                 case 8:  // asin
                                 validateBuiltinArgs(loc, builtin, args, {Value::DOUBLE});
-                                scratch = makeDoubleCheck(loc, std::asin(args[0].v.d));
+                                scratch = makeDoubleCheck(loc, std::asin(args[0].getDouble()));
                                 break;
 
                                 case 9:  // acos
                                 validateBuiltinArgs(loc, builtin, args, {Value::DOUBLE});
-                                scratch = makeDoubleCheck(loc, std::acos(args[0].v.d));
+                                scratch = makeDoubleCheck(loc, std::acos(args[0].getDouble()));
                                 break;
 
                                 case 10:  // atan
                                 validateBuiltinArgs(loc, builtin, args, {Value::DOUBLE});
-                                scratch = makeDoubleCheck(loc, std::atan(args[0].v.d));
+                                scratch = makeDoubleCheck(loc, std::atan(args[0].getDouble()));
                                 break;
 
                                 case 11: {  // type
-                                    switch (args[0].t) {
+                                    switch (args[0].type()) {
                                         case Value::NULL_TYPE:
                                         scratch = makeString(U"null");
                                         break;
@@ -1568,8 +2565,8 @@ namespace {
                                 case 12: {  // filter
                                     validateBuiltinArgs(loc, builtin, args,
                                                         {Value::FUNCTION, Value::ARRAY});
-                                    auto *func = static_cast<HeapClosure*>(args[0].v.h);
-                                    auto *arr = static_cast<HeapArray*>(args[1].v.h);
+                                    auto *func = static_cast<HeapClosure*>(args[0].getHeap());
+                                    auto *arr = static_cast<HeapArray*>(args[1].getHeap());
                                     if (func->params.size() != 1) {
                                         throw makeError(loc, "filter function takes 1 parameter.");
                                     }
@@ -1596,9 +2593,9 @@ namespace {
                                     validateBuiltinArgs(loc, builtin, args,
                                                         {Value::OBJECT, Value::STRING,
                                                          Value::BOOLEAN});
-                                    const auto *obj = static_cast<const HeapObject*>(args[0].v.h);
-                                    const auto *str = static_cast<const HeapString*>(args[1].v.h);
-                                    bool include_hidden = args[2].v.b;
+                                    const auto *obj = static_cast<const HeapObject*>(args[0].getHeap());
+                                    const auto *str = static_cast<const HeapString*>(args[1].getHeap());
+                                    bool include_hidden = args[2].getBoolean();
                                     bool found = false;
                                     for (const auto &field : objectFields(obj, !include_hidden)) {
                                         if (field->name == str->value) {
@@ -1613,8 +2610,8 @@ namespace {
                                     if (args.size() != 1) {
                                         throw makeError(loc, "length takes 1 parameter.");
                                     }
-                                    HeapEntity *e = args[0].v.h;
-                                    switch (args[0].t) {
+                                    HeapEntity *e = args[0].getHeap();
+                                    switch (args[0].type()) {
                                         case Value::OBJECT: {
                                             auto fields =
                                                 objectFields(static_cast<HeapObject*>(e), true);
@@ -1646,40 +2643,41 @@ namespace {
                                 case 15: {  // objectFieldsEx
                                     validateBuiltinArgs(loc, builtin, args,
                                                         {Value::OBJECT, Value::BOOLEAN});
-                                    const auto *obj = static_cast<HeapObject*>(args[0].v.h);
-                                    bool include_hidden = args[1].v.b;
+                                    const auto *obj = static_cast<HeapObject*>(args[0].getHeap());
+                                    bool include_hidden = args[1].getBoolean();
                                     // Stash in a set first to sort them.
                                     std::set<String> fields;
                                     for (const auto &field : objectFields(obj, !include_hidden)) {
                                         fields.insert(field->name);
                                     }
                                     scratch = makeArray({});
-                                    auto &elements = static_cast<HeapArray*>(scratch.v.h)->elements;
+                                    auto &elements = static_cast<HeapArray*>(scratch.getHeap())->elements;
                                     for (const auto &field : fields) {
-                                        auto *th = makeHeap<HeapThunk>(idArrayElement, nullptr,
-                                                                       0, nullptr);
+                                        // The new thunk keeps the new string alive if the
+                                        // thunk's allocation triggers a GC cycle.
+                                        auto *th = makeHeap<HeapThunk>(idArrayElement,
+                                                                       makeString(field));
                                         elements.push_back(th);
-                                        th->fill(makeString(field));
                                     }
                                 } break;
 
                                 case 16: { // codepoint
                                     validateBuiltinArgs(loc, builtin, args, {Value::STRING});
                                     const String &str =
-                                        static_cast<HeapString*>(args[0].v.h)->value;
+                                        static_cast<HeapString*>(args[0].getHeap())->value;
                                     if (str.length() != 1) {
                                         std::stringstream ss;
                                         ss << "codepoint takes a string of length 1, got length "
                                            << str.length();
                                         throw makeError(loc, ss.str());
                                     }
-                                    char32_t c = static_cast<HeapString*>(args[0].v.h)->value[0];
+                                    char32_t c = static_cast<HeapString*>(args[0].getHeap())->value[0];
                                     scratch = makeDouble((unsigned long)(c));
                                 } break;
 
                                 case 17: { // char
                                     validateBuiltinArgs(loc, builtin, args, {Value::DOUBLE});
-                                    long l = long(args[0].v.d);
+                                    long l = long(args[0].getDouble());
                                     if (l < 0) {
                                         std::stringstream ss;
                                         ss << "Codepoints must be >= 0, got " << l;
@@ -1690,39 +2688,38 @@ namespace {
                                         ss << "Invalid unicode codepoint, got " << l;
                                         throw makeError(ast.location, ss.str());
                                     }
-                                    char32_t c = l;
-                                    scratch = makeString(String(&c, 1));
+                                    scratch = makeCharString(char32_t(l));
                                 } break;
 
                                 case 18: {  // log
                                     validateBuiltinArgs(loc, builtin, args, {Value::DOUBLE});
-                                    scratch = makeDoubleCheck(loc, std::log(args[0].v.d));
+                                    scratch = makeDoubleCheck(loc, std::log(args[0].getDouble()));
                                 } break;
 
                                 case 19: {  // exp
                                     validateBuiltinArgs(loc, builtin, args, {Value::DOUBLE});
-                                    scratch = makeDoubleCheck(loc, std::exp(args[0].v.d));
+                                    scratch = makeDoubleCheck(loc, std::exp(args[0].getDouble()));
                                 } break;
 
                                 case 20: {  // mantissa
                                     validateBuiltinArgs(loc, builtin, args, {Value::DOUBLE});
                                     int exp;
-                                    double m = std::frexp(args[0].v.d, &exp);
+                                    double m = std::frexp(args[0].getDouble(), &exp);
                                     scratch = makeDoubleCheck(loc, m);
                                 } break;
 
                                 case 21: {  // exponent
                                     validateBuiltinArgs(loc, builtin, args, {Value::DOUBLE});
                                     int exp;
-                                    std::frexp(args[0].v.d, &exp);
+                                    std::frexp(args[0].getDouble(), &exp);
                                     scratch = makeDoubleCheck(loc, exp);
                                 } break;
 
                                 case 22: {  // modulo
                                     validateBuiltinArgs(loc, builtin, args,
                                                         {Value::DOUBLE, Value::DOUBLE});
-                                    double a = args[0].v.d;
-                                    double b = args[1].v.d;
+                                    double a = args[0].getDouble();
+                                    double b = args[1].getDouble();
                                     if (b == 0)
                                         throw makeError(ast.location, "Division by zero.");
                                     scratch = makeDoubleCheck(loc, std::fmod(a, b));
@@ -1731,7 +2728,7 @@ namespace {
                                 case 23: {  // extVar
                                     validateBuiltinArgs(loc, builtin, args, {Value::STRING});
                                     const String &var =
-                                        static_cast<HeapString*>(args[0].v.h)->value;
+                                        static_cast<HeapString*>(args[0].getHeap())->value;
                                     std::string var8 = encode_utf8(var);
                                     auto it = externalVars.find(var8);
                                     if (it == externalVars.end()) {
@@ -1740,14 +2737,38 @@ namespace {
                                     }
                                     const VmExt &ext = it->second;
                                     if (ext.isCode) {
-                                        std::string filename = "<extvar:" + var8 + ">";
-                                        AST *expr =
-                                            jsonnet_parse(alloc, filename, ext.data.c_str());
-                                        jsonnet_desugar(alloc, expr);
-                                        jsonnet_static_analysis(expr);
-                                        ast_ = expr;
-                                        stack.pop();
-                                        goto recurse;
+                                        HeapThunk *&th = externalCode[var8];
+                                        if (th == nullptr) {
+                                            // Large values are usually JSON, which does not
+                                            // need the parser.
+                                            Value v;
+                                            JsonError err;
+                                            if (jsonDocument(ext.data.c_str(), ext.data.length(),
+                                                             true, v, err)) {
+                                                th = heap.makeImmortalEntity<HeapThunk>(
+                                                    alloc->makeIdentifier(var), v);
+                                            } else {
+                                                std::string filename = "<extvar:" + var8 + ">";
+                                                AST *expr = jsonnet_parse(alloc, filename,
+                                                                          ext.data.c_str());
+                                                jsonnet_desugar(alloc, expr);
+                                                std::vector<const AST*> imports;
+                                                jsonnet_static_analysis(expr, &imports);
+                                                jsonnet_constant_folding(alloc, expr);
+                                                jsonnet_strictness_analysis(expr);
+                                                queueImports(imports);
+                                                th = makeHeap<HeapThunk>(
+                                                    alloc->makeIdentifier(var), nullptr, 0, expr);
+                                            }
+                                        }
+                                        if (th->filled) {
+                                            scratch = th->content;
+                                        } else {
+                                            stack.pop();
+                                            stack.newCall(loc, th, nullptr, 0, BindingFrame());
+                                            ast_ = th->body;
+                                            goto recurse;
+                                        }
                                     } else {
                                         scratch = makeString(decode_utf8(ext.data));
                                     }
@@ -1757,23 +2778,23 @@ namespace {
                                     if (args.size() != 2) {
                                         throw makeError(loc, "primitiveEquals takes 2 parameters.");
                                     }
-                                    if (args[0].t != args[1].t) {
+                                    if (args[0].type() != args[1].type()) {
                                         scratch = makeBoolean(false);
                                         break;
                                     }
                                     bool r;
-                                    switch (args[0].t) {
+                                    switch (args[0].type()) {
                                         case Value::BOOLEAN:
-                                        r = args[0].v.b == args[1].v.b;
+                                        r = args[0].getBoolean() == args[1].getBoolean();
                                         break;
 
                                         case Value::DOUBLE:
-                                        r = args[0].v.d == args[1].v.d;
+                                        r = args[0].getDouble() == args[1].getDouble();
                                         break;
 
                                         case Value::STRING:
-                                        r = static_cast<HeapString*>(args[0].v.h)->value
-                                          == static_cast<HeapString*>(args[1].v.h)->value;
+                                        r = static_cast<HeapString*>(args[0].getHeap())->value
+                                          == static_cast<HeapString*>(args[1].getHeap())->value;
                                         break;
 
                                         case Value::NULL_TYPE:
@@ -1788,6 +2809,43 @@ namespace {
                                     scratch = makeBoolean(r);
                                 } break;
 
+                                case 25: {  // parseJson
+                                    validateBuiltinArgs(loc, builtin, args, {Value::STRING});
+                                    std::string text = encode_utf8(
+                                        static_cast<HeapString*>(args[0].getHeap())->value);
+                                    Value v;
+                                    JsonError err;
+                                    if (!jsonDocument(text.c_str(), text.length(), false, v, err)) {
+                                        unsigned long line = 1, column = 1;
+                                        for (unsigned long i = 0 ; i < err.offset ; ++i) {
+                                            if (text[i] == '\n') {
+                                                line++;
+                                                column = 1;
+                                            } else {
+                                                column++;
+                                            }
+                                        }
+                                        std::stringstream ss;
+                                        ss << "Invalid JSON at line " << line << ", column "
+                                           << column << ": " << err.msg;
+                                        throw makeError(loc, ss.str());
+                                    }
+                                    scratch = v;
+                                } break;
+
+                                case 26: {  // escapeStringJson
+                                    std::string json;
+                                    if (args[0].type() == Value::STRING) {
+                                        const String &str =
+                                            static_cast<HeapString*>(args[0].getHeap())->value;
+                                        jsonnet_json_escape(str, true, json);
+                                    } else {
+                                        scratch = args[0];
+                                        jsonnet_json_escape(toString(loc), true, json);
+                                    }
+                                    scratch = makeString(String(json.begin(), json.end()));
+                                } break;
+
                                 default:
                                 std::cerr << "INTERNAL ERROR: Unrecognized builtin: " << builtin
                                           << std::endl;
@@ -1801,6 +2859,8 @@ namespace {
                                 ast_ = th->body;
                                 goto recurse;
                             }
+                            // Already filled, move on to the next one.
+                            goto replaceframe;
                         }
                     } break;
 
@@ -1818,6 +2878,8 @@ namespace {
                                     ast_ = th->body;
                                     goto recurse;
                                 }
+                                // Already filled, move on to the next one.
+                                goto replaceframe;
                             } else if (f.thunks.size() == 0) {
                                 // Body has now been executed
                             } else {
@@ -1833,20 +2895,20 @@ namespace {
 
                     case FRAME_ERROR: {
                         const auto &ast = *static_cast<const Error*>(f.ast);
-                        if (scratch.t != Value::STRING)
+                        if (scratch.type() != Value::STRING)
                             throw makeError(ast.location, "Error message must be string, got " +
                                                           type_str(scratch) + ".");
-                        std::string msg = encode_utf8(static_cast<HeapString*>(scratch.v.h)->value);
+                        std::string msg = encode_utf8(static_cast<HeapString*>(scratch.getHeap())->value);
                         throw makeError(ast.location, msg);
                     } break;
 
                     case FRAME_IF: {
                         const auto &ast = *static_cast<const Conditional*>(f.ast);
-                        if (scratch.t != Value::BOOLEAN) {
+                        if (scratch.type() != Value::BOOLEAN) {
                             throw makeError(ast.location, "Condition must be boolean, got " +
                                                           type_str(scratch) + ".");
                         }
-                        ast_ = scratch.v.b ? ast.branchTrue : ast.branchFalse;
+                        ast_ = scratch.getBoolean() ? ast.branchTrue : ast.branchFalse;
                         stack.pop();
                         goto recurse;
                     } break;
@@ -1854,13 +2916,13 @@ namespace {
                     case FRAME_INDEX_INDEX: {
                         const auto &ast = *static_cast<const Index*>(f.ast);
                         const Value &target = f.val;
-                        if (target.t == Value::ARRAY) {
-                            const auto *array = static_cast<HeapArray*>(target.v.h);
-                            if (scratch.t != Value::DOUBLE) {
+                        if (target.type() == Value::ARRAY) {
+                            const auto *array = static_cast<HeapArray*>(target.getHeap());
+                            if (scratch.type() != Value::DOUBLE) {
                                 throw makeError(ast.location, "Array index must be number, got "
                                                               + type_str(scratch) + ".");
                             }
-                            long i = long(scratch.v.d);
+                            long i = long(scratch.getDouble());
                             long sz = array->elements.size();
                             if (i < 0 || i >= sz) {
                                 std::stringstream ss;
@@ -1878,38 +2940,37 @@ namespace {
                                 ast_ = thunk->body;
                                 goto recurse;
                             }
-                        } else if (target.t == Value::OBJECT) {
-                            auto *obj = static_cast<HeapObject*>(target.v.h);
+                        } else if (target.type() == Value::OBJECT) {
+                            auto *obj = static_cast<HeapObject*>(target.getHeap());
                             assert(obj != nullptr);
-                            if (scratch.t != Value::STRING) {
+                            if (scratch.type() != Value::STRING) {
                                 throw makeError(ast.location,
                                                 "Object index must be string, got "
                                                 + type_str(scratch) + ".");
                             }
                             const String &index_name =
-                                static_cast<HeapString*>(scratch.v.h)->value;
+                                static_cast<HeapString*>(scratch.getHeap())->value;
                             auto *fid = alloc->makeIdentifier(index_name);
                             stack.pop();
                             ast_ = objectIndex(ast.location, obj, fid);
                             goto recurse;
-                        } else if (target.t == Value::STRING) {
-                            auto *obj = static_cast<HeapString*>(target.v.h);
+                        } else if (target.type() == Value::STRING) {
+                            auto *obj = static_cast<HeapString*>(target.getHeap());
                             assert(obj != nullptr);
-                            if (scratch.t != Value::DOUBLE) {
+                            if (scratch.type() != Value::DOUBLE) {
                                 throw makeError(ast.location,
                                                 "String index must be a number, got "
                                                 + type_str(scratch) + ".");
                             }
                             long sz = obj->value.length();
-                            long i = (long)scratch.v.d;
+                            long i = (long)scratch.getDouble();
                             if (i < 0 || i >= sz) {
                                 std::stringstream ss;
                                 ss << "String bounds error: " << i
                                    << " not within [0, " << sz << ")";
                                 throw makeError(ast.location, ss.str());
                             }
-                            char32_t ch[] = {obj->value[i], U'\0'};
-                            scratch = makeString(ch);
+                            scratch = makeCharString(obj->value[i]);
                         } else {
                             std::cerr << "INTERNAL ERROR: Not object / array / string."
                                       << std::endl;
@@ -1919,38 +2980,21 @@ namespace {
 
                     case FRAME_INDEX_TARGET: {
                         const auto &ast = *static_cast<const Index*>(f.ast);
-                        if (scratch.t != Value::ARRAY
-                            && scratch.t != Value::OBJECT
-                            && scratch.t != Value::STRING) {
+                        if (scratch.type() != Value::ARRAY
+                            && scratch.type() != Value::OBJECT
+                            && scratch.type() != Value::STRING) {
                             throw makeError(ast.location,
                                             "Can only index objects, strings, and arrays, got "
                                             + type_str(scratch) + ".");
                         }
                         f.val = scratch;
                         f.kind = FRAME_INDEX_INDEX;
-                        if (scratch.t == Value::OBJECT) {
-                            auto *self = static_cast<HeapObject*>(scratch.v.h);
-                            auto *self_marker = self;
-                            // Strip supers off of self, they are not relevant for invariant
-                            // checking and as they are not interned, they cause 
-                            // stack.alreadyExecutingInvariants to always fail.
-                            while (auto *super = dynamic_cast<HeapSuperObject*>(self_marker)) {
-                                self_marker = super->root;
-                            }
-                            if (!stack.alreadyExecutingInvariants(self_marker)) {
-                                stack.newFrame(FRAME_INVARIANTS, ast.location);
-                                Frame &f2 = stack.top();
-                                f2.self = self_marker;
-                                unsigned counter = 0;
-                                objectInvariants(self, self, counter, f2.thunks);
-                                if (f2.thunks.size() > 0) {
-                                    auto *thunk = f2.thunks[0];
-                                    f2.elementId = 1;
-                                    stack.newCall(ast.location, thunk,
-                                                  thunk->self, thunk->offset, thunk->upValues);
-                                    ast_ = thunk->body;
-                                    goto recurse;
-                                }
+                        if (scratch.type() == Value::OBJECT) {
+                            auto *self = static_cast<HeapObject*>(scratch.getHeap());
+                            const AST *body = startInvariants(ast.location, self);
+                            if (body != nullptr) {
+                                ast_ = body;
+                                goto recurse;
                             }
                         }
                         ast_ = ast.index;
@@ -1959,6 +3003,7 @@ namespace {
 
                     case FRAME_INVARIANTS: {
                         if (f.elementId >= f.thunks.size()) {
+                            f.self->assertState = HeapObject::ASSERTS_PASSED;
                             if (stack.size() == initial_stack_size + 1) {
                                 // Just pop, evaluate was invoked by runInvariants.
                                 break;
@@ -1982,11 +3027,11 @@ namespace {
 
                     case FRAME_OBJECT: {
                         const auto &ast = *static_cast<const Object*>(f.ast);
-                        if (scratch.t != Value::NULL_TYPE) {
-                            if (scratch.t != Value::STRING) {
+                        if (scratch.type() != Value::NULL_TYPE) {
+                            if (scratch.type() != Value::STRING) {
                                 throw makeError(ast.location, "Field name was not a string.");
                             }
-                            const auto &fname = static_cast<const HeapString*>(scratch.v.h)->value;
+                            const auto &fname = static_cast<const HeapString*>(scratch.getHeap())->value;
                             const Identifier *fid = alloc->makeIdentifier(fname);
                             if (f.objectFields.find(fid) != f.objectFields.end()) {
                                 std::string msg = "Duplicate field name: \""
@@ -2009,20 +3054,21 @@ namespace {
 
                     case FRAME_OBJECT_COMP_ARRAY: {
                         const auto &ast = *static_cast<const ObjectComprehensionSimple*>(f.ast);
-                        const Value &arr_v = scratch;
-                        if (scratch.t != Value::ARRAY) {
-                            throw makeError(ast.location,
-                                            "Object comprehension needs array, got "
-                                            + type_str(arr_v));
-                        }
-                        const auto *arr = static_cast<const HeapArray*>(arr_v.v.h);
+                        comprehensionArray(ast.array->location, ast.id);
+                        const auto *arr = static_cast<const HeapArray*>(scratch.getHeap());
                         if (arr->elements.size() == 0) {
                             // Degenerate case.  Just create the object now.
                             scratch = makeObject<HeapComprehensionObject>(BindingFrame{}, ast.value,
-                                                                          ast.id, BindingFrame{});
+                                                                          ast.id);
                         } else {
+                            // Build the object's table in place, it is sized for the common
+                            // case of every element producing a field.
                             f.kind = FRAME_OBJECT_COMP_ELEMENT;
                             f.val = scratch;
+                            f.val2 = makeObject<HeapComprehensionObject>(
+                                capture(ast.freeVariables), ast.value, ast.id);
+                            auto *obj = static_cast<HeapComprehensionObject*>(f.val2.getHeap());
+                            obj->compValues.reserve(arr->elements.size());
                             f.bindings[ast.id] = arr->elements[0];
                             f.elementId = 0;
                             ast_ = ast.field;
@@ -2032,25 +3078,23 @@ namespace {
 
                     case FRAME_OBJECT_COMP_ELEMENT: {
                         const auto &ast = *static_cast<const ObjectComprehensionSimple*>(f.ast);
-                        const auto *arr = static_cast<const HeapArray*>(f.val.v.h);
-                        if (scratch.t != Value::STRING) {
+                        const auto *arr = static_cast<const HeapArray*>(f.val.getHeap());
+                        auto *obj = static_cast<HeapComprehensionObject*>(f.val2.getHeap());
+                        if (scratch.type() != Value::STRING) {
                             std::stringstream ss;
                             ss << "field must be string, got: " << type_str(scratch);
                             throw makeError(ast.location, ss.str());
                         }
-                        const auto &fname = static_cast<const HeapString*>(scratch.v.h)->value;
+                        const auto &fname = static_cast<const HeapString*>(scratch.getHeap())->value;
                         const Identifier *fid = alloc->makeIdentifier(fname);
-                        if (f.elements.find(fid) != f.elements.end()) {
+                        if (!obj->compValues.emplace(fid, arr->elements[f.elementId]).second) {
                             throw makeError(ast.location,
                                             "Duplicate field name: \"" + encode_utf8(fname) + "\"");
                         }
-                        f.elements[fid] = arr->elements[f.elementId];
                         f.elementId++;
 
                         if (f.elementId == arr->elements.size()) {
-                            auto env = capture(ast.freeVariables);
-                            scratch = makeObject<HeapComprehensionObject>(env, ast.value,
-                                                                          ast.id, f.elements);
+                            scratch = f.val2;
                         } else {
                             f.bindings[ast.id] = arr->elements[f.elementId];
                             ast_ = ast.field;
@@ -2063,14 +3107,14 @@ namespace {
                         const Value &lhs = stack.top().val;
                         const Value &rhs = stack.top().val2;
                         String output;
-                        if (lhs.t == Value::STRING) {
-                            output.append(static_cast<const HeapString*>(lhs.v.h)->value);
+                        if (lhs.type() == Value::STRING) {
+                            output.append(static_cast<const HeapString*>(lhs.getHeap())->value);
                         } else {
                             scratch = lhs;
                             output.append(toString(ast.left->location));
                         }
-                        if (rhs.t == Value::STRING) {
-                            output.append(static_cast<const HeapString*>(rhs.v.h)->value);
+                        if (rhs.type() == Value::STRING) {
+                            output.append(static_cast<const HeapString*>(rhs.getHeap())->value);
                         } else {
                             scratch = rhs;
                             output.append(toString(ast.right->location));
@@ -2080,11 +3124,11 @@ namespace {
 
                     case FRAME_UNARY: {
                         const auto &ast = *static_cast<const Unary*>(f.ast);
-                        switch (scratch.t) {
+                        switch (scratch.type()) {
 
                             case Value::BOOLEAN:
                             if (ast.op == UOP_NOT) {
-                                scratch = makeBoolean(!scratch.v.b);
+                                scratch = makeBoolean(!scratch.getBoolean());
                             } else {
                                 throw makeError(ast.location,
                                                 "Unary operator " + uop_string(ast.op)
@@ -2098,11 +3142,11 @@ namespace {
                                 break;
 
                                 case UOP_MINUS:
-                                scratch = makeDouble(-scratch.v.d);
+                                scratch = makeDouble(-scratch.getDouble());
                                 break;
 
                                 case UOP_BITWISE_NOT:
-                                scratch = makeDouble(~(long)(scratch.v.d));
+                                scratch = makeDouble(~(long)(scratch.getDouble()));
                                 break;
 
                                 default:
@@ -2132,133 +3176,183 @@ namespace {
             }
         }
 
+        /** An array or object that is part way through being manifested. */
+        struct ManifestLevel {
+            /** Where the array or object came from, used when evaluating its elements. */
+            LocationRange location;
+
+            /** For objects, the visible fields in the order they are output. */
+            std::vector<std::pair<String, const Identifier*>> fields;
+
+            /** Number of elements or fields. */
+            unsigned size;
+
+            /** The next element or field to output. */
+            unsigned next;
+
+            ManifestLevel(const LocationRange &location, unsigned size)
+              : location(location), size(size), next(0)
+            { }
+        };
+
         /** Manifest the scratch value by evaluating any remaining fields, and then convert to JSON.
          *
          * This can trigger a garbage collection cycle.  Be sure to stash any objects that aren't
          * reachable via the stack or heap.
          *
+         * Nested arrays and objects are handled with an explicit stack of ManifestLevel rather than
+         * by recursion, so the depth of the value does not use any native stack.  The element being
+         * manifested still has a FRAME_CALL on the interpreter stack (which keeps its container
+         * alive in val), so depth counts towards the stack limit and shows up in stack traces.
+         *
+         * \param loc Where the value came from, for error messages.
          * \param multiline If true, will print objects and arrays in an indented fashion.
+         * \param out The JSON is appended to this, in UTF-8.
          */
-        String manifestJson(const LocationRange &loc, bool multiline, const String &indent)
+        void manifestJson(const LocationRange &loc, bool multiline, std::string &out)
         {
-            // Printing fields means evaluating and binding them, which can trigger
-            // garbage collection.
+            std::vector<ManifestLevel> levels;
+            LocationRange vloc = loc;
+            while (true) {
+                // Output the value in scratch, or the start of it if it is a non-empty array or
+                // object.
+                bool opened = false;
+                switch (scratch.type()) {
+                    case Value::ARRAY: {
+                        HeapArray *arr = static_cast<HeapArray*>(scratch.getHeap());
+                        if (arr->elements.size() == 0) {
+                            out.append("[ ]");
+                        } else {
+                            out.append("[");
+                            levels.emplace_back(vloc, arr->elements.size());
+                            opened = true;
+                        }
+                    } break;
 
-            StringStream ss;
-            switch (scratch.t) {
-                case Value::ARRAY: {
-                    HeapArray *arr = static_cast<HeapArray*>(scratch.v.h);
-                    if (arr->elements.size() == 0) {
-                        ss << U"[ ]";
-                    } else {
-                        const char32_t *prefix = multiline ? U"[\n" : U"[";
-                        String indent2 = multiline ? indent + U"   " : indent;
-                        for (auto *thunk : arr->elements) {
-                            LocationRange tloc = thunk->body == nullptr
-                                               ? loc
-                                               : thunk->body->location;
-                            if (thunk->filled) {
-                                stack.newCall(loc, thunk, nullptr, 0, BindingFrame{});
-                                // Keep arr alive when scratch is overwritten
-                                stack.top().val = scratch;
-                                scratch = thunk->content;
-                            } else {
-                                stack.newCall(loc, thunk,
-                                              thunk->self, thunk->offset, thunk->upValues);
-                                // Keep arr alive when scratch is overwritten
-                                stack.top().val = scratch;
-                                evaluate(thunk->body, stack.size());
-                            }
-                            auto element = manifestJson(tloc, multiline, indent2);
-                            // Restore scratch
-                            scratch = stack.top().val;
-                            stack.pop();
-                            ss << prefix << indent2 << element;
-                            prefix = multiline ? U",\n" : U", ";
+                    case Value::BOOLEAN:
+                    out.append(scratch.getBoolean() ? "true" : "false");
+                    break;
+
+                    case Value::DOUBLE: {
+                        char buf[JSONNET_NUMBER_BUFFER];
+                        unsigned len = jsonnet_format_number(scratch.getDouble(), compatNumbers,
+                                                             buf);
+                        out.append(buf, len);
+                    } break;
+
+                    case Value::FUNCTION:
+                    throw makeError(vloc, "Couldn't manifest function in JSON output.");
+
+                    case Value::NULL_TYPE:
+                    out.append("null");
+                    break;
+
+                    case Value::OBJECT: {
+                        auto *obj = static_cast<HeapObject*>(scratch.getHeap());
+                        runInvariants(vloc, obj);
+                        // Using std::map has the useful side-effect of ordering the fields
+                        // alphabetically.
+                        std::map<String, const Identifier*> fields;
+                        for (const auto &f : objectFields(obj, true)) {
+                            fields[f->name] = f;
                         }
-                        ss << (multiline ? U"\n" : U"") << indent << U"]";
-                    }
+                        if (fields.size() == 0) {
+                            out.append("{ }");
+                        } else {
+                            out.append("{");
+                            levels.emplace_back(vloc, fields.size());
+                            levels.back().fields.assign(fields.begin(), fields.end());
+                            opened = true;
+                        }
+                    } break;
+
+                    case Value::STRING: {
+                        const String &str = static_cast<HeapString*>(scratch.getHeap())->value;
+                        jsonnet_json_escape(str, false, out);
+                    } break;
                 }
-                break;
-
-                case Value::BOOLEAN:
-                ss << (scratch.v.b ? U"true" : U"false");
-                break;
-
-                case Value::DOUBLE:
-                ss << decode_utf8(jsonnet_unparse_number(scratch.v.d));
-                break;
-
-                case Value::FUNCTION:
-                throw makeError(loc, "Couldn't manifest function in JSON output.");
-
-                case Value::NULL_TYPE:
-                ss << U"null";
-                break;
-
-                case Value::OBJECT: {
-                    auto *obj = static_cast<HeapObject*>(scratch.v.h);
-                    runInvariants(loc, obj);
-                    // Using std::map has the useful side-effect of ordering the fields
-                    // alphabetically.
-                    std::map<String, const Identifier*> fields;
-                    for (const auto &f : objectFields(obj, true)) {
-                        fields[f->name] = f;
+
+                // Unless a new array or object was started, the value is complete.  Find the next
+                // element to output, closing every array and object that finishes on the way.
+                while (!opened) {
+                    if (levels.size() == 0) return;
+                    // The value was an element of the innermost level.  Restore the container
+                    // into scratch so it is not GC'd.
+                    scratch = stack.top().val;
+                    stack.pop();
+                    ManifestLevel &level = levels.back();
+                    if (level.next < level.size) break;
+                    if (multiline) {
+                        out.append("\n");
+                        out.append(3 * (levels.size() - 1), ' ');
                     }
-                    if (fields.size() == 0) {
-                        ss << U"{ }";
+                    out.append(scratch.type() == Value::ARRAY ? "]" : "}");
+                    levels.pop_back();
+                }
+                ManifestLevel &level = levels.back();
+                if (level.next > 0) out.append(multiline ? ",\n" : ", ");
+                else if (multiline) out.append("\n");
+                if (multiline) out.append(3 * levels.size(), ' ');
+                if (scratch.type() == Value::ARRAY) {
+                    auto *thunk = static_cast<HeapArray*>(scratch.getHeap())->elements[level.next];
+                    vloc = thunk->body == nullptr ? level.location : thunk->body->location;
+                    if (thunk->filled) {
+                        stack.newCall(level.location, thunk, nullptr, 0, BindingFrame{});
+                        // Keep arr alive when scratch is overwritten
+                        stack.top().val = scratch;
+                        scratch = thunk->content;
                     } else {
-                        String indent2 = multiline ? indent + U"   " : indent;
-                        const char32_t *prefix = multiline ? U"{\n" : U"{";
-                        for (const auto &f : fields) {
-                            // pushes FRAME_CALL
-                            const AST *body = objectIndex(loc, obj, f.second);
-                            stack.top().val = scratch;
-                            evaluate(body, stack.size());
-                            auto vstr = manifestJson(body->location, multiline, indent2);
-                            // Reset scratch so that the object we're manifesting doesn't
-                            // get GC'd.
-                            scratch = stack.top().val;
-                            stack.pop();
-                            ss << prefix << indent2 << U"\"" << f.first << U"\": " << vstr;
-                            prefix = multiline ? U",\n" : U", ";
-                        }
-                        ss << (multiline ? U"\n" : U"") << indent << U"}";
+                        stack.newCall(level.location, thunk,
+                                      thunk->self, thunk->offset, thunk->upValues);
+                        // Keep arr alive when scratch is overwritten
+                        stack.top().val = scratch;
+                        evaluate(thunk->body, stack.size());
                     }
+                } else {
+                    auto *obj = static_cast<HeapObject*>(scratch.getHeap());
+                    const auto &field = level.fields[level.next];
+                    jsonnet_json_escape(field.first, false, out);
+                    out.append(": ");
+                    // pushes FRAME_CALL
+                    const AST *body = objectIndex(level.location, obj, field.second);
+                    // Keep obj alive when scratch is overwritten
+                    stack.top().val = scratch;
+                    evaluate(body, stack.size());
+                    vloc = body->location;
                 }
-                break;
-
-                case Value::STRING: {
-                    const String &str = static_cast<HeapString*>(scratch.v.h)->value;
-                    ss << jsonnet_unparse_escape(str);
-                }
-                break;
+                level.next++;
             }
-            return ss.str();
+        }
+
+        std::string manifestJson(const LocationRange &loc, bool multiline)
+        {
+            std::string r;
+            manifestJson(loc, multiline, r);
+            return r;
         }
 
         String manifestString(const LocationRange &loc)
         {
-            if (scratch.t != Value::STRING) {
+            if (scratch.type() != Value::STRING) {
                 std::stringstream ss;
-                ss << "Expected string result, got: " << type_str(scratch.t);
+                ss << "Expected string result, got: " << type_str(scratch.type());
                 throw makeError(loc, ss.str());
             }
-            return static_cast<HeapString*>(scratch.v.h)->value;
+            return static_cast<HeapString*>(scratch.getHeap())->value;
         }
 
         StrMap manifestMulti(bool string)
         {
             StrMap r;
-            LocationRange loc("During manifestation");
-            if (scratch.t != Value::OBJECT) {
+            LocationRange loc = during_manifestation();
+            if (scratch.type() != Value::OBJECT) {
                 std::stringstream ss;
-                ss << "Multi mode: Top-level object was a " << type_str(scratch.t) << ", "
+                ss << "Multi mode: Top-level object was a " << type_str(scratch.type()) << ", "
                    << "should be an object whose keys are filenames and values hold "
                    << "the JSON for that file.";
                 throw makeError(loc, ss.str());
             }
-            auto *obj = static_cast<HeapObject*>(scratch.v.h);
+            auto *obj = static_cast<HeapObject*>(scratch.getHeap());
             runInvariants(loc, obj);
             std::map<String, const Identifier*> fields;
             for (const auto &f : objectFields(obj, true)) {
@@ -2269,13 +3363,13 @@ namespace {
                 const AST *body = objectIndex(loc, obj, f.second);
                 stack.top().val = scratch;
                 evaluate(body, stack.size());
-                auto vstr = string ? manifestString(body->location)
-                                   : manifestJson(body->location, true, U"");
+                auto vstr = string ? encode_utf8(manifestString(body->location))
+                                   : manifestJson(body->location, true);
                 // Reset scratch so that the object we're manifesting doesn't
                 // get GC'd.
                 scratch = stack.top().val;
                 stack.pop();
-                r[encode_utf8(f.first)] = encode_utf8(vstr);
+                r[encode_utf8(f.first)] = vstr;
             }
             return r;
         }
@@ -2285,29 +3379,41 @@ namespace {
 }
 
 std::string jsonnet_vm_execute(Allocator *alloc, const AST *ast,
+                               const std::vector<const AST*> &imports,
                                const ExtMap &ext_vars,
                                unsigned max_stack, double gc_min_objects,
                                double gc_growth_trigger,
                                JsonnetImportCallback *import_callback, void *ctx,
-                               bool string_output)
+                               JsonnetImportBatchCallback *import_batch_callback,
+                               void *batch_ctx, unsigned import_threads,
+                               const std::string &cache_dir, bool string_output,
+                               bool compat_numbers)
 {
     Interpreter vm(alloc, ext_vars, max_stack, gc_min_objects, gc_growth_trigger,
-                   import_callback, ctx);
+                   import_callback, ctx, import_batch_callback, batch_ctx, import_threads,
+                   cache_dir, compat_numbers);
+    vm.prefetchImports(imports);
     vm.evaluate(ast, 0);
     if (string_output) {
-        return encode_utf8(vm.manifestString(LocationRange("During manifestation")));
+        return encode_utf8(vm.manifestString(during_manifestation()));
     } else {
-        return encode_utf8(vm.manifestJson(LocationRange("During manifestation"), true, U""));
+        return vm.manifestJson(during_manifestation(), true);
     }
 }
 
-StrMap jsonnet_vm_execute_multi(Allocator *alloc, const AST *ast, const ExtMap &ext_vars,
+StrMap jsonnet_vm_execute_multi(Allocator *alloc, const AST *ast,
+                                const std::vector<const AST*> &imports, const ExtMap &ext_vars,
                                 unsigned max_stack, double gc_min_objects, double gc_growth_trigger,
                                 JsonnetImportCallback *import_callback, void *ctx,
-                                bool string_output)
+                                JsonnetImportBatchCallback *import_batch_callback,
+                                void *batch_ctx, unsigned import_threads,
+                                const std::string &cache_dir, bool string_output,
+                                bool compat_numbers)
 {
     Interpreter vm(alloc, ext_vars, max_stack, gc_min_objects, gc_growth_trigger,
-                   import_callback, ctx);
+                   import_callback, ctx, import_batch_callback, batch_ctx, import_threads,
+                   cache_dir, compat_numbers);
+    vm.prefetchImports(imports);
     vm.evaluate(ast, 0);
     return vm.manifestMulti(string_output);
 }
@@ -56,22 +56,32 @@ struct VmExt {
  *
  * \param alloc The allocator used to create the ast.
  * \param ast The program to execute.
+ * \param imports The Import and Importstr ASTs of the program, from jsonnet_static_analysis.
  * \param ext The external vars / code.
  * \param max_stack Recursion beyond this level gives an error.
  * \param gc_min_objects The garbage collector does not run when the heap is this small.
  * \param gc_growth_trigger Growth since last garbage collection cycle to trigger a new cycle.
  * \param import_callback A callback to handle imports
  * \param import_callback_ctx Context param for the import callback.
+ * \param import_batch_callback A callback to load many imports at once, or nullptr.
+ * \param import_batch_callback_ctx Context param for the batch import callback.
+ * \param import_threads How many threads load and parse imports ahead of evaluation.
+ * \param cache_dir Where to cache the parsed imports, see jsonnet_parse_cached, or "" for none.
  * \param output_string Whether to expect a string and output it without JSON encoding
+ * \param compat_numbers Whether to output numbers exactly as earlier versions did
  * \throws RuntimeError reports runtime errors in the program.
  * \returns The JSON result in string form.
  */
 std::string jsonnet_vm_execute(Allocator *alloc, const AST *ast,
+                               const std::vector<const AST*> &imports,
                                const std::map<std::string, VmExt> &ext,
                                unsigned max_stack, double gc_min_objects,
                                double gc_growth_trigger,
                                JsonnetImportCallback *import_callback, void *import_callback_ctx,
-                               bool string_output);
+                               JsonnetImportBatchCallback *import_batch_callback,
+                               void *import_batch_callback_ctx, unsigned import_threads,
+                               const std::string &cache_dir, bool string_output,
+                               bool compat_numbers);
 
 /** Execute the program and return the value as a number of JSON files.
  *
@@ -79,20 +89,29 @@ std::string jsonnet_vm_execute(Allocator *alloc, const AST *ast,
  *
  * \param alloc The allocator used to create the ast.
  * \param ast The program to execute.
+ * \param imports The Import and Importstr ASTs of the program, from jsonnet_static_analysis.
  * \param ext The external vars / code.
  * \param max_stack Recursion beyond this level gives an error.
  * \param gc_min_objects The garbage collector does not run when the heap is this small.
  * \param gc_growth_trigger Growth since last garbage collection cycle to trigger a new cycle.
  * \param import_callback A callback to handle imports
  * \param import_callback_ctx Context param for the import callback.
+ * \param import_batch_callback A callback to load many imports at once, or nullptr.
+ * \param import_batch_callback_ctx Context param for the batch import callback.
+ * \param import_threads How many threads load and parse imports ahead of evaluation.
+ * \param cache_dir Where to cache the parsed imports, see jsonnet_parse_cached, or "" for none.
  * \param output_string Whether to expect a string and output it without JSON encoding
+ * \param compat_numbers Whether to output numbers exactly as earlier versions did
  * \throws RuntimeError reports runtime errors in the program.
  * \returns A mapping from filename to the JSON strings for that file.
  */
 std::map<std::string, std::string> jsonnet_vm_execute_multi(
-    Allocator *alloc, const AST *ast, const std::map<std::string, VmExt> &ext,
+    Allocator *alloc, const AST *ast, const std::vector<const AST*> &imports,
+    const std::map<std::string, VmExt> &ext,
     unsigned max_stack, double gc_min_objects, double gc_growth_trigger,
     JsonnetImportCallback *import_callback, void *import_callback_ctx,
-    bool string_output);
+    JsonnetImportBatchCallback *import_batch_callback, void *import_batch_callback_ctx,
+    unsigned import_threads, const std::string &cache_dir, bool string_output,
+    bool compat_numbers);
 
 #endif
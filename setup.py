@@ -20,10 +20,16 @@ from subprocess import Popen
 
 DIR = os.path.abspath(os.path.dirname(__file__))
 LIB_OBJECTS = [
+    'core/constant_folding.o',
+    'core/hash.o',
+    'core/json.o',
     'core/libjsonnet.o',
     'core/lexer.o',
+    'core/number.o',
+    'core/parse_cache.o',
     'core/parser.o',
     'core/static_analysis.o',
+    'core/strictness_analysis.o',
     'core/vm.o'
 ]
 
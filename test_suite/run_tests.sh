@@ -39,7 +39,7 @@ for TEST in *.jsonnet ; do
     if [ -r "$TEST.golden_regex" ] ; then
         GOLDEN_REGEX=$(cat "$TEST.golden_regex")
     fi
-    OUTPUT="$($VALGRIND ../jsonnet $PARAMS --var var1=test --code-var var2='{x:1, y: 2}' "$TEST" 2>&1 )"
+    OUTPUT="$($VALGRIND ../jsonnet $PARAMS --var var1=test --code-var var2='{x:1, y: 2}' --code-var var3='{"z": [1, {"w": null}]}' "$TEST" 2>&1 )"
     EXIT_CODE=$?
     if [ $EXIT_CODE -ne $EXPECTED_EXIT_CODE ] ; then
         FAILED=$((FAILED + 1))